@@ -73,13 +73,13 @@ fi
 
 # --- delete state file before start unless KEEP_STATE ---
 if [[ "$KEEP_STATE" -eq 0 && -f "$STATE_FILE" ]]; then
-  rm -f -- "$STATE_FILE"
+  rm -f -- "$STATE_FILE" "$STATE_FILE.journal"
 fi
 
 # --- delete state file after run unless KEEP_STATE ---
 cleanup() {
   if [[ "$KEEP_STATE" -eq 0 ]]; then
-    rm -f -- "$STATE_FILE"
+    rm -f -- "$STATE_FILE" "$STATE_FILE.journal"
   fi
 }
 trap cleanup EXIT
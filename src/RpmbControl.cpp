@@ -0,0 +1,200 @@
+#include "RpmbControl.h"
+
+#include <cstring>
+#include <cerrno>
+#include <sstream>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "Rpmbd.h"
+#include "RpmbLog.h"
+
+namespace {
+
+const size_t MAX_CLIENTS = 16;
+const size_t MAX_LINE = 1024;
+const int SEND_TIMEOUT_MS = 1000;  // a client that stops reading is dropped
+
+bool SendAll(int fd, const std::string& s) {
+    const char* p = s.data();
+    size_t len = s.size();
+    while (len > 0) {
+        ssize_t n = ::send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        p += n;
+        len -= size_t(n);
+    }
+    return true;
+}
+
+} // namespace
+
+// ----------------------------------------------------------------------
+
+bool RpmbControl::Start() {
+    sockaddr_un sa{};
+    sa.sun_family = AF_UNIX;
+    if (opt_.socketPath.empty() || opt_.socketPath.size() >= sizeof(sa.sun_path)) {
+        RPMB_LOG(RpmbLog::Error, "[rpmbd] control socket path invalid: '%s'", opt_.socketPath.c_str());
+        return false;
+    }
+    std::memcpy(sa.sun_path, opt_.socketPath.c_str(), opt_.socketPath.size() + 1);
+
+    listenFd_ = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    ::unlink(opt_.socketPath.c_str());
+    if (listenFd_ < 0 ||
+        ::bind(listenFd_, reinterpret_cast<sockaddr*>(&sa), sizeof(sa)) != 0 ||
+        ::listen(listenFd_, 8) != 0) {
+        RPMB_LOG(RpmbLog::Error, "[rpmbd] control socket '%s': %s",
+                 opt_.socketPath.c_str(), std::strerror(errno));
+        if (listenFd_ >= 0) ::close(listenFd_);
+        listenFd_ = -1;
+        return false;
+    }
+
+    if (::pipe2(wakeFd_, O_CLOEXEC) != 0) {
+        RPMB_LOG(RpmbLog::Error, "[rpmbd] control: pipe: %s", std::strerror(errno));
+        Stop();
+        return false;
+    }
+
+    thread_ = std::thread([this] { Loop(); });
+    return true;
+}
+
+void RpmbControl::Stop() {
+    if (thread_.joinable()) {
+        const char c = 0;
+        ssize_t n = ::write(wakeFd_[1], &c, 1);
+        (void)n;
+        thread_.join();
+    }
+    for (int& fd : wakeFd_) {
+        if (fd >= 0) ::close(fd);
+        fd = -1;
+    }
+    if (listenFd_ >= 0) {
+        ::close(listenFd_);
+        ::unlink(opt_.socketPath.c_str());
+        listenFd_ = -1;
+    }
+}
+
+void RpmbControl::Loop() {
+    std::vector<Client> clients;
+
+    for (;;) {
+        std::vector<pollfd> p;
+        p.push_back({ wakeFd_[0], POLLIN, 0 });
+        p.push_back({ listenFd_, short(clients.size() < MAX_CLIENTS ? POLLIN : 0), 0 });
+        for (const Client& c : clients) p.push_back({ c.fd, POLLIN, 0 });
+
+        if (::poll(p.data(), p.size(), -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (p[0].revents) break;
+
+        // Clients first: indices in p match clients until one is removed
+        for (size_t i = clients.size(); i-- > 0; ) {
+            if (!p[2 + i].revents) continue;
+            if (!Serve(clients[i])) {
+                ::close(clients[i].fd);
+                clients.erase(clients.begin() + long(i));
+            }
+        }
+
+        if (p[1].revents & POLLIN) {
+            int fd = ::accept4(listenFd_, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd >= 0) {
+                // One thread serves all clients: a reply must not block it
+                const timeval tv{ SEND_TIMEOUT_MS / 1000, (SEND_TIMEOUT_MS % 1000) * 1000 };
+                ::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+                clients.push_back(Client{ fd, std::string() });
+            }
+        }
+    }
+
+    for (Client& c : clients) ::close(c.fd);
+}
+
+// Reads what arrived and answers every complete line; false once the
+// client is gone (or misbehaves)
+bool RpmbControl::Serve(Client& c) {
+    char buf[512];
+    ssize_t n = ::recv(c.fd, buf, sizeof(buf), MSG_DONTWAIT);
+    if (n < 0 && (errno == EINTR || errno == EAGAIN)) return true;
+    if (n <= 0) return false;
+    c.in.append(buf, size_t(n));
+
+    size_t eol;
+    while ((eol = c.in.find('\n')) != std::string::npos) {
+        std::string line = c.in.substr(0, eol);
+        c.in.erase(0, eol + 1);
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (line.empty()) continue;
+        if (!SendAll(c.fd, Execute(line) + "\n")) return false;
+    }
+    return c.in.size() <= MAX_LINE;
+}
+
+Rpmbd* RpmbControl::Find(const std::string& devName, std::string& err) {
+    if (devName.empty()) {
+        if (devs_.size() == 1) return devs_[0].second;
+        err = "device name required";
+        return nullptr;
+    }
+    for (auto& d : devs_)
+        if (d.first == devName) return d.second;
+    err = "no device '" + devName + "'";
+    return nullptr;
+}
+
+std::string RpmbControl::Execute(const std::string& line) {
+    std::istringstream in(line);
+    std::string cmd, name, dev, extra;
+    in >> cmd;
+
+    const bool named = (cmd == "snapshot" || cmd == "restore" || cmd == "delete");
+    if (named && !(in >> name)) return "ERR " + cmd + ": name required";
+    in >> dev;
+    if (in >> extra) return "ERR too many arguments";
+
+    // Daemon-wide, e.g. to switch debug logging on while a problem shows
+    if (cmd == "log-level") {
+        if (!dev.empty()) {
+            RpmbLog::Level level;
+            if (!RpmbLog::ParseLevel(dev, level)) return "ERR unknown log level '" + dev + "'";
+            RpmbLog::SetLevel(level);
+            RPMB_LOG(RpmbLog::Info, "[rpmbd] control: %s -> OK", line.c_str());
+        }
+        return std::string("OK ") + RpmbLog::LevelName(RpmbLog::GetLevel());
+    }
+
+    if (!named && cmd != "reset" && cmd != "list") return "ERR unknown command '" + cmd + "'";
+
+    std::string err;
+    Rpmbd* core = Find(dev, err);
+    if (!core) return "ERR " + err;
+
+    bool ok = true;
+    if (cmd == "snapshot") ok = core->TakeSnapshot(name, err);
+    else if (cmd == "restore") ok = core->RestoreSnapshot(name, err);
+    else if (cmd == "delete") ok = core->DeleteSnapshot(name, err);
+    else if (cmd == "reset") ok = core->Reset(err);
+    else {
+        std::string reply = "OK";
+        for (const std::string& s : core->ListSnapshots()) reply += " " + s;
+        return reply;
+    }
+
+    RPMB_LOG(ok ? RpmbLog::Info : RpmbLog::Error, "[rpmbd] control: %s -> %s",
+             line.c_str(), ok ? "OK" : err.c_str());
+    return ok ? "OK" : "ERR " + err;
+}
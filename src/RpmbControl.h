@@ -0,0 +1,57 @@
+#pragma once
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+class Rpmbd;
+
+// Control socket for test harnesses: snapshots and resets devices in place,
+// without restarting the daemon. Text protocol, one request per line and
+// one reply line each ("OK[ <info>]" or "ERR <reason>"):
+//
+//   snapshot <name> [<dev>]   save key, write counter and storage as <name>
+//   restore <name> [<dev>]    roll back to <name> (it is kept)
+//   delete <name> [<dev>]     drop <name>
+//   reset [<dev>]             factory state, as with a new state file
+//   list [<dev>]              "OK <name>:<write counter> ..."
+//   log-level [<level>]       "OK <level>": sets the daemon's log level (see
+//                             RpmbLog::ParseLevel), or only reports it
+//
+// <dev> (name under /dev) may be omitted while only one device is served.
+// Clients may keep the connection open for many requests. Runs one
+// background thread.
+class RpmbControl {
+public:
+    struct Options {
+        std::string socketPath;
+    };
+
+    explicit RpmbControl(const Options& opt) : opt_(opt) {}
+    ~RpmbControl() { Stop(); }
+
+    // core must outlive Stop()
+    void Add(const std::string& devName, Rpmbd& core) { devs_.emplace_back(devName, &core); }
+
+    bool Start();
+    void Stop();
+
+    // Runs one request line, returns the reply (without newline)
+    std::string Execute(const std::string& line);
+
+private:
+    struct Client {
+        int fd;
+        std::string in;     // bytes received, not yet a full line
+    };
+
+    Options opt_;
+    std::vector<std::pair<std::string, Rpmbd*>> devs_;
+    int listenFd_ = -1;
+    int wakeFd_[2] = { -1, -1 };
+    std::thread thread_;
+
+    void Loop();
+    bool Serve(Client& c);
+    Rpmbd* Find(const std::string& devName, std::string& err);
+};
@@ -1,5 +1,6 @@
 #define FUSE_USE_VERSION 31
 #include "RpmbCuseDevice.h"
+#include "RpmbCusePool.h"
 
 #include <fuse3/cuse_lowlevel.h>
 
@@ -16,48 +17,30 @@
 #include <vector>
 #include <cstdint>
 #include <algorithm>
-#include <ctime>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <queue>
+#include <thread>
 
 #include "Rpmbd.h"
 #include "RpmbFrame.h"
+#include "RpmbLog.h"
+#include "RpmbMetrics.h"
+#include "RpmbSpans.h"
+#include "RpmbTrace.h"     // RpmbMonotonicNs()
 
 // ------------------------------------------------------------
-// Debug helpers
+// Debug helpers (records go through the async logger, see RpmbLog.h)
 // ------------------------------------------------------------
-static bool gRpmbDebug = true;
-
-static void DbgTs() {
-    if (!gRpmbDebug) return;
-    std::time_t t = std::time(nullptr);
-    std::tm tm{};
-    localtime_r(&t, &tm);
-    std::fprintf(stderr, "%02d:%02d:%02d ", tm.tm_hour, tm.tm_min, tm.tm_sec);
-}
+#define DBG(fmt, ...) RPMB_LOG(RpmbLog::Debug, "[rpmb-cuse] " fmt, ##__VA_ARGS__)
 
-#define DBG(fmt, ...) do { \
-    if (gRpmbDebug) { \
-        DbgTs(); \
-        std::fprintf(stderr, "[rpmb-cuse] " fmt "\n", ##__VA_ARGS__); \
-        std::fflush(stderr); \
-    } \
-} while(0)
-
-static void HexDump(const char* title, const void* data, size_t len, size_t maxLen = 256) {
-    if (!gRpmbDebug) return;
-    const uint8_t* p = reinterpret_cast<const uint8_t*>(data);
-    size_t n = std::min(len, maxLen);
-
-    DbgTs();
-    std::fprintf(stderr, "[rpmb-cuse] %s (%zu bytes, showing %zu)\n", title, len, n);
-    for (size_t i = 0; i < n; i += 16) {
-        DbgTs();
-        std::fprintf(stderr, "  %04zx: ", i);
-        for (size_t j = 0; j < 16 && (i + j) < n; ++j)
-            std::fprintf(stderr, "%02x ", p[i + j]);
-        std::fprintf(stderr, "\n");
-    }
-    std::fflush(stderr);
-}
+#define ERR(fmt, ...) RPMB_LOG(RpmbLog::Error, "[rpmb-cuse] " fmt, ##__VA_ARGS__)
+
+// Only copies the bytes; the dump is formatted by the log writer
+#define HexDump(title, data, len) RPMB_HEX(RpmbLog::Debug, "[rpmb-cuse] " title, data, len)
 
 static const char* ErrStr() {
     return std::strerror(errno);
@@ -66,20 +49,129 @@ static const char* ErrStr() {
 // ------------------------------------------------------------
 // process_vm helpers (read/write caller buffers)
 // ------------------------------------------------------------
-static bool ReadFromPid(pid_t pid, uint64_t remoteAddr, void* local, size_t len) {
+
+// Reads up to len bytes; returns the number read (short at an unmapped page)
+static ssize_t ReadFromPidPartial(pid_t pid, uint64_t remoteAddr, void* local, size_t len) {
     struct iovec liov { local, len };
     struct iovec riov { (void*)(uintptr_t)remoteAddr, len };
-    ssize_t n = process_vm_readv(pid, &liov, 1, &riov, 1, 0);
+    return process_vm_readv(pid, &liov, 1, &riov, 1, 0);
+}
+
+// Gathers all remote ranges into one contiguous local buffer (one syscall)
+static bool ReadvFromPid(pid_t pid, const struct iovec* remote, size_t count,
+                         void* local, size_t len) {
+    struct iovec liov { local, len };
+    ssize_t n = process_vm_readv(pid, &liov, 1, remote, count, 0);
     return (n == (ssize_t)len);
 }
 
-static bool WriteToPid(pid_t pid, uint64_t remoteAddr, const void* local, size_t len) {
+// Scatters one contiguous local buffer to all remote ranges (one syscall)
+static bool WritevToPid(pid_t pid, const struct iovec* remote, size_t count,
+                        const void* local, size_t len) {
     struct iovec liov { (void*)local, len };
-    struct iovec riov { (void*)(uintptr_t)remoteAddr, len };
-    ssize_t n = process_vm_writev(pid, &liov, 1, &riov, 1, 0);
+    ssize_t n = process_vm_writev(pid, &liov, 1, remote, count, 0);
     return (n == (ssize_t)len);
 }
 
+// Chain data left in the caller's memory: the core pulls CMD25 payloads and
+// pushes CMD18 responses piece by piece (large bursts only)
+class CuseChainIo : public Rpmbd::ChainIo {
+public:
+    CuseChainIo(pid_t pid, const mmc_ioc_cmd* cmds) : pid_(pid), cmds_(cmds) {}
+
+    uint8_t* Map(size_t, size_t, size_t) override { return nullptr; }
+
+    bool Read(size_t cmd, size_t off, uint8_t* dst, size_t len) override {
+        return ReadFromPidPartial(pid_, cmds_[cmd].data_ptr + off, dst, len) == (ssize_t)len;
+    }
+
+    bool Write(size_t cmd, size_t off, const uint8_t* src, size_t len) override {
+        struct iovec liov { (void*)src, len };
+        struct iovec riov { (void*)(uintptr_t)(cmds_[cmd].data_ptr + off), len };
+        return process_vm_writev(pid_, &liov, 1, &riov, 1, 0) == (ssize_t)len;
+    }
+
+private:
+    pid_t pid_;
+    const mmc_ioc_cmd* cmds_;
+};
+
+// Per-thread transfer buffer for CMD25/CMD18 data, grown on demand and
+// reused by every ioctl on this thread (chains up to MAX_STAGED only)
+static uint8_t* XferArena(size_t len) {
+    thread_local std::vector<uint8_t> arena;
+    if (arena.size() < len) arena.resize(len);
+    return arena.data();
+}
+
+// Holds ioctl replies back until the timing model's completion time, so no
+// worker thread sleeps on a slow chain
+class ReplyTimer {
+public:
+    ~ReplyTimer() { Stop(); }
+
+    void Start() {
+        if (!thread_.joinable()) thread_ = std::thread(&ReplyTimer::Loop, this);
+    }
+
+    // Sends what is still held right away
+    void Stop() {
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            stop_ = true;
+        }
+        cv_.notify_one();
+        if (thread_.joinable()) thread_.join();
+        stop_ = false;
+    }
+
+    bool Running() const { return thread_.joinable(); }
+
+    void Add(uint64_t dueNs, fuse_req_t req) {
+        bool first;
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            first = q_.empty() || dueNs < q_.top().due;
+            q_.push(Entry{ dueNs, req });
+        }
+        if (first) cv_.notify_one();
+    }
+
+private:
+    struct Entry {
+        uint64_t due;
+        fuse_req_t req;
+        bool operator>(const Entry& o) const { return due > o.due; }
+    };
+
+    std::mutex mu_;
+    std::condition_variable cv_;
+    std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> q_;   // mu_
+    bool stop_ = false;                                                       // mu_
+    std::thread thread_;
+
+    void Loop() {
+        std::unique_lock<std::mutex> lk(mu_);
+        for (;;) {
+            if (q_.empty()) {
+                if (stop_) return;
+                cv_.wait(lk);
+                continue;
+            }
+            // steady_clock is CLOCK_MONOTONIC, like RpmbMonotonicNs()
+            const Entry e = q_.top();
+            if (!stop_ && e.due > RpmbMonotonicNs()) {
+                cv_.wait_until(lk, std::chrono::steady_clock::time_point(std::chrono::nanoseconds(e.due)));
+                continue;
+            }
+            q_.pop();
+            lk.unlock();
+            fuse_reply_ioctl(e.req, 0, nullptr, 0);
+            lk.lock();
+        }
+    }
+};
+
 // ------------------------------------------------------------
 // Internal implementation
 // ------------------------------------------------------------
@@ -90,8 +182,24 @@ public:
 
     Rpmbd& core_;
     Options opt_;
+    std::atomic<uint32_t> nextSession_{1};
+    fuse_session* se_ = nullptr;        // Open() only
+    ReplyTimer replies_;                // with a timing model only
+
+    // Arguments for cuse_lowlevel_setup()
+    struct Args {
+        char devarg[256];
+        const char* devinfo[2];
+        struct cuse_info ci;
+        char arg0[6] = "rpmbd";
+        char argF[3] = "-f";
+        char* argv[3];
+        int argc;
+    };
+    void MakeArgs(Args& a, bool foreground) const;
 
     static void cb_open(fuse_req_t req, struct fuse_file_info* fi);
+    static void cb_release(fuse_req_t req, struct fuse_file_info* fi);
     static void cb_read(fuse_req_t req, size_t size, off_t off, struct fuse_file_info* fi);
     static void cb_write(fuse_req_t req, const char* buf, size_t size, off_t off, struct fuse_file_info* fi);
     static void cb_ioctl(fuse_req_t req, int cmd, void* arg,
@@ -104,6 +212,23 @@ public:
         return static_cast<Impl*>(fuse_req_userdata(req));
     }
 
+    // Per-open request/response state, owned via fi->fh
+    static Rpmbd::Session* session(struct fuse_file_info* fi) {
+        return fi ? reinterpret_cast<Rpmbd::Session*>(static_cast<uintptr_t>(fi->fh)) : nullptr;
+    }
+
+    // Limits of one MULTI_CMD: commands per chain (as the kernel's
+    // MMC_IOC_MAX_CMDS), data per command (block count is 16 bit in RPMB
+    // frames)
+    static const size_t MAX_CMDS = 255;
+    static const size_t MAX_CMD_DATA = size_t(0xFFFF) * RPMB_FRAME_SIZE;
+
+    // Commands fetched with the header; longer lists take a second read
+    static const size_t FIRST_CMDS = 16;
+
+    // Chains with more data than this are streamed instead of staged
+    static const size_t MAX_STAGED = 256 * 1024;
+
     static size_t CmdDataLen(const mmc_ioc_cmd& c) {
         return size_t(c.blocks) * size_t(c.blksz);
     }
@@ -118,6 +243,34 @@ public:
             (int)ctx->pid, (unsigned)ctx->uid, (unsigned)ctx->gid, (unsigned)ctx->umask);
     }
 
+    static void ReplyIoctlErr(fuse_req_t req, int err) {
+        RpmbMetrics::CountIoctl(false);
+        fuse_reply_err(req, err);
+    }
+
+    // Success, once the device is done with the chain (timing model)
+    void ReplyIoctlOk(fuse_req_t req, uint64_t readyAtNs) {
+        if (readyAtNs && replies_.Running() && readyAtNs > RpmbMonotonicNs())
+            replies_.Add(readyAtNs, req);
+        else
+            fuse_reply_ioctl(req, 0, nullptr, 0);
+    }
+
+    // ioctl stages feed both the metrics histograms and the spans; 0 if
+    // neither is enabled
+    static uint64_t StageNow() {
+        return (RpmbMetrics::Enabled() || RpmbSpans::Enabled()) ? RpmbMonotonicNs() : 0;
+    }
+
+    // Records the stage begun at t0 (if timed); returns the end time
+    static uint64_t StageDone(RpmbMetrics::Stage stage, uint64_t t0) {
+        if (!t0) return 0;
+        const uint64_t t1 = RpmbMonotonicNs();
+        RpmbMetrics::RecordStage(stage, t1 - t0);
+        RpmbSpans::Record(RpmbMetrics::StageName(stage), t0, t1);
+        return t1;
+    }
+
     static void DumpMmcCmd(const char* prefix, const mmc_ioc_cmd& c) {
         DBG("%s opcode=%u arg=0x%x blocks=%u blksz=%u flags=0x%x data_ptr=0x%llx",
             prefix,
@@ -130,6 +283,7 @@ const struct cuse_lowlevel_ops RpmbCuseDevice::Impl::ops = []{
     struct cuse_lowlevel_ops o;
     std::memset(&o, 0, sizeof(o));
     o.open  = RpmbCuseDevice::Impl::cb_open;
+    o.release = RpmbCuseDevice::Impl::cb_release;
     o.read  = RpmbCuseDevice::Impl::cb_read;
     o.write = RpmbCuseDevice::Impl::cb_write;
     o.ioctl = RpmbCuseDevice::Impl::cb_ioctl;
@@ -140,10 +294,21 @@ const struct cuse_lowlevel_ops RpmbCuseDevice::Impl::ops = []{
 // FUSE callbacks
 // ------------------------------------------------------------
 void RpmbCuseDevice::Impl::cb_open(fuse_req_t req, struct fuse_file_info* fi) {
-    DBG("open()");
+    Rpmbd::Session* s = new Rpmbd::Session();
+    if (Impl* impl = self(req)) s->id = impl->nextSession_.fetch_add(1);
+    fi->fh = static_cast<uint64_t>(reinterpret_cast<uintptr_t>(s));
+    DBG("open() -> session=%p id=%u", (void*)s, s->id);
     fuse_reply_open(req, fi);
 }
 
+void RpmbCuseDevice::Impl::cb_release(fuse_req_t req, struct fuse_file_info* fi) {
+    Rpmbd::Session* s = session(fi);
+    DBG("release() session=%p", (void*)s);
+    delete s;
+    fi->fh = 0;
+    fuse_reply_err(req, 0);
+}
+
 void RpmbCuseDevice::Impl::cb_read(fuse_req_t req, size_t, off_t, struct fuse_file_info*) {
     DBG("read() -> EOPNOTSUPP");
     fuse_reply_err(req, EOPNOTSUPP);
@@ -158,20 +323,29 @@ void RpmbCuseDevice::Impl::cb_write(fuse_req_t req, const char*, size_t, off_t,
 // IOCTL handler (mmc-utils uses MMC_IOC_MULTI_CMD)
 // ------------------------------------------------------------
 void RpmbCuseDevice::Impl::cb_ioctl(fuse_req_t req, int cmd, void* arg,
-                                   struct fuse_file_info*,
+                                   struct fuse_file_info* fi,
                                    unsigned,
                                    const void* in_buf, size_t in_bufsz,
                                    size_t out_bufsz)
 {
     Impl* impl = self(req);
     if (!impl) {
-        DBG("ERROR: missing userdata -> EIO");
-        fuse_reply_err(req, EIO);
+        ERR("ERROR: missing userdata -> EIO");
+        ReplyIoctlErr(req, EIO);
+        return;
+    }
+
+    Rpmbd::Session* sess = session(fi);
+    if (!sess) {
+        ERR("ERROR: ioctl without open session -> EBADF");
+        ReplyIoctlErr(req, EBADF);
         return;
     }
 
     LogFuseCtx(req);
 
+    const uint64_t mt0 = StageNow();
+
     const fuse_ctx* fctx = fuse_req_ctx(req);
     pid_t pid = fctx ? fctx->pid : -1;
 
@@ -183,181 +357,221 @@ void RpmbCuseDevice::Impl::cb_ioctl(fuse_req_t req, int cmd, void* arg,
     // Read full structs from the caller process memory instead.
 
     if (!arg || pid <= 0) {
-        DBG("ERROR: arg null or pid invalid");
-        fuse_reply_err(req, EINVAL);
+        ERR("ERROR: arg null or pid invalid");
+        ReplyIoctlErr(req, EINVAL);
         return;
     }
 
-    mmc_ioc_multi_cmd hdr{};
-    if (!ReadFromPid(pid, (uint64_t)(uintptr_t)arg, &hdr, sizeof(hdr))) {
-        DBG("ERROR: cannot read multi_cmd header pid=%d addr=%p (%s)", pid, arg, ErrStr());
-        fuse_reply_err(req, EIO);
+    // Header + the first FIRST_CMDS commands in one read. The caller's
+    // struct may be shorter than that, so a short read is fine as long as
+    // it covers num_of_cmds.
+    alignas(mmc_ioc_multi_cmd) uint8_t cmdblob[sizeof(mmc_ioc_multi_cmd) + MAX_CMDS * sizeof(mmc_ioc_cmd)];
+    ssize_t got = ReadFromPidPartial(pid, (uint64_t)(uintptr_t)arg, cmdblob,
+                                     sizeof(mmc_ioc_multi_cmd) + FIRST_CMDS * sizeof(mmc_ioc_cmd));
+    if (got < (ssize_t)sizeof(mmc_ioc_multi_cmd)) {
+        ERR("ERROR: cannot read multi_cmd header pid=%d addr=%p (%s)", pid, arg, ErrStr());
+        ReplyIoctlErr(req, EIO);
         return;
     }
 
-    DBG("multi_cmd header: num_of_cmds=%llu", (unsigned long long)hdr.num_of_cmds);
+    const mmc_ioc_multi_cmd* full =
+        reinterpret_cast<const mmc_ioc_multi_cmd*>(cmdblob);
+    const mmc_ioc_cmd* cmds = full->cmds;
+    const unsigned long long numCmds = full->num_of_cmds;
+
+    DBG("multi_cmd header: num_of_cmds=%llu", numCmds);
 
-    if (hdr.num_of_cmds == 0 || hdr.num_of_cmds > 16) {
-        DBG("ERROR: suspicious num_of_cmds=%llu -> EINVAL", (unsigned long long)hdr.num_of_cmds);
-        fuse_reply_err(req, EINVAL);
+    if (numCmds == 0 || numCmds > MAX_CMDS) {
+        ERR("ERROR: suspicious num_of_cmds=%llu -> EINVAL", numCmds);
+        ReplyIoctlErr(req, EINVAL);
         return;
     }
 
     const size_t cmdlist_len =
-        sizeof(mmc_ioc_multi_cmd) + hdr.num_of_cmds * sizeof(mmc_ioc_cmd);
+        sizeof(mmc_ioc_multi_cmd) + numCmds * sizeof(mmc_ioc_cmd);
 
-    std::vector<uint8_t> cmdblob(cmdlist_len);
-    if (!ReadFromPid(pid, (uint64_t)(uintptr_t)arg, cmdblob.data(), cmdblob.size())) {
-        DBG("ERROR: cannot read full cmdlist len=%zu pid=%d (%s)", cmdlist_len, pid, ErrStr());
-        fuse_reply_err(req, EIO);
+    if (got < (ssize_t)cmdlist_len && numCmds > FIRST_CMDS)
+        got = ReadFromPidPartial(pid, (uint64_t)(uintptr_t)arg, cmdblob, cmdlist_len);
+
+    if (got < (ssize_t)cmdlist_len) {
+        ERR("ERROR: cannot read full cmdlist len=%zu pid=%d (%s)", cmdlist_len, pid, ErrStr());
+        ReplyIoctlErr(req, EIO);
         return;
     }
 
-    const mmc_ioc_multi_cmd* full =
-        reinterpret_cast<const mmc_ioc_multi_cmd*>(cmdblob.data());
-    const mmc_ioc_cmd* cmds = full->cmds;
-
-    DBG("cmdlist read OK (len=%zu)", cmdblob.size());
-
-    for (unsigned long long i = 0; i < full->num_of_cmds; ++i) {
-        DumpMmcCmd("cmd", cmds[i]);
-    }
+    DBG("cmdlist read OK (len=%zu)", cmdlist_len);
+    uint64_t mt = StageDone(RpmbMetrics::STAGE_CMDLIST_READ, mt0);
 
-    // Expected RPMB chain:
-    // CMD23 (set block count)
-    // CMD25 (write request frames)
-    // CMD18 (read response frames)
-    // CMD12 (stop)
+    // Validate the chain and lay out all data in one arena: CMD25 payloads
+    // first, then CMD18 responses. Like the kernel, all write data is copied
+    // in before the chain runs and all read data copied out afterwards.
+    struct iovec inIov[MAX_CMDS], outIov[MAX_CMDS];
+    Rpmbd::MmcCmd chain[MAX_CMDS];
+    size_t nIn = 0, nOut = 0, inLen = 0, outLen = 0;
 
-    bool haveRead = false;
-    for (unsigned long long i = 0; i < full->num_of_cmds; ++i) {
+    for (unsigned long long i = 0; i < numCmds; ++i) {
         const mmc_ioc_cmd& c = cmds[i];
-        size_t dlen = CmdDataLen(c);
+        const size_t dlen = CmdDataLen(c);
+        DumpMmcCmd("cmd", c);
 
-        DBG("exec cmd[%llu]: opcode=%u dlen=%zu", i, c.opcode, dlen);
+        chain[i].opcode = c.opcode;
+        chain[i].blocks = c.blocks;
+        chain[i].dataLen = 0;
 
-        if (c.opcode == 23) {
-            DBG("CMD23: ignore");
-            continue;
-        }
-
-        if (c.opcode == 25) {
-            if (dlen == 0 || c.data_ptr == 0) {
-                DBG("ERROR: CMD25 missing payload dlen=%zu data_ptr=0x%llx",
-                    dlen, (unsigned long long)c.data_ptr);
-                fuse_reply_err(req, EIO);
-                return;
-            }
-
-            std::vector<uint8_t> payload(dlen);
-            if (!ReadFromPid(pid, c.data_ptr, payload.data(), payload.size())) {
-                DBG("ERROR: cannot read CMD25 payload pid=%d ptr=0x%llx len=%zu (%s)",
-                    pid, (unsigned long long)c.data_ptr, dlen, ErrStr());
-                fuse_reply_err(req, EIO);
-                return;
-            }
-
-            auto be16 = [](const uint8_t* p) {
-                return (uint16_t(p[0]) << 8) | uint16_t(p[1]);
-            };
+        if (c.opcode == 23 || c.opcode == 12) continue;
 
-            uint16_t reqresp = be16(payload.data() + OFF_REQRESP);
-            uint16_t addr    = be16(payload.data() + OFF_ADDR);
-            uint16_t cnt     = be16(payload.data() + OFF_BLOCK_COUNT);
-
-            DBG("CMD25 decoded: reqresp=0x%04x addr=%u cnt=%u", reqresp, addr, cnt);
-            HexDump("CMD25 request frames", payload.data(), payload.size(), 256);
+        if (c.opcode != 25 && c.opcode != 18) {
+            ERR("ERROR: unsupported opcode=%u -> EIO", c.opcode);
+            ReplyIoctlErr(req, EIO);
+            return;
+        }
 
-            impl->core_.HandleWriteRequestFrames(payload.data(), payload.size());
-            DBG("core write done");
-            continue;
+        if (dlen == 0 || c.data_ptr == 0 || dlen > MAX_CMD_DATA) {
+            ERR("ERROR: CMD%u bad buffer dlen=%zu data_ptr=0x%llx",
+                c.opcode, dlen, (unsigned long long)c.data_ptr);
+            ReplyIoctlErr(req, EIO);
+            return;
         }
 
-        if (c.opcode == 18) {
-            if (dlen == 0 || c.data_ptr == 0) {
-                DBG("ERROR: CMD18 missing buffer dlen=%zu data_ptr=0x%llx",
-                    dlen, (unsigned long long)c.data_ptr);
-                fuse_reply_err(req, EIO);
-                return;
-            }
+        chain[i].dataLen = uint32_t(dlen);
 
-            // blkCnt = CMD18 blocks (fallback to dlen/512)
-            uint16_t blkCnt = (uint16_t)c.blocks;
-            if (blkCnt == 0) blkCnt = (uint16_t)(dlen / 512);
-            if (blkCnt == 0) blkCnt = 1;
+        struct iovec v { (void*)(uintptr_t)c.data_ptr, dlen };
+        if (c.opcode == 25) {
+            inIov[nIn++] = v;
+            inLen += dlen;
+        } else {
+            outIov[nOut++] = v;
+            outLen += dlen;
+        }
+    }
 
-            // Finalize pending read before fetching responses
-            if (impl->core_.HasPendingRead())
-                impl->core_.FinalizePendingRead(blkCnt);
+    // Large bursts go straight between the caller and the core, in pieces,
+    // so memory stays bounded
+    if (inLen + outLen > MAX_STAGED) {
+        CuseChainIo io(pid, cmds);
+        bool ok;
+        uint64_t readyAtNs;
+        {
+            std::lock_guard<std::mutex> sessLock(sess->mu);
+            ok = impl->core_.ExecuteChain(*sess, chain, numCmds, io);
+            readyAtNs = sess->readyAtNs;
+        }
+        StageDone(RpmbMetrics::STAGE_EXECUTE, mt);
 
-            std::vector<uint8_t> resp(dlen, 0);
-            impl->core_.ReadResponseFrames(resp.data(), resp.size());
+        if (!ok) {
+            ERR("ERROR: cannot transfer streamed chain pid=%d in=%zu out=%zu (%s)",
+                pid, inLen, outLen, ErrStr());
+            ReplyIoctlErr(req, EIO);
+            return;
+        }
 
-            DBG("core read -> %zu bytes", resp.size());
-            HexDump("CMD18 response frames", resp.data(), resp.size(), 256);
+        StageDone(RpmbMetrics::STAGE_IOCTL, mt0);
+        RpmbMetrics::CountIoctl(true);
 
-            if (!WriteToPid(pid, c.data_ptr, resp.data(), resp.size())) {
-                DBG("ERROR: cannot write resp pid=%d ptr=0x%llx len=%zu (%s)",
-                    pid, (unsigned long long)c.data_ptr, resp.size(), ErrStr());
-                fuse_reply_err(req, EIO);
-                return;
-            }
+        DBG("MULTI_CMD done (streamed) -> OK");
+        impl->ReplyIoctlOk(req, readyAtNs);
+        return;
+    }
 
-            DBG("CMD18 response written");
-            haveRead = true;
-            continue;
-        }
+    uint8_t* arena = XferArena(inLen + outLen);
 
-        if (c.opcode == 12) {
-            DBG("CMD12: ignore");
-            continue;
-        }
+    if (nIn && !ReadvFromPid(pid, inIov, nIn, arena, inLen)) {
+        ERR("ERROR: cannot read CMD25 payloads pid=%d n=%zu len=%zu (%s)",
+            pid, nIn, inLen, ErrStr());
+        ReplyIoctlErr(req, EIO);
+        return;
+    }
+    mt = StageDone(RpmbMetrics::STAGE_PAYLOAD_READ, mt);
+
+    // The whole chain runs against this open file's session; other opens
+    // proceed in parallel (the core locks its shared state itself).
+    uint64_t readyAtNs;
+    {
+        std::lock_guard<std::mutex> sessLock(sess->mu);
+        impl->core_.ExecuteChain(*sess, chain, numCmds, arena, arena + inLen);
+        readyAtNs = sess->readyAtNs;
+    }
+    mt = StageDone(RpmbMetrics::STAGE_EXECUTE, mt);
 
-        DBG("ERROR: unsupported opcode=%u -> EIO", c.opcode);
-        fuse_reply_err(req, EIO);
+    if (nOut && !WritevToPid(pid, outIov, nOut, arena + inLen, outLen)) {
+        ERR("ERROR: cannot write responses pid=%d n=%zu len=%zu (%s)",
+            pid, nOut, outLen, ErrStr());
+        ReplyIoctlErr(req, EIO);
         return;
     }
 
-    DBG("MULTI_CMD done haveRead=%d -> OK", haveRead ? 1 : 0);
-    fuse_reply_ioctl(req, 0, nullptr, 0);
+    StageDone(RpmbMetrics::STAGE_WRITEBACK, mt);
+    StageDone(RpmbMetrics::STAGE_IOCTL, mt0);
+    RpmbMetrics::CountIoctl(true);
+
+    DBG("MULTI_CMD done -> OK");
+    impl->ReplyIoctlOk(req, readyAtNs);
 }
 
 // ------------------------------------------------------------
 // RpmbCuseDevice (public)
 // ------------------------------------------------------------
 RpmbCuseDevice::RpmbCuseDevice(Rpmbd& core, const Options& opt)
-    : impl_(new Impl(core, opt))
-{
-    gRpmbDebug = opt.debug;
-}
+    : impl_(new Impl(core, opt)) {}
 
 RpmbCuseDevice::~RpmbCuseDevice() {
+    Close();
     delete impl_;
 }
 
-int RpmbCuseDevice::Run() {
-    char devarg[256];
-    std::snprintf(devarg, sizeof(devarg), "DEVNAME=%s", impl_->opt_.devName.c_str());
+void RpmbCuseDevice::Impl::MakeArgs(Args& a, bool foreground) const {
+    std::snprintf(a.devarg, sizeof(a.devarg), "DEVNAME=%s", opt_.devName.c_str());
+    a.devinfo[0] = a.devarg;
+    a.devinfo[1] = nullptr;
 
-    const char* devinfo_argv[] = { devarg, nullptr };
+    std::memset(&a.ci, 0, sizeof(a.ci));
+    a.ci.dev_info_argc = 1;
+    a.ci.dev_info_argv = a.devinfo;
 
-    struct cuse_info ci;
-    std::memset(&ci, 0, sizeof(ci));
-    ci.dev_info_argc = 1;
-    ci.dev_info_argv = devinfo_argv;
+    a.argc = 0;
+    a.argv[a.argc++] = a.arg0;
+    if (foreground) a.argv[a.argc++] = a.argF;
+    a.argv[a.argc] = nullptr;
+}
 
-    const bool fg = impl_->opt_.foreground;
+int RpmbCuseDevice::Run() {
+    if (!impl_->opt_.foreground && fuse_daemonize(0) != 0) {
+        ERR("cannot daemonize");
+        return 1;
+    }
 
-    char arg0[] = "rpmbd";
-    char arg_f[] = "-f";
+    RpmbCusePool pool{RpmbCusePool::Options()};
+    pool.Add(*this);
+    return pool.Run();
+}
+
+fuse_session* RpmbCuseDevice::Open() {
+    if (impl_->se_) return impl_->se_;
+
+    Impl::Args a;
+    impl_->MakeArgs(a, true);
 
-    char* argv_fg[] = { arg0, arg_f, nullptr };
-    char* argv_bg[] = { arg0, nullptr };
+    DBG("creating /dev/%s", impl_->opt_.devName.c_str());
 
-    int argc = fg ? 2 : 1;
-    char** argv = fg ? argv_fg : argv_bg;
+    int multithreaded = 0;
+    fuse_session* se = cuse_lowlevel_setup(a.argc, a.argv, &a.ci, &Impl::ops,
+                                           &multithreaded, impl_);
+    if (!se) {
+        ERR("cannot create /dev/%s", impl_->opt_.devName.c_str());
+        return nullptr;
+    }
 
-    DBG("creating /dev/%s (foreground=%d)", impl_->opt_.devName.c_str(), fg ? 1 : 0);
+    // Signals are handled by the caller, once for all devices
+    fuse_remove_signal_handlers(se);
+    impl_->se_ = se;
+    if (impl_->core_.TimingEnabled()) impl_->replies_.Start();
+    return se;
+}
 
-    return cuse_lowlevel_main(argc, argv, &ci, &Impl::ops, impl_);
+void RpmbCuseDevice::Close() {
+    if (impl_->se_) {
+        impl_->replies_.Stop();
+        fuse_session_destroy(impl_->se_);   // removes /dev/<devName>
+        impl_->se_ = nullptr;
+    }
 }
@@ -3,21 +3,27 @@
 #include <string>
 
 class Rpmbd; // forward decl
+struct fuse_session;
 
 class RpmbCuseDevice {
 public:
     struct Options {
         std::string devName = "mmcblk2rpmb"; // creates /dev/<devName>
-        bool foreground = true;              // pass -f to FUSE
-        bool debug = false;                  // enable debug logs
+        bool foreground = true;              // Run(): false daemonizes first
     };
 
     RpmbCuseDevice(Rpmbd& core, const Options& opt);
     ~RpmbCuseDevice();
 
-    // Blocks: runs the CUSE/FUSE main loop
+    // Blocks: serves the device on a RpmbCusePool with default options
     int Run();
 
+    // Creates /dev/<devName> without running a loop, for a caller that
+    // drives the session itself (RpmbCusePool). Always in the foreground;
+    // libfuse's signal handlers are not installed. nullptr on failure.
+    fuse_session* Open();
+    void Close();
+
 private:
     class Impl;
     Impl* impl_;
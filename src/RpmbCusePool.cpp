@@ -0,0 +1,283 @@
+#define FUSE_USE_VERSION 31
+#include "RpmbCusePool.h"
+
+#include <fuse3/cuse_lowlevel.h>
+
+#include <sys/epoll.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+#include "RpmbCuseDevice.h"
+#include "RpmbLog.h"
+
+#define ERR(fmt, ...) RPMB_LOG(RpmbLog::Error, "[rpmb-pool] " fmt, ##__VA_ARGS__)
+#define INFO(fmt, ...) RPMB_LOG(RpmbLog::Info, "[rpmb-pool] " fmt, ##__VA_ARGS__)
+
+namespace {
+
+// Signal handler -> workers (read end is level-triggered in the epoll set,
+// so one byte wakes every worker)
+int gStopFd[2] = { -1, -1 };
+
+void OnStopSignal(int) {
+    const int saved = errno;
+    const char c = 's';
+    ssize_t n = ::write(gStopFd[1], &c, 1);     // async-signal-safe
+    (void)n;
+    errno = saved;
+}
+
+struct Device {
+    fuse_session* se = nullptr;
+    int fd = -1;
+};
+
+struct Shared {
+    int epfd = -1;
+    std::atomic<size_t> live{0};    // devices whose session has not ended
+
+    unsigned maxThreads = 1;
+    unsigned maxIdle = 0;           // 0: fixed pool
+    std::vector<int> cpus;
+
+    std::atomic<unsigned> idle{0};  // workers waiting in epoll_wait
+
+    std::mutex mu;
+    std::unordered_map<unsigned, std::thread> workers;  // mu; by worker number
+    std::vector<std::thread> finished;  // mu; retired, to be joined
+    unsigned running = 0;               // mu
+    unsigned started = 0;               // mu; number of the next worker
+    bool stopping = false;              // mu
+    bool pinFailed = false;             // mu; reported once
+};
+
+void Worker(Shared& sh, unsigned n);
+
+// Starts one more worker unless the pool is full or stopping; joins the
+// workers that retired since the last call
+void Spawn(Shared& sh) {
+    std::vector<std::thread> retired;
+    {
+        std::lock_guard<std::mutex> lk(sh.mu);
+        retired.swap(sh.finished);
+        if (!sh.stopping && sh.running < sh.maxThreads) {
+            const unsigned n = sh.started++;
+            std::thread& t = sh.workers[n];
+            t = std::thread(Worker, std::ref(sh), n);
+            sh.running++;
+
+            if (!sh.cpus.empty()) {
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                CPU_SET(sh.cpus[n % sh.cpus.size()], &set);
+                const int err = pthread_setaffinity_np(t.native_handle(), sizeof(set), &set);
+                if (err && !sh.pinFailed) {
+                    ERR("cannot pin worker to CPU %d: %s", sh.cpus[n % sh.cpus.size()], std::strerror(err));
+                    sh.pinFailed = true;
+                }
+            }
+        }
+    }
+    for (auto& t : retired) t.join();     // about to return, if not already
+}
+
+// After a request: true if worker n should exit because enough others are
+// idle (on-demand pools only; the last worker always stays). Its thread is
+// handed over to be joined by the next Spawn() or by Run().
+bool Retire(Shared& sh, unsigned n) {
+    if (sh.maxIdle == 0 || sh.idle.load(std::memory_order_relaxed) < sh.maxIdle) return false;
+    std::lock_guard<std::mutex> lk(sh.mu);
+    if (sh.running <= 1 || sh.idle.load(std::memory_order_relaxed) < sh.maxIdle) return false;
+    sh.running--;
+    auto it = sh.workers.find(n);
+    if (it != sh.workers.end()) {
+        sh.finished.push_back(std::move(it->second));
+        sh.workers.erase(it);
+    }
+    return true;
+}
+
+// Device fds are EPOLLONESHOT: exactly one worker reads each request, and
+// re-arms the fd before processing it so the next request of the same
+// device can be picked up by another worker meanwhile.
+bool Arm(int epfd, int op, Device& d) {
+    epoll_event ev;
+    std::memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.ptr = &d;
+    return ::epoll_ctl(epfd, op, d.fd, &ev) == 0;
+}
+
+void Worker(Shared& sh, unsigned n) {
+    // All sessions are set up alike (same bufsize), so one receive buffer
+    // per worker serves every device
+    struct fuse_buf buf;
+    std::memset(&buf, 0, sizeof(buf));
+
+    for (;;) {
+        epoll_event ev;
+        sh.idle++;
+        const int nev = ::epoll_wait(sh.epfd, &ev, 1, -1);
+        sh.idle--;
+        if (nev < 0) {
+            if (errno == EINTR) continue;
+            ERR("epoll_wait: %s", std::strerror(errno));
+            break;
+        }
+        if (nev == 0) continue;
+        if (!ev.data.ptr) break;    // stop pipe
+
+        // Nobody left to pick up the next request: add a worker
+        if (sh.maxIdle && sh.idle.load(std::memory_order_relaxed) == 0) Spawn(sh);
+
+        Device& d = *static_cast<Device*>(ev.data.ptr);
+        const int res = fuse_session_receive_buf(d.se, &buf);
+
+        if (res > 0 || res == -EINTR || res == -EAGAIN) {
+            Arm(sh.epfd, EPOLL_CTL_MOD, d);
+            if (res > 0) fuse_session_process_buf(d.se, &buf);
+            if (Retire(sh, n)) break;
+            continue;
+        }
+
+        // Session ended (device released by the kernel) or failed; the fd
+        // stays disarmed
+        if (res < 0) ERR("receive: %s", std::strerror(-res));
+        fuse_session_exit(d.se);
+        if (sh.live.fetch_sub(1) == 1) OnStopSignal(0);
+    }
+
+    std::free(buf.mem);
+}
+
+} // namespace
+
+// ----------------------------------------------------------------------
+
+bool RpmbCusePool::ParseCpuList(const std::string& s, std::vector<int>& out) {
+    out.clear();
+    const char* p = s.c_str();
+    while (*p) {
+        char* end = nullptr;
+        const long first = std::strtol(p, &end, 10);
+        if (end == p || first < 0 || first >= CPU_SETSIZE) return false;
+        long last = first;
+        p = end;
+        if (*p == '-') {
+            last = std::strtol(++p, &end, 10);
+            if (end == p || last < first || last >= CPU_SETSIZE) return false;
+            p = end;
+        }
+        for (long c = first; c <= last; ++c) out.push_back(int(c));
+        if (*p == ',') ++p;
+        else if (*p) return false;
+    }
+    return !out.empty();
+}
+
+int RpmbCusePool::Run() {
+    if (devs_.empty()) return 0;
+
+    unsigned threads = opt_.threads;
+    if (threads == 0) threads = std::thread::hardware_concurrency();
+    if (threads == 0) threads = 1;
+
+    Shared sh;
+    sh.maxThreads = threads;
+    sh.maxIdle = opt_.maxIdle;
+    sh.cpus = opt_.cpus;
+    std::vector<Device> devices(devs_.size());
+    int rc = 1;
+
+    sh.epfd = ::epoll_create1(EPOLL_CLOEXEC);
+    if (sh.epfd < 0 || ::pipe2(gStopFd, O_CLOEXEC | O_NONBLOCK) != 0) {
+        ERR("setup: %s", std::strerror(errno));
+        if (sh.epfd >= 0) ::close(sh.epfd);
+        return 1;
+    }
+
+    // Stop pipe: data.ptr == nullptr, level-triggered
+    epoll_event stopEv;
+    std::memset(&stopEv, 0, sizeof(stopEv));
+    stopEv.events = EPOLLIN;
+    stopEv.data.ptr = nullptr;
+    ::epoll_ctl(sh.epfd, EPOLL_CTL_ADD, gStopFd[0], &stopEv);
+
+    size_t opened = 0;
+    for (; opened < devs_.size(); ++opened) {
+        Device& d = devices[opened];
+        d.se = devs_[opened]->Open();
+        if (!d.se) break;
+        d.fd = fuse_session_fd(d.se);
+        if (!Arm(sh.epfd, EPOLL_CTL_ADD, d)) {
+            ERR("epoll_ctl: %s", std::strerror(errno));
+            devs_[opened]->Close();
+            break;
+        }
+    }
+
+    if (opened == devs_.size()) {
+        struct sigaction sa, oldInt, oldTerm, oldHup, oldPipe;
+        std::memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = OnStopSignal;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGINT, &sa, &oldInt);
+        sigaction(SIGTERM, &sa, &oldTerm);
+        sigaction(SIGHUP, &sa, &oldHup);
+        sa.sa_handler = SIG_IGN;
+        sigaction(SIGPIPE, &sa, &oldPipe);
+
+        if (sh.maxIdle)
+            INFO("serving %zu device(s) with up to %u worker(s), %u idle", devices.size(), threads, sh.maxIdle);
+        else
+            INFO("serving %zu device(s) with %u worker(s)", devices.size(), threads);
+
+        sh.live = devices.size();
+        const unsigned initial = sh.maxIdle ? std::min(sh.maxIdle, threads) : threads;
+        for (unsigned i = 0; i < initial; ++i)
+            Spawn(sh);
+
+        // Workers may start others until the last one has exited
+        for (;;) {
+            std::vector<std::thread> batch;
+            {
+                std::lock_guard<std::mutex> lk(sh.mu);
+                if (sh.workers.empty() && sh.finished.empty()) {
+                    sh.stopping = true;
+                    break;
+                }
+                batch.swap(sh.finished);
+                for (auto& w : sh.workers) batch.push_back(std::move(w.second));
+                sh.workers.clear();
+            }
+            for (auto& t : batch) t.join();
+        }
+
+        sigaction(SIGINT, &oldInt, nullptr);
+        sigaction(SIGTERM, &oldTerm, nullptr);
+        sigaction(SIGHUP, &oldHup, nullptr);
+        sigaction(SIGPIPE, &oldPipe, nullptr);
+        rc = 0;
+    }
+
+    for (size_t i = 0; i < opened; ++i) devs_[i]->Close();
+
+    ::close(sh.epfd);
+    for (int& fd : gStopFd) {
+        ::close(fd);
+        fd = -1;
+    }
+    return rc;
+}
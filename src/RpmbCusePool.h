@@ -0,0 +1,41 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+class RpmbCuseDevice;
+
+// Serves several CUSE devices from one process: all device fds share one
+// epoll set, and a common pool of worker threads receives and processes
+// their requests (instead of one FUSE loop, with its own threads, per
+// device). Requests of one device may run on several workers at once.
+//
+// The kernel does not clone CUSE channels (FUSE_DEV_IOC_CLONE only works
+// between /dev/fuse files), so workers share each device fd; a worker
+// re-arms it right after reading a request, before processing it.
+class RpmbCusePool {
+public:
+    struct Options {
+        unsigned threads = 0;       // max workers; 0: one per online CPU
+        unsigned maxIdle = 0;       // 0: start all workers up front and keep
+                                    // them; else start workers on demand and
+                                    // let those beyond maxIdle idle ones exit
+        std::vector<int> cpus;      // pin worker i to cpus[i % size]; empty: any
+    };
+
+    // "0-3,6" -> {0,1,2,3,6}; false on a malformed list
+    static bool ParseCpuList(const std::string& s, std::vector<int>& out);
+
+    explicit RpmbCusePool(const Options& opt) : opt_(opt) {}
+
+    // dev must outlive Run()
+    void Add(RpmbCuseDevice& dev) { devs_.push_back(&dev); }
+
+    // Blocks: creates all devices, serves them until SIGINT/SIGTERM/SIGHUP
+    // or until every device is gone, then removes them again
+    int Run();
+
+private:
+    Options opt_;
+    std::vector<RpmbCuseDevice*> devs_;
+};
@@ -0,0 +1,449 @@
+#include "RpmbLog.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+std::atomic<int> RpmbLog::level_{RpmbLog::Error};
+
+// ----------------------------------------------------------------------
+// Record layout (8-byte aligned in the ring):
+//   RecHdr | args...      kind FMT: per arg type(1) len(1) value(len)
+//   RecHdr | len(4) | bytes   kind HEX: fmt is the title
+
+namespace {
+
+enum Kind : uint8_t { K_FMT, K_HEX, K_PAD };
+
+struct RecHdr {
+    uint32_t size;          // whole record, padded to 8
+    uint8_t level;
+    uint8_t kind;
+    uint16_t reserved;
+    uint64_t tsNs;
+    const char* fmt;
+};
+
+uint64_t NowNs() {
+    timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000ull + uint64_t(ts.tv_nsec);
+}
+
+size_t Align8(size_t n) { return (n + 7) & ~size_t(7); }
+
+// Single-producer (owning thread) / single-consumer (writer) byte ring
+struct Ring {
+    static const size_t SIZE = 256 * 1024;
+
+    std::atomic<uint64_t> head{0};  // written by producer
+    std::atomic<uint64_t> tail{0};  // written by consumer
+    std::atomic<bool> dead{false};  // owning thread exited
+    alignas(8) uint8_t buf[SIZE];
+
+    // Returns false if full; wake is set when the ring just crossed half full
+    bool Push(const uint8_t* rec, size_t size, bool& wake) {
+        const uint64_t h = head.load(std::memory_order_relaxed);
+        const uint64_t t = tail.load(std::memory_order_acquire);
+        const size_t off = size_t(h % SIZE);
+        const size_t toEnd = SIZE - off;
+
+        // Records never wrap; the rest of the buffer is skipped with a pad
+        const size_t need = size <= toEnd ? size : toEnd + size;
+        if (SIZE - (h - t) < need) return false;
+
+        uint64_t nh = h;
+        if (size > toEnd) {
+            RecHdr pad{};
+            pad.size = uint32_t(toEnd);
+            pad.kind = K_PAD;
+            std::memcpy(buf + off, &pad, sizeof(pad.size) + 2);
+            nh += toEnd;
+        }
+        std::memcpy(buf + size_t(nh % SIZE), rec, size);
+        head.store(nh + size, std::memory_order_release);
+
+        wake = (h - t) < SIZE / 2 && (nh + size - t) >= SIZE / 2;
+        return true;
+    }
+};
+
+struct State {
+    std::mutex mu;                              // rings list, start/stop
+    std::vector<std::shared_ptr<Ring>> rings;
+    std::condition_variable cv;
+    std::thread writer;
+    bool running = false;
+    bool stop = false;
+    std::atomic<bool> async{false};
+    std::atomic<uint64_t> dropped{0};
+    std::mutex syncMu;                          // synchronous mode output
+};
+
+State& S() {
+    static State* s = new State();  // outlives thread_local ring holders
+    return *s;
+}
+
+struct RingHolder {
+    std::shared_ptr<Ring> ring;
+    ~RingHolder() {
+        if (ring) ring->dead.store(true, std::memory_order_release);
+    }
+};
+
+Ring& ThreadRing() {
+    thread_local RingHolder h;
+    if (!h.ring) {
+        h.ring = std::make_shared<Ring>();
+        std::lock_guard<std::mutex> lk(S().mu);
+        S().rings.push_back(h.ring);
+    }
+    return *h.ring;
+}
+
+// ----------------------------------------------------------------------
+// Formatting (writer thread, or caller in synchronous mode)
+
+void AppendTs(std::string& out, uint64_t tsNs) {
+    const std::time_t sec = std::time_t(tsNs / 1000000000ull);
+    std::tm tm{};
+    localtime_r(&sec, &tm);
+    char b[32];
+    std::snprintf(b, sizeof(b), "%02d:%02d:%02d.%06u ", tm.tm_hour, tm.tm_min, tm.tm_sec,
+                  unsigned((tsNs / 1000) % 1000000));
+    out += b;
+}
+
+struct ArgReader {
+    const uint8_t* p;
+    const uint8_t* end;
+
+    bool Next(uint8_t& type, const uint8_t*& val, size_t& len) {
+        if (end - p < 2) return false;
+        type = p[0];
+        len = p[1];
+        val = p + 2;
+        p += 2 + len;
+        return p <= end;
+    }
+};
+
+// Formats one conversion; spec is e.g. "%-08llx"
+void FormatArg(std::string& out, std::string spec, char conv,
+               uint8_t type, const uint8_t* val, size_t len) {
+    // Replace the length modifier with one matching the stored width
+    std::string lenMod;
+    while (!spec.empty() && std::strchr("hljztL", spec.back())) {
+        lenMod.insert(lenMod.begin(), spec.back());
+        spec.pop_back();
+    }
+
+    char b[256];
+    int n = -1;
+    switch (conv) {
+    case 'd': case 'i': case 'u': case 'o': case 'x': case 'X': case 'c': {
+        uint64_t u = 0;
+        if ((type == RpmbLog::A_INT || type == RpmbLog::A_UINT || type == RpmbLog::A_PTR) && len == 8) std::memcpy(&u, val, 8);
+        if (conv == 'c') {
+            n = std::snprintf(b, sizeof(b), (spec + "c").c_str(), int(u));
+        } else if (conv == 'd' || conv == 'i') {
+            long long v = (long long)u;
+            if (lenMod == "hh") v = (signed char)v;
+            else if (lenMod == "h") v = short(v);
+            else if (lenMod.empty()) v = int(v);
+            n = std::snprintf(b, sizeof(b), (spec + "ll" + conv).c_str(), v);
+        } else {
+            unsigned long long v = u;
+            if (lenMod == "hh") v = (unsigned char)v;
+            else if (lenMod == "h") v = (unsigned short)v;
+            else if (lenMod.empty()) v = unsigned(v);
+            n = std::snprintf(b, sizeof(b), (spec + "ll" + conv).c_str(), v);
+        }
+        break;
+    }
+    case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A': {
+        double d = 0;
+        if (type == RpmbLog::A_DBL && len == 8) std::memcpy(&d, val, 8);
+        n = std::snprintf(b, sizeof(b), (spec + conv).c_str(), d);
+        break;
+    }
+    case 'p': {
+        const void* p = nullptr;
+        if (len == sizeof(p)) std::memcpy(&p, val, sizeof(p));
+        n = std::snprintf(b, sizeof(b), (spec + "p").c_str(), p);
+        break;
+    }
+    case 's': {
+        std::string s;
+        if (type == RpmbLog::A_STR) s.assign(reinterpret_cast<const char*>(val), len);
+        else s = "(?)";
+        n = std::snprintf(b, sizeof(b), (spec + "s").c_str(), s.c_str());
+        break;
+    }
+    default:
+        break;
+    }
+    if (n > 0) out.append(b, std::min(size_t(n), sizeof(b) - 1));
+}
+
+void FormatFmt(std::string& out, const RecHdr& h, const uint8_t* args, const uint8_t* end) {
+    ArgReader rd{args, end};
+    for (const char* f = h.fmt; *f; ++f) {
+        if (*f != '%') { out += *f; continue; }
+        if (f[1] == '%') { out += '%'; ++f; continue; }
+
+        const char* start = f++;
+        while (*f && !std::strchr("diouxXcspfFeEgGaA", *f)) ++f;
+        if (!*f) { out.append(start); break; }
+
+        uint8_t type = 0;
+        const uint8_t* val = nullptr;
+        size_t len = 0;
+        if (!rd.Next(type, val, len)) { out += "(?)"; continue; }
+        FormatArg(out, std::string(start, f), *f, type, val, len);
+    }
+    out += '\n';
+}
+
+void FormatHex(std::string& out, const RecHdr& h, const uint8_t* p, uint64_t tsNs) {
+    uint32_t len = 0, shown = 0;
+    std::memcpy(&len, p, 4);
+    std::memcpy(&shown, p + 4, 4);
+    p += 8;
+
+    char b[64];
+    std::snprintf(b, sizeof(b), " (%u bytes, showing %u)\n", len, shown);
+    out += h.fmt;
+    out += b;
+    for (uint32_t i = 0; i < shown; i += 16) {
+        AppendTs(out, tsNs);
+        std::snprintf(b, sizeof(b), "  %04x: ", i);
+        out += b;
+        for (uint32_t j = 0; j < 16 && i + j < shown; ++j) {
+            std::snprintf(b, sizeof(b), "%02x ", p[i + j]);
+            out += b;
+        }
+        out += '\n';
+    }
+}
+
+void Format(std::string& out, const uint8_t* rec) {
+    RecHdr h;
+    std::memcpy(&h, rec, sizeof(h));
+    AppendTs(out, h.tsNs);
+    if (h.kind == K_HEX) FormatHex(out, h, rec + sizeof(h), h.tsNs);
+    else FormatFmt(out, h, rec + sizeof(h), rec + h.size);
+}
+
+void WriteOut(const std::string& s) {
+    if (s.empty()) return;
+    std::fwrite(s.data(), 1, s.size(), stderr);
+    std::fflush(stderr);
+}
+
+// ----------------------------------------------------------------------
+// Writer thread
+
+struct Pending {
+    uint64_t tsNs;
+    size_t off;     // into batch buffer
+};
+
+// Moves every complete record of all rings into out (sorted by time) and
+// releases finished rings. Returns false if there was nothing to do.
+bool Drain(std::string& out) {
+    std::vector<std::shared_ptr<Ring>> rings;
+    {
+        std::lock_guard<std::mutex> lk(S().mu);
+        rings = S().rings;
+    }
+
+    std::vector<uint8_t> batch;
+    std::vector<Pending> recs;
+
+    for (auto& r : rings) {
+        const bool dead = r->dead.load(std::memory_order_acquire);
+        const uint64_t h = r->head.load(std::memory_order_acquire);
+        uint64_t t = r->tail.load(std::memory_order_relaxed);
+
+        while (t != h) {
+            const uint8_t* rec = r->buf + size_t(t % Ring::SIZE);
+            RecHdr hdr;
+            std::memcpy(&hdr, rec, sizeof(hdr.size) + 2);
+            if (hdr.kind != K_PAD) {
+                std::memcpy(&hdr, rec, sizeof(hdr));
+                recs.push_back({hdr.tsNs, batch.size()});
+                batch.insert(batch.end(), rec, rec + hdr.size);
+            }
+            t += hdr.size;
+        }
+        r->tail.store(t, std::memory_order_release);
+
+        if (dead) {
+            std::lock_guard<std::mutex> lk(S().mu);
+            auto& v = S().rings;
+            v.erase(std::remove(v.begin(), v.end(), r), v.end());
+        }
+    }
+
+    if (recs.empty()) return false;
+
+    std::stable_sort(recs.begin(), recs.end(),
+                     [](const Pending& a, const Pending& b) { return a.tsNs < b.tsNs; });
+    for (const Pending& p : recs) Format(out, batch.data() + p.off);
+    return true;
+}
+
+void WriterLoop() {
+    std::string out;
+    std::unique_lock<std::mutex> lk(S().mu);
+    for (;;) {
+        const bool stopping = S().stop;
+        lk.unlock();
+
+        out.clear();
+        while (Drain(out)) {
+            WriteOut(out);
+            out.clear();
+        }
+
+        const uint64_t d = S().dropped.exchange(0);
+        if (d) {
+            char b[64];
+            std::snprintf(b, sizeof(b), "[rpmbd] log: %llu record(s) dropped\n",
+                          (unsigned long long)d);
+            WriteOut(b);
+        }
+
+        lk.lock();
+        if (stopping) break;
+        S().cv.wait_for(lk, std::chrono::milliseconds(2));
+    }
+}
+
+} // namespace
+
+// ----------------------------------------------------------------------
+
+static const struct { const char* name; RpmbLog::Level level; } LEVEL_NAMES[] = {
+    { "off", RpmbLog::Off }, { "error", RpmbLog::Error }, { "info", RpmbLog::Info },
+    { "debug", RpmbLog::Debug }, { "trace", RpmbLog::Trace },
+};
+
+bool RpmbLog::ParseLevel(const std::string& s, Level& out) {
+    for (const auto& n : LEVEL_NAMES) {
+        if (s == n.name) {
+            out = n.level;
+            return true;
+        }
+    }
+    return false;
+}
+
+const char* RpmbLog::LevelName(Level l) {
+    for (const auto& n : LEVEL_NAMES)
+        if (n.level == l) return n.name;
+    return "?";
+}
+
+void RpmbLog::Start() {
+    std::lock_guard<std::mutex> lk(S().mu);
+    if (S().running) return;
+    S().stop = false;
+    S().running = true;
+    S().writer = std::thread(WriterLoop);
+    S().async.store(true, std::memory_order_release);
+}
+
+void RpmbLog::Stop() {
+    {
+        std::lock_guard<std::mutex> lk(S().mu);
+        if (!S().running) return;
+        S().async.store(false, std::memory_order_release);
+        S().stop = true;
+    }
+    S().cv.notify_all();
+    S().writer.join();
+
+    std::lock_guard<std::mutex> lk(S().mu);
+    S().running = false;
+}
+
+uint64_t RpmbLog::Dropped() {
+    return S().dropped.load(std::memory_order_relaxed);
+}
+
+// ----------------------------------------------------------------------
+// Producer side
+
+RpmbLog::Packer::Packer(Level l, const char* fmt) {
+    RecHdr h{};
+    h.level = uint8_t(l);
+    h.kind = K_FMT;
+    h.tsNs = NowNs();
+    h.fmt = fmt;
+    std::memcpy(buf, &h, sizeof(h));
+    len = sizeof(h);
+}
+
+void RpmbLog::Packer::Put(ArgType t, const void* v, size_t n) {
+    if (len + 2 + n > CAP) {
+        truncated = true;
+        return;
+    }
+    buf[len] = t;
+    buf[len + 1] = uint8_t(n);
+    std::memcpy(buf + len + 2, v, n);
+    len += 2 + n;
+}
+
+void RpmbLog::Packer::Add(const char* s) {
+    if (!s) s = "(null)";
+    Put(A_STR, s, strnlen(s, MAX_STR));
+}
+
+void RpmbLog::Packer::Add(double d) {
+    Put(A_DBL, &d, sizeof(d));
+}
+
+void RpmbLog::Submit(Packer& p) {
+    const uint32_t size = uint32_t(Align8(p.len));
+    std::memcpy(p.buf, &size, sizeof(size));    // RecHdr::size
+
+    if (S().async.load(std::memory_order_acquire)) {
+        bool wake = false;
+        if (!ThreadRing().Push(p.buf, size, wake))
+            S().dropped.fetch_add(1, std::memory_order_relaxed);
+        else if (wake)
+            S().cv.notify_one();    // burst: don't wait for the next poll
+        return;
+    }
+
+    std::string out;
+    Format(out, p.buf);
+    std::lock_guard<std::mutex> lk(S().syncMu);
+    WriteOut(out);
+}
+
+void RpmbLog::Hex(Level l, const char* title, const void* data, size_t len) {
+    Packer p(l, title);
+    RecHdr h;
+    std::memcpy(&h, p.buf, sizeof(h));
+    h.kind = K_HEX;
+    std::memcpy(p.buf, &h, sizeof(h));
+
+    const uint32_t total = uint32_t(len);
+    const uint32_t shown = uint32_t(std::min(len, MAX_HEX));
+    std::memcpy(p.buf + p.len, &total, 4);
+    std::memcpy(p.buf + p.len + 4, &shown, 4);
+    std::memcpy(p.buf + p.len + 8, data, shown);
+    p.len += 8 + shown;
+
+    Submit(p);
+}
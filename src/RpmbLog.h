@@ -0,0 +1,105 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <atomic>
+#include <string>
+#include <type_traits>
+
+// Asynchronous logger.
+//
+// RPMB_LOG() checks the level, then copies the format pointer, a timestamp
+// and the raw arguments into a lock-free ring owned by the calling thread.
+// A writer thread collects the records of all threads, formats them and
+// writes them to stderr in batches. RPMB_HEX() copies the bytes and leaves
+// the dump formatting to the writer as well.
+//
+// Format strings must be string literals (only the pointer is stored);
+// string arguments are copied, truncated to MAX_STR bytes. If a ring is
+// full the record is dropped and counted.
+//
+// Before Start() and after Stop() records are formatted synchronously.
+class RpmbLog {
+public:
+    enum Level : int { Off = 0, Error = 1, Info = 2, Debug = 3, Trace = 4 };
+
+    static const size_t MAX_STR = 96;
+    static const size_t MAX_HEX = 256;
+
+    static void SetLevel(Level l) { level_.store(l, std::memory_order_relaxed); }
+    static Level GetLevel() { return Level(level_.load(std::memory_order_relaxed)); }
+    static bool Enabled(Level l) { return int(l) <= level_.load(std::memory_order_relaxed); }
+
+    // "off" | "error" | "info" | "debug" | "trace"
+    static bool ParseLevel(const std::string& s, Level& out);
+    static const char* LevelName(Level l);
+
+    static void Start();
+    static void Stop();   // drains all pending records
+
+    static uint64_t Dropped();
+
+    template <class... A>
+    static void Write(Level l, const char* fmt, const A&... args) {
+        Packer p(l, fmt);
+        int unused[] = { 0, (p.Add(args), 0)... };
+        (void)unused;
+        Submit(p);
+    }
+
+    static void Hex(Level l, const char* title, const void* data, size_t len);
+
+    // Record encoding of one argument
+    enum ArgType : uint8_t { A_INT, A_UINT, A_DBL, A_PTR, A_STR };
+
+private:
+    static std::atomic<int> level_;
+
+    // Builds one record on the stack
+    struct Packer {
+        static const size_t CAP = 1024;
+        alignas(8) uint8_t buf[CAP];
+        size_t len;
+        bool truncated = false;
+
+        Packer(Level l, const char* fmt);
+
+        void Add(const char* s);
+        void Add(char* s) { Add(static_cast<const char*>(s)); }
+        void Add(const std::string& s) { Add(s.c_str()); }
+        void Add(double d);
+        void Add(const void* p) { Put(A_PTR, &p, sizeof(p)); }
+
+        template <class T>
+        typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value>::type
+        Add(T v) {
+            if (std::is_signed<T>::value) {
+                int64_t x = int64_t(v);
+                Put(A_INT, &x, sizeof(x));
+            } else {
+                uint64_t x = uint64_t(v);
+                Put(A_UINT, &x, sizeof(x));
+            }
+        }
+
+        template <class T>
+        typename std::enable_if<std::is_pointer<T>::value>::type Add(T v) {
+            Add(static_cast<const void*>(v));
+        }
+
+        void Put(ArgType t, const void* v, size_t n);
+    };
+
+    static void Submit(Packer& p);
+};
+
+#define RPMB_LOG(level, fmt, ...) do { \
+    if (RpmbLog::Enabled(level)) { \
+        if (0) std::fprintf(stderr, fmt, ##__VA_ARGS__); /* format check only */ \
+        RpmbLog::Write(level, fmt, ##__VA_ARGS__); \
+    } \
+} while (0)
+
+#define RPMB_HEX(level, title, data, len) do { \
+    if (RpmbLog::Enabled(level)) RpmbLog::Hex(level, title, data, len); \
+} while (0)
@@ -0,0 +1,286 @@
+#include "RpmbMac.h"
+
+#include <algorithm>
+#include <cstring>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
+#include "RpmbFrame.h"
+#include "RpmbSeqlock.h"
+
+static std::atomic<const RpmbShaBackend*> g_backend{nullptr};
+
+void RpmbMacKey::UseBackend(const RpmbShaBackend& b) {
+    g_backend.store(&b, std::memory_order_release);
+}
+
+const RpmbShaBackend& RpmbMacKey::Backend() {
+    const RpmbShaBackend* b = g_backend.load(std::memory_order_acquire);
+    return b ? *b : RpmbShaReference();
+}
+
+// ----------------------------------------------------------------------
+// SHA-256 framing on top of the backend's block function
+
+static inline void StoreBe32(uint8_t* p, uint32_t v) {
+    p[0] = uint8_t(v >> 24); p[1] = uint8_t(v >> 16);
+    p[2] = uint8_t(v >> 8);  p[3] = uint8_t(v);
+}
+
+static inline void StoreBe64(uint8_t* p, uint64_t v) {
+    StoreBe32(p, uint32_t(v >> 32));
+    StoreBe32(p + 4, uint32_t(v));
+}
+
+static inline void StoreDigest(const uint32_t h[8], uint8_t out[32]) {
+    for (int i = 0; i < 8; ++i) StoreBe32(out + 4 * i, h[i]);
+}
+
+// Final padding for a message of totalLen bytes whose last (totalLen % 64)
+// bytes are already in block; the rest of block is overwritten. Returns
+// the number of blocks to compress (1 or 2, block must hold 128 bytes).
+static size_t Pad(uint8_t* block, uint64_t totalLen) {
+    size_t used = size_t(totalLen % 64);
+    block[used++] = 0x80;
+    const size_t nblocks = used <= 56 ? 1 : 2;
+    std::memset(block + used, 0, nblocks * 64 - 8 - used);
+    StoreBe64(block + nblocks * 64 - 8, totalLen * 8);
+    return nblocks;
+}
+
+RpmbMacKey::Stream::Stream(const RpmbMacKey& key, const uint32_t h[8],
+                           uint64_t done, bool skipData)
+    : key_(key), total_(done), skipData_(skipData) {
+    std::memcpy(h_, h, sizeof(h_));
+}
+
+// Inner hash, continuing from a block-aligned state
+void RpmbMacKey::Stream::Hash(const uint8_t* p, size_t len) {
+    const RpmbShaBackend& b = RpmbMacKey::Backend();
+    size_t used = size_t(total_ % 64);
+    total_ += len;
+
+    if (used) {
+        const size_t take = std::min(len, 64 - used);
+        std::memcpy(buf_ + used, p, take);
+        p += take; len -= take; used += take;
+        if (used < 64) return;
+        b.compress(h_, buf_, 1);
+    }
+
+    if (len >= 64) {
+        b.compress(h_, p, len / 64);
+        p += len & ~size_t(63);
+        len &= 63;
+    }
+    std::memcpy(buf_, p, len);
+}
+
+void RpmbMacKey::Stream::Update(const uint8_t* frames, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        const uint8_t* region = frames + i * RPMB_FRAME_SIZE + OFF_DATA;
+        if (skipData_) {
+            Hash(region + 256, REGION_LEN - 256);
+            skipData_ = false;
+        } else {
+            Hash(region, REGION_LEN);
+        }
+    }
+}
+
+void RpmbMacKey::Stream::Final(uint8_t out[32]) {
+    uint8_t digest[32];
+    RpmbMacKey::Backend().compress(h_, buf_, Pad(buf_, total_));
+    StoreDigest(h_, digest);
+    key_.Finish(digest, out);
+}
+
+// ----------------------------------------------------------------------
+
+void RpmbMacKey::SetKey(const uint8_t key[32]) {
+    const RpmbShaBackend& b = Backend();
+    uint8_t pad[64];
+
+    std::memset(pad, 0x36, sizeof(pad));
+    for (size_t i = 0; i < 32; ++i) pad[i] ^= key[i];
+    std::memcpy(inner_, RPMB_SHA256_IV, sizeof(inner_));
+    b.compress(inner_, pad, 1);
+
+    std::memset(pad, 0x5c, sizeof(pad));
+    for (size_t i = 0; i < 32; ++i) pad[i] ^= key[i];
+    std::memcpy(outer_, RPMB_SHA256_IV, sizeof(outer_));
+    b.compress(outer_, pad, 1);
+
+    OPENSSL_cleanse(pad, sizeof(pad));
+
+    static const uint8_t zeros[256] = {};
+    DataMidstate(zeros, zero_);
+}
+
+void RpmbMacKey::DataMidstate(const uint8_t data256[256], Midstate& out) const {
+    std::memcpy(out.h, inner_, sizeof(out.h));
+    Backend().compress(out.h, data256, 4);
+}
+
+void RpmbMacKey::Finish(const uint8_t innerDigest[32], uint8_t out[32]) const {
+    uint8_t block[128];
+    std::memcpy(block, innerDigest, 32);
+    Pad(block, 64 + 32);
+
+    uint32_t h[8];
+    std::memcpy(h, outer_, sizeof(h));
+    Backend().compress(h, block, 1);
+    StoreDigest(h, out);
+}
+
+void RpmbMacKey::Mac(const uint8_t* frames, size_t blkCnt, uint8_t out[32]) const {
+    Stream st(*this);
+    st.Update(frames, blkCnt);
+    st.Final(out);
+}
+
+void RpmbMacKey::Mac(const Midstate& first, const uint8_t* frames, size_t blkCnt,
+                     uint8_t out[32]) const {
+    Stream st(*this, first);
+    st.Update(frames, blkCnt);
+    st.Final(out);
+}
+
+bool RpmbMacKey::Verify(const uint8_t* frame) const {
+    return VerifyEach(frame, 1);
+}
+
+bool RpmbMacKey::VerifyEach(const uint8_t* frames, size_t count) const {
+    const size_t LANES = RpmbShaBackend::MAX_LANES;
+    // ipad block + one region + padding = 6 blocks, the last 5 per lane here
+    const size_t INNER_BLOCKS = (REGION_LEN + 1 + 8 + 63) / 64;
+
+    const RpmbShaBackend& b = Backend();
+    bool ok = true;
+
+    for (size_t base = 0; base < count; base += LANES) {
+        const size_t lanes = std::min(LANES, count - base);
+
+        uint8_t msg[LANES][INNER_BLOCKS * 64];
+        uint32_t st[LANES][8];
+        uint32_t* states[LANES];
+        const uint8_t* blocks[LANES];
+
+        // Inner pass
+        for (size_t l = 0; l < lanes; ++l) {
+            const uint8_t* f = frames + (base + l) * RPMB_FRAME_SIZE;
+            std::memcpy(msg[l], f + OFF_DATA, REGION_LEN);
+            Pad(msg[l] + REGION_LEN / 64 * 64, 64 + REGION_LEN);
+            std::memcpy(st[l], inner_, sizeof(st[l]));
+            states[l] = st[l];
+            blocks[l] = msg[l];
+        }
+        if (lanes == 1) b.compress(st[0], msg[0], INNER_BLOCKS);
+        else b.compressLanes(states, blocks, lanes, INNER_BLOCKS);
+
+        // Outer pass
+        for (size_t l = 0; l < lanes; ++l) {
+            StoreDigest(st[l], msg[l]);
+            Pad(msg[l], 64 + 32);
+            std::memcpy(st[l], outer_, sizeof(st[l]));
+        }
+        if (lanes == 1) b.compress(st[0], msg[0], 1);
+        else b.compressLanes(states, blocks, lanes, 1);
+
+        for (size_t l = 0; l < lanes; ++l) {
+            uint8_t mac[32];
+            StoreDigest(st[l], mac);
+            const uint8_t* f = frames + (base + l) * RPMB_FRAME_SIZE;
+            // No early exit: timing does not depend on which frame is bad
+            ok &= CRYPTO_memcmp(mac, f + OFF_MAC, MAC_LEN) == 0;
+        }
+    }
+    return ok;
+}
+
+// ----------------------------------------------------------------------
+// Self test
+
+bool RpmbMacKey::SelfTest() {
+    const size_t MAX_FRAMES = RpmbShaBackend::MAX_LANES + 3;
+    std::unique_ptr<uint8_t[]> frames(new uint8_t[MAX_FRAMES * RPMB_FRAME_SIZE]);
+
+    uint8_t key[32];
+    uint32_t x = 0x9e3779b9;
+    auto next = [&x] { x ^= x << 13; x ^= x >> 17; x ^= x << 5; return uint8_t(x); };
+    for (auto& k : key) k = next();
+    for (size_t i = 0; i < MAX_FRAMES * RPMB_FRAME_SIZE; ++i) frames[i] = next();
+
+    RpmbMacKey mk;
+    mk.SetKey(key);
+
+    for (size_t n = 1; n <= MAX_FRAMES; ++n) {
+        uint8_t ref[32], got[32];
+
+        // Multi-frame MAC vs OpenSSL
+        HMAC_CTX* ctx = HMAC_CTX_new();
+        HMAC_Init_ex(ctx, key, 32, EVP_sha256(), nullptr);
+        for (size_t i = 0; i < n; ++i)
+            HMAC_Update(ctx, &frames[i * RPMB_FRAME_SIZE + OFF_DATA], REGION_LEN);
+        unsigned int len = 0;
+        HMAC_Final(ctx, ref, &len);
+        HMAC_CTX_free(ctx);
+
+        mk.Mac(frames.get(), n, got);
+        if (std::memcmp(ref, got, 32) != 0) return false;
+
+        Midstate ms;
+        mk.DataMidstate(&frames[OFF_DATA], ms);
+        mk.Mac(ms, frames.get(), n, got);
+        if (std::memcmp(ref, got, 32) != 0) return false;
+
+        // Per-frame MACs, verified in lanes
+        for (size_t i = 0; i < n; ++i) {
+            uint8_t* f = &frames[i * RPMB_FRAME_SIZE];
+            HMAC(EVP_sha256(), key, 32, f + OFF_DATA, REGION_LEN, f + OFF_MAC, &len);
+        }
+        if (!mk.VerifyEach(frames.get(), n)) return false;
+
+        frames[(n - 1) * RPMB_FRAME_SIZE + OFF_DATA] ^= 1;
+        const bool caught = !mk.VerifyEach(frames.get(), n);
+        frames[(n - 1) * RPMB_FRAME_SIZE + OFF_DATA] ^= 1;
+        if (!caught) return false;
+    }
+    return true;
+}
+
+// ----------------------------------------------------------------------
+
+RpmbMacCache::RpmbMacCache(size_t blocks)
+    : blocks_(blocks), entries_(new Entry[blocks]) {}
+
+bool RpmbMacCache::Lookup(uint16_t addr, uint64_t tag, RpmbMacKey::Midstate& out) const {
+    if (addr >= blocks_) return false;
+    const Entry& e = entries_[addr];
+
+    const uint32_t s1 = e.seq.load(std::memory_order_acquire);
+    if (s1 & 1) return false;
+
+    if (SeqlockLoad(e.tag) != tag) return false;
+    SeqlockRead(&out, &e.ms, sizeof out);
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return e.seq.load(std::memory_order_relaxed) == s1;
+}
+
+void RpmbMacCache::Store(uint16_t addr, uint64_t tag, const RpmbMacKey::Midstate& ms) {
+    if (addr >= blocks_) return;
+    Entry& e = entries_[addr];
+
+    uint32_t s1 = e.seq.load(std::memory_order_relaxed);
+    if ((s1 & 1) ||
+        !e.seq.compare_exchange_strong(s1, s1 + 1, std::memory_order_relaxed))
+        return;  // someone else is filling it
+    std::atomic_thread_fence(std::memory_order_release);
+
+    SeqlockStore(e.tag, tag);
+    SeqlockWrite(&e.ms, &ms, sizeof ms);
+
+    e.seq.store(s1 + 2, std::memory_order_release);
+}
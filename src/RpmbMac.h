@@ -0,0 +1,111 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <memory>
+
+#include "RpmbSha256.h"
+
+// HMAC-SHA256 with a precomputed key schedule.
+//
+// SetKey() hashes the ipad/opad key blocks once; every MAC afterwards starts
+// from copies of these two SHA-256 states instead of redoing the key setup.
+// The object is plain data, so it can be copied by value (e.g. into a
+// snapshot taken for one request).
+//
+// Block compression is done by a process-wide RpmbShaBackend (UseBackend(),
+// default: the OpenSSL reference).
+class RpmbMacKey {
+public:
+    // RPMB MACs cover 284 bytes per frame: data..req/resp
+    static const size_t REGION_LEN = 284;
+
+    // Inner hash state after (key ^ ipad) and a 256-byte data payload. The
+    // payload is block aligned, so only the 28-byte frame tail and the
+    // outer pass remain to be hashed.
+    struct Midstate {
+        uint32_t h[8];
+    };
+
+    // Select the backend before the first MAC; not meant to change while
+    // requests are processed
+    static void UseBackend(const RpmbShaBackend& b);
+    static const RpmbShaBackend& Backend();
+
+    // Compares MACs of the current backend against OpenSSL's HMAC()
+    static bool SelfTest();
+
+    void SetKey(const uint8_t key[32]);
+
+    void DataMidstate(const uint8_t data256[256], Midstate& out) const;
+
+    // Midstate of an all-zero payload (GET_COUNTER etc.)
+    const Midstate& ZeroMidstate() const { return zero_; }
+
+    // Like Mac(), with the first frame's payload already hashed into first
+    void Mac(const Midstate& first, const uint8_t* frames, size_t blkCnt,
+             uint8_t out[32]) const;
+
+    // MAC over the regions (starting at OFF_DATA) of blkCnt consecutive
+    // 512-byte frames
+    void Mac(const uint8_t* frames, size_t blkCnt, uint8_t out[32]) const;
+
+    // Mac() over frames that arrive in pieces (same result)
+    class Stream {
+    public:
+        explicit Stream(const RpmbMacKey& key) : Stream(key, key.inner_, 64, false) {}
+        // The first frame's payload is already hashed into first
+        Stream(const RpmbMacKey& key, const Midstate& first) : Stream(key, first.h, 64 + 256, true) {}
+
+        // The next count consecutive 512-byte frames
+        void Update(const uint8_t* frames, size_t count);
+        void Final(uint8_t out[32]);
+
+    private:
+        Stream(const RpmbMacKey& key, const uint32_t h[8], uint64_t done, bool skipData);
+        void Hash(const uint8_t* p, size_t len);
+
+        const RpmbMacKey& key_;
+        uint32_t h_[8];
+        uint8_t buf_[128];
+        uint64_t total_;
+        bool skipData_;     // first frame's payload is in h_ already
+    };
+
+    // Single-frame MAC compared against the frame's MAC field
+    bool Verify(const uint8_t* frame) const;
+
+    // Verify() for each of count consecutive frames; frames are hashed
+    // side by side in the backend's lanes. True if all MACs match.
+    bool VerifyEach(const uint8_t* frames, size_t count) const;
+
+private:
+    uint32_t inner_[8];     // after (key ^ ipad)
+    uint32_t outer_[8];     // after (key ^ opad)
+    Midstate zero_;
+
+    void Finish(const uint8_t innerDigest[32], uint8_t out[32]) const;
+};
+
+// Per-block cache of data midstates, shared by all readers without locking.
+//
+// Entries are tagged by the caller (key generation + block generation); a
+// lookup only hits on an exact tag match. Each entry is a small seqlock:
+// a concurrent fill is simply a miss, and of two racing fills one wins.
+class RpmbMacCache {
+public:
+    explicit RpmbMacCache(size_t blocks);
+
+    bool Lookup(uint16_t addr, uint64_t tag, RpmbMacKey::Midstate& out) const;
+    void Store(uint16_t addr, uint64_t tag, const RpmbMacKey::Midstate& ms);
+
+private:
+    struct Entry {
+        std::atomic<uint32_t> seq{0};
+        uint64_t tag = ~uint64_t(0);    // empty
+        RpmbMacKey::Midstate ms;
+    };
+
+    size_t blocks_;
+    std::unique_ptr<Entry[]> entries_;
+};
@@ -0,0 +1,378 @@
+#include "RpmbMetrics.h"
+
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <memory>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "RpmbFrame.h"
+#include "RpmbLog.h"
+#include "RpmbThreadShards.h"
+
+std::atomic<bool> RpmbMetrics::enabled_{false};
+
+namespace {
+
+const char* const REQ_NAMES[RpmbMetrics::REQ_COUNT] = {
+    "program_key", "get_counter", "data_write", "data_read", "result_read", "other"
+};
+
+const char* const STAGE_NAMES[RpmbMetrics::STAGE_COUNT] = {
+    "cmdlist_read", "payload_read", "execute", "writeback", "total"
+};
+
+const char* const RESULT_NAMES[RpmbMetrics::RESULT_COUNT] = {
+    "ok", "general_fail", "auth_fail", "counter_fail", "addr_fail",
+    "write_fail", "read_fail", "no_key", "other"
+};
+
+// Single writer (the owning thread), read by Render(): relaxed load + store
+// instead of a locked add
+inline void Bump(std::atomic<uint64_t>& c, uint64_t v = 1) {
+    c.store(c.load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+}
+
+struct Histogram {
+    std::atomic<uint64_t> buckets[RpmbMetrics::BUCKETS];
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> sumNs;
+
+    // v < 16: exact; above: 8 linear sub-buckets per power of two
+    static int Index(uint64_t v) {
+        if (v < 16) return int(v);
+        const int e = 63 - __builtin_clzll(v);
+        const int idx = 16 + (e - 4) * 8 + int((v >> (e - 3)) & 7);
+        return idx < RpmbMetrics::BUCKETS ? idx : RpmbMetrics::BUCKETS - 1;
+    }
+
+    // Exclusive upper bound of bucket idx in ns
+    static uint64_t Upper(int idx) {
+        if (idx < 16) return uint64_t(idx) + 1;
+        const int e = (idx - 16) / 8 + 4;
+        const uint64_t sub = uint64_t((idx - 16) % 8);
+        return (9 + sub) << (e - 3);
+    }
+
+    void Record(uint64_t ns) {
+        Bump(buckets[Index(ns)]);
+        Bump(count);
+        Bump(sumNs, ns);
+    }
+};
+
+struct Shard {
+    std::atomic<uint64_t> results[RpmbMetrics::REQ_COUNT][RpmbMetrics::RESULT_COUNT];
+    Histogram requests[RpmbMetrics::REQ_COUNT];
+    Histogram stages[RpmbMetrics::STAGE_COUNT];
+    std::atomic<uint64_t> ioctls[2];    // ok, error
+};
+
+typedef RpmbThreadShards<Shard> Shards;
+
+// Sum over all shards
+struct Totals {
+    uint64_t results[RpmbMetrics::REQ_COUNT][RpmbMetrics::RESULT_COUNT]{};
+    struct Hist {
+        uint64_t buckets[RpmbMetrics::BUCKETS]{};
+        uint64_t count = 0;
+        uint64_t sumNs = 0;
+    } requests[RpmbMetrics::REQ_COUNT], stages[RpmbMetrics::STAGE_COUNT];
+    uint64_t ioctls[2]{};
+};
+
+void Add(Totals::Hist& t, const Histogram& h) {
+    for (int i = 0; i < RpmbMetrics::BUCKETS; ++i)
+        t.buckets[i] += h.buckets[i].load(std::memory_order_relaxed);
+    t.count += h.count.load(std::memory_order_relaxed);
+    t.sumNs += h.sumNs.load(std::memory_order_relaxed);
+}
+
+// Exported bucket bounds (seconds); internal buckets are finer and counted
+// under the first bound not below their upper end
+const double LE_BOUNDS[] = {
+    1e-6, 2e-6, 5e-6, 1e-5, 2e-5, 5e-5, 1e-4, 2e-4, 5e-4,
+    1e-3, 2e-3, 5e-3, 1e-2, 2e-2, 5e-2, 1e-1, 2e-1, 5e-1, 1.0, 2.0, 5.0, 10.0
+};
+
+void AppendHistogram(std::string& out, const char* name, const char* label,
+                     const char* value, const Totals::Hist& h) {
+    char line[256];
+    uint64_t cum = 0;
+    int idx = 0;
+    for (double le : LE_BOUNDS) {
+        const uint64_t leNs = uint64_t(le * 1e9 + 0.5);
+        while (idx < RpmbMetrics::BUCKETS && Histogram::Upper(idx) <= leNs)
+            cum += h.buckets[idx++];
+        std::snprintf(line, sizeof(line), "%s_bucket{%s=\"%s\",le=\"%g\"} %llu\n",
+                      name, label, value, le, (unsigned long long)cum);
+        out += line;
+    }
+    std::snprintf(line, sizeof(line),
+                  "%s_bucket{%s=\"%s\",le=\"+Inf\"} %llu\n"
+                  "%s_sum{%s=\"%s\"} %.9f\n"
+                  "%s_count{%s=\"%s\"} %llu\n",
+                  name, label, value, (unsigned long long)h.count,
+                  name, label, value, double(h.sumNs) / 1e9,
+                  name, label, value, (unsigned long long)h.count);
+    out += line;
+}
+
+} // namespace
+
+// ----------------------------------------------------------------------
+
+uint64_t RpmbMetrics::Now() {
+    if (!Enabled()) return 0;
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000ull + uint64_t(ts.tv_nsec) + 1;  // never 0
+}
+
+RpmbMetrics::Req RpmbMetrics::ReqIndex(uint16_t reqType) {
+    if (reqType >= 0x0100) reqType >>= 8;   // response type
+    switch (reqType) {
+    case RPMB_REQ_PROGRAM_KEY: return REQ_PROGRAM_KEY;
+    case RPMB_REQ_GET_COUNTER: return REQ_GET_COUNTER;
+    case RPMB_REQ_DATA_WRITE:  return REQ_DATA_WRITE;
+    case RPMB_REQ_DATA_READ:   return REQ_DATA_READ;
+    case RPMB_REQ_RESULT_READ: return REQ_RESULT_READ;
+    default:                   return REQ_OTHER;
+    }
+}
+
+const char* RpmbMetrics::ReqName(Req r) {
+    return REQ_NAMES[r];
+}
+
+const char* RpmbMetrics::StageName(Stage s) {
+    return STAGE_NAMES[s];
+}
+
+void RpmbMetrics::CountResult(Req r, uint16_t result) {
+    if (!Enabled()) return;
+    // Bit 7 is the write counter expired flag
+    const int res = (result & 0x7F) < RESULT_COUNT - 1 ? (result & 0x7F) : RESULT_COUNT - 1;
+    Bump(Shards::Local().results[r][res]);
+}
+
+void RpmbMetrics::RecordRequest(Req r, uint64_t ns) {
+    if (Enabled()) Shards::Local().requests[r].Record(ns);
+}
+
+void RpmbMetrics::RecordStage(Stage s, uint64_t ns) {
+    if (Enabled()) Shards::Local().stages[s].Record(ns);
+}
+
+void RpmbMetrics::CountIoctl(bool ok) {
+    if (Enabled()) Bump(Shards::Local().ioctls[ok ? 0 : 1]);
+}
+
+std::string RpmbMetrics::Render() {
+    std::unique_ptr<Totals> t(new Totals());
+    Shards::ForEach([&](const Shard& s) {
+        for (int i = 0; i < REQ_COUNT; ++i) {
+            for (int j = 0; j < RESULT_COUNT; ++j)
+                t->results[i][j] += s.results[i][j].load(std::memory_order_relaxed);
+            Add(t->requests[i], s.requests[i]);
+        }
+        for (int i = 0; i < STAGE_COUNT; ++i)
+            Add(t->stages[i], s.stages[i]);
+        t->ioctls[0] += s.ioctls[0].load(std::memory_order_relaxed);
+        t->ioctls[1] += s.ioctls[1].load(std::memory_order_relaxed);
+    });
+
+    std::string out;
+    char line[256];
+
+    out += "# HELP rpmbd_requests_total RPMB requests by type and result code.\n"
+           "# TYPE rpmbd_requests_total counter\n";
+    for (int i = 0; i < REQ_COUNT; ++i) {
+        for (int j = 0; j < RESULT_COUNT; ++j) {
+            if (!t->results[i][j]) continue;
+            std::snprintf(line, sizeof(line), "rpmbd_requests_total{type=\"%s\",result=\"%s\"} %llu\n",
+                          REQ_NAMES[i], RESULT_NAMES[j], (unsigned long long)t->results[i][j]);
+            out += line;
+        }
+    }
+
+    out += "# HELP rpmbd_request_duration_seconds Time spent in the core per request type.\n"
+           "# TYPE rpmbd_request_duration_seconds histogram\n";
+    for (int i = 0; i < REQ_COUNT; ++i)
+        if (t->requests[i].count)
+            AppendHistogram(out, "rpmbd_request_duration_seconds", "type", REQ_NAMES[i], t->requests[i]);
+
+    out += "# HELP rpmbd_ioctl_stage_duration_seconds Time per MULTI_CMD ioctl stage.\n"
+           "# TYPE rpmbd_ioctl_stage_duration_seconds histogram\n";
+    for (int i = 0; i < STAGE_COUNT; ++i)
+        if (t->stages[i].count)
+            AppendHistogram(out, "rpmbd_ioctl_stage_duration_seconds", "stage", STAGE_NAMES[i], t->stages[i]);
+
+    std::snprintf(line, sizeof(line),
+                  "# HELP rpmbd_ioctls_total MULTI_CMD ioctls by outcome.\n"
+                  "# TYPE rpmbd_ioctls_total counter\n"
+                  "rpmbd_ioctls_total{status=\"ok\"} %llu\n"
+                  "rpmbd_ioctls_total{status=\"error\"} %llu\n",
+                  (unsigned long long)t->ioctls[0], (unsigned long long)t->ioctls[1]);
+    out += line;
+    return out;
+}
+
+// ----------------------------------------------------------------------
+// Exporter
+
+static bool WriteAll(int fd, const char* p, size_t len) {
+    while (len > 0) {
+        ssize_t n = ::write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        p += n;
+        len -= size_t(n);
+    }
+    return true;
+}
+
+// To a client socket: a reader that went away must not raise SIGPIPE
+static bool SendAll(int fd, const char* p, size_t len) {
+    while (len > 0) {
+        ssize_t n = ::send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        p += n;
+        len -= size_t(n);
+    }
+    return true;
+}
+
+static uint64_t MonotonicMs() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000 + uint64_t(ts.tv_nsec) / 1000000;
+}
+
+bool RpmbMetricsExporter::Start() {
+    if (!opt_.socketPath.empty()) {
+        sockaddr_un sa{};
+        sa.sun_family = AF_UNIX;
+        if (opt_.socketPath.size() >= sizeof(sa.sun_path)) {
+            RPMB_LOG(RpmbLog::Error, "[rpmbd] metrics socket path too long: %s", opt_.socketPath.c_str());
+            return false;
+        }
+        std::memcpy(sa.sun_path, opt_.socketPath.c_str(), opt_.socketPath.size() + 1);
+
+        listenFd_ = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        ::unlink(opt_.socketPath.c_str());
+        if (listenFd_ < 0 ||
+            ::bind(listenFd_, reinterpret_cast<sockaddr*>(&sa), sizeof(sa)) != 0 ||
+            ::listen(listenFd_, 8) != 0) {
+            RPMB_LOG(RpmbLog::Error, "[rpmbd] metrics socket '%s': %s",
+                     opt_.socketPath.c_str(), std::strerror(errno));
+            if (listenFd_ >= 0) ::close(listenFd_);
+            listenFd_ = -1;
+            return false;
+        }
+    }
+
+    if (::pipe2(wakeFd_, O_CLOEXEC) != 0) {
+        RPMB_LOG(RpmbLog::Error, "[rpmbd] metrics: pipe: %s", std::strerror(errno));
+        Stop();
+        return false;
+    }
+
+    RpmbMetrics::Enable(true);
+    thread_ = std::thread([this] { Loop(); });
+    return true;
+}
+
+void RpmbMetricsExporter::Stop() {
+    if (thread_.joinable()) {
+        char c = 0;
+        WriteAll(wakeFd_[1], &c, 1);
+        thread_.join();
+        if (!opt_.filePath.empty()) WriteFile();    // final numbers
+    }
+    for (int& fd : wakeFd_) {
+        if (fd >= 0) ::close(fd);
+        fd = -1;
+    }
+    if (listenFd_ >= 0) {
+        ::close(listenFd_);
+        ::unlink(opt_.socketPath.c_str());
+        listenFd_ = -1;
+    }
+}
+
+void RpmbMetricsExporter::Loop() {
+    const bool file = !opt_.filePath.empty();
+    const uint64_t interval = opt_.intervalMs ? opt_.intervalMs : 1;
+    uint64_t nextWrite = MonotonicMs() + interval;     // file only
+
+    for (;;) {
+        // Scrapes do not push the file rewrite back
+        int timeout = -1;
+        if (file) {
+            const uint64_t now = MonotonicMs();
+            if (now >= nextWrite) {
+                WriteFile();
+                nextWrite += interval;
+                if (nextWrite <= now) nextWrite = now + interval;   // fell behind
+            }
+            const uint64_t t = MonotonicMs();
+            timeout = t >= nextWrite ? 0 : int(nextWrite - t);
+        }
+
+        pollfd p[2] = { { wakeFd_[0], POLLIN, 0 }, { listenFd_, POLLIN, 0 } };
+        int n = ::poll(p, listenFd_ >= 0 ? 2 : 1, timeout);
+        if (n < 0 && errno != EINTR) break;
+        if (p[0].revents) break;
+
+        if (listenFd_ >= 0 && (p[1].revents & POLLIN)) {
+            int c = ::accept4(listenFd_, nullptr, nullptr, SOCK_CLOEXEC);
+            if (c >= 0) {
+                Serve(c);
+                ::close(c);
+            }
+        }
+    }
+}
+
+// Plain text for raw readers (e.g. socat); a minimal HTTP/1.0 response if
+// the client sent a request line (curl --unix-socket)
+void RpmbMetricsExporter::Serve(int fd) {
+    char req[512];
+    ssize_t n = 0;
+    pollfd p = { fd, POLLIN, 0 };
+    if (::poll(&p, 1, 100) > 0) n = ::recv(fd, req, sizeof(req), MSG_DONTWAIT);
+
+    const std::string body = RpmbMetrics::Render();
+    if (n >= 4 && std::memcmp(req, "GET ", 4) == 0) {
+        char hdr[128];
+        int len = std::snprintf(hdr, sizeof(hdr),
+                                "HTTP/1.0 200 OK\r\n"
+                                "Content-Type: text/plain; version=0.0.4\r\n"
+                                "Content-Length: %zu\r\n\r\n", body.size());
+        if (!SendAll(fd, hdr, size_t(len))) return;
+    }
+    SendAll(fd, body.data(), body.size());
+}
+
+void RpmbMetricsExporter::WriteFile() {
+    const std::string tmp = opt_.filePath + ".tmp";
+    const std::string body = RpmbMetrics::Render();
+
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return;
+    const bool ok = WriteAll(fd, body.data(), body.size());
+    ::close(fd);
+    if (!ok || ::rename(tmp.c_str(), opt_.filePath.c_str()) != 0)
+        ::unlink(tmp.c_str());
+}
@@ -0,0 +1,91 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <string>
+#include <thread>
+
+// Runtime metrics: request counters by type and result code, and latency
+// histograms per request type and per ioctl stage.
+//
+// Every thread updates its own shard (plain relaxed stores, no shared cache
+// lines); Render() sums all shards into Prometheus text format. Histograms
+// are log-linear (8 sub-buckets per power of two of nanoseconds, HDR style).
+// While disabled (default) nothing is timed or counted.
+class RpmbMetrics {
+public:
+    // Request types as dispatched by Rpmbd::ProcessRequest
+    enum Req { REQ_PROGRAM_KEY, REQ_GET_COUNTER, REQ_DATA_WRITE, REQ_DATA_READ,
+               REQ_RESULT_READ, REQ_OTHER, REQ_COUNT };
+
+    // Stages of one MULTI_CMD ioctl in the CUSE frontend
+    enum Stage { STAGE_CMDLIST_READ, STAGE_PAYLOAD_READ, STAGE_EXECUTE,
+                 STAGE_WRITEBACK, STAGE_IOCTL, STAGE_COUNT };
+
+    static const int RESULT_COUNT = 9;      // RPMB_RES_* 0..7, other
+    static const int BUCKETS = 16 + 37 * 8; // values up to 2^41 ns
+
+    static void Enable(bool on) { enabled_.store(on, std::memory_order_relaxed); }
+    static bool Enabled() { return enabled_.load(std::memory_order_relaxed); }
+
+    // Monotonic ns, or 0 while disabled (callers skip recording on 0)
+    static uint64_t Now();
+
+    // reqType: RPMB request (0x0001..) or response (0x0100..) type
+    static Req ReqIndex(uint16_t reqType);
+
+    // Label values, e.g. "data_write" / "payload_read" (string literals)
+    static const char* ReqName(Req r);
+    static const char* StageName(Stage s);
+
+    static void CountResult(Req r, uint16_t result);
+    static void RecordRequest(Req r, uint64_t ns);
+    static void RecordStage(Stage s, uint64_t ns);
+    static void CountIoctl(bool ok);
+
+    // Prometheus text exposition of all counters
+    static std::string Render();
+
+    // Times a scope (no-op while disabled)
+    class RequestTimer {
+    public:
+        explicit RequestTimer(Req r) : r_(r), t0_(Now()) {}
+        ~RequestTimer() { if (t0_) RecordRequest(r_, Now() - t0_); }
+        void Retarget(Req r) { r_ = r; }
+        void Cancel() { t0_ = 0; }
+    private:
+        Req r_;
+        uint64_t t0_;
+    };
+
+private:
+    static std::atomic<bool> enabled_;
+};
+
+// Serves RpmbMetrics::Render() on a Unix socket and/or rewrites a file
+// periodically (atomically via rename, e.g. for a node_exporter textfile
+// collector). Runs one background thread.
+class RpmbMetricsExporter {
+public:
+    struct Options {
+        std::string socketPath;         // empty: no socket
+        std::string filePath;           // empty: no file
+        uint32_t intervalMs = 1000;     // file rewrite period
+    };
+
+    explicit RpmbMetricsExporter(const Options& opt) : opt_(opt) {}
+    ~RpmbMetricsExporter() { Stop(); }
+
+    bool Start();
+    void Stop();
+
+private:
+    Options opt_;
+    int listenFd_ = -1;
+    int wakeFd_[2] = { -1, -1 };
+    std::thread thread_;
+
+    void Loop();
+    void Serve(int fd);
+    void WriteFile();
+};
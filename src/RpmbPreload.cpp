@@ -0,0 +1,374 @@
+// LD_PRELOAD interposer: runs the RPMB simulator inside the calling process.
+//
+// open()/ioctl()/close() on the configured device path are served by an
+// in-process Rpmbd core; everything else goes to libc. Unmodified tools
+// (e.g. mmc-utils) then run against the simulator without CUSE, root or a
+// kernel round trip, e.g. with
+//
+//   LD_PRELOAD=build/librpmbd_preload.so
+//   RPMBD_STATE_FILE=/tmp/rpmb_state.bin
+//
+// in the environment of "mmc rpmb read-counter /dev/mmcblk2rpmb".
+//
+// Settings (environment, read at the first open of the device):
+//   RPMBD_DEV          device path to intercept (default: /dev/mmcblk2rpmb)
+//   RPMBD_STATE_FILE   state file (default: ./rpmb_state.bin)
+//   RPMBD_KEY          32-byte key file, programmed if the state has none yet
+//   RPMBD_MAX_BLOCKS   RPMB size in 256-byte blocks (default: 128)
+//   RPMBD_DURABILITY   strict | group | volatile (default: strict)
+//   RPMBD_TIMING       device timing model, as rpmbd --timing (default: none);
+//                      the ioctl returns once the modeled device is done
+//   RPMBD_LOG_LEVEL    off | error | info | debug | trace (default: error)
+//
+// The state file is shared by consecutive processes; concurrent processes
+// each have their own copy and must not use the same state file.
+//
+// An fd of the device is a /dev/null fd with a session attached. Its dups
+// (dup, dup2, dup3, fcntl F_DUPFD*) share the session, as they share the
+// open file of a real device. It is not the device in another process:
+// passed over a socket or kept across exec() it is plain /dev/null.
+
+// The fortified inline open() wrappers would clash with the definitions here
+#undef _FORTIFY_SOURCE
+
+#include "Rpmbd.h"
+#include "RpmbFrame.h"
+#include "RpmbLog.h"
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <linux/ioctl.h>
+#include <linux/mmc/ioctl.h>
+
+#include <cerrno>
+#include <cstdarg>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#define ERR(fmt, ...) RPMB_LOG(RpmbLog::Error, "[rpmb-preload] " fmt, ##__VA_ARGS__)
+
+namespace {
+
+const size_t MAX_CMDS = 255;                                // MMC_IOC_MAX_CMDS
+const size_t MAX_CMD_DATA = size_t(0xFFFF) * RPMB_FRAME_SIZE;
+
+using OpenFn = int (*)(const char*, int, ...);
+using OpenatFn = int (*)(int, const char*, int, ...);
+using CloseFn = int (*)(int);
+using DupFn = int (*)(int);
+using Dup2Fn = int (*)(int, int);
+using Dup3Fn = int (*)(int, int, int);
+using FcntlFn = int (*)(int, int, ...);
+using IoctlFn = int (*)(int, unsigned long, ...);
+
+template <class Fn>
+Fn Next(const char* name) {
+    return reinterpret_cast<Fn>(::dlsym(RTLD_NEXT, name));
+}
+
+const char* Env(const char* name, const char* def) {
+    const char* v = std::getenv(name);
+    return (v && *v) ? v : def;
+}
+
+// The device: one core, one session per open(), shared by the dups of its fd
+struct Device {
+    std::string path = Env("RPMBD_DEV", "/dev/mmcblk2rpmb");
+
+    std::once_flag once;
+    std::unique_ptr<Rpmbd> core;
+
+    std::mutex mu;
+    std::unordered_map<int, std::shared_ptr<Rpmbd::Session>> sessions;    // mu
+    uint32_t nextSession = 1;                                              // mu
+
+    void Init();
+    // Keeps the session alive while an ioctl runs, even if fd is closed
+    std::shared_ptr<Rpmbd::Session> Find(int fd);
+    // newfd now refers to what fd refers to (after a successful dup)
+    void Dup(int fd, int newfd);
+};
+
+// Never destroyed: close() may still come in from other exit handlers
+Device& Dev() {
+    static Device* d = new Device();
+    return *d;
+}
+
+void Device::Init() {
+    RpmbLog::Level level = RpmbLog::Error;
+    RpmbLog::ParseLevel(Env("RPMBD_LOG_LEVEL", "error"), level);
+    RpmbLog::SetLevel(level);
+
+    Rpmbd::Options o;
+    o.stateFile = Env("RPMBD_STATE_FILE", "rpmb_state.bin");
+    o.keyFile = Env("RPMBD_KEY", "");
+
+    const unsigned long blocks = std::strtoul(Env("RPMBD_MAX_BLOCKS", "128"), nullptr, 10);
+    if (blocks >= 1 && blocks <= RpmbStateFile::MAX_BLOCKS)
+        o.maxBlocks = uint32_t(blocks);
+    else
+        ERR("RPMBD_MAX_BLOCKS out of range, using %u", o.maxBlocks);
+
+    const std::string durability = Env("RPMBD_DURABILITY", "strict");
+    if (durability == "group")
+        o.durability = RpmbStateFile::Durability::Group;
+    else if (durability == "volatile")
+        o.durability = RpmbStateFile::Durability::Volatile;
+    else if (durability != "strict")
+        ERR("unknown RPMBD_DURABILITY '%s', using strict", durability.c_str());
+
+    std::string err;
+    if (!RpmbTiming::Parse(Env("RPMBD_TIMING", "none"), o.timing, err))
+        ERR("RPMBD_TIMING: %s, using none", err.c_str());
+
+    core.reset(new Rpmbd(o));
+
+    // Flushes the state (Durability::Group) at exit
+    std::atexit([] { Dev().core.reset(); });
+}
+
+std::shared_ptr<Rpmbd::Session> Device::Find(int fd) {
+    std::lock_guard<std::mutex> lk(mu);
+    auto it = sessions.find(fd);
+    return it == sessions.end() ? nullptr : it->second;
+}
+
+void Device::Dup(int fd, int newfd) {
+    if (newfd < 0 || newfd == fd) return;
+    std::lock_guard<std::mutex> lk(mu);
+    auto it = sessions.find(fd);
+    if (it != sessions.end())
+        sessions[newfd] = it->second;
+    else
+        sessions.erase(newfd);      // dup2/dup3 closed whatever newfd was
+}
+
+// Chain data is the caller's own memory: used in place, no copies
+class DirectChainIo : public Rpmbd::ChainIo {
+public:
+    explicit DirectChainIo(const mmc_ioc_cmd* cmds) : cmds_(cmds) {}
+
+    uint8_t* Map(size_t cmd, size_t off, size_t) override { return Base(cmd) + off; }
+
+    bool Read(size_t cmd, size_t off, uint8_t* dst, size_t len) override {
+        std::memcpy(dst, Base(cmd) + off, len);
+        return true;
+    }
+
+    bool Write(size_t cmd, size_t off, const uint8_t* src, size_t len) override {
+        std::memcpy(Base(cmd) + off, src, len);
+        return true;
+    }
+
+private:
+    const mmc_ioc_cmd* cmds_;
+
+    uint8_t* Base(size_t cmd) { return reinterpret_cast<uint8_t*>(uintptr_t(cmds_[cmd].data_ptr)); }
+};
+
+// MMC_IOC_MULTI_CMD, validated like the CUSE frontend does. 0 or errno.
+int MultiCmd(Rpmbd& core, Rpmbd::Session& s, const mmc_ioc_multi_cmd* multi) {
+    if (!multi) return EFAULT;
+
+    const size_t count = multi->num_of_cmds;
+    if (count == 0 || count > MAX_CMDS) {
+        ERR("suspicious num_of_cmds=%zu -> EINVAL", count);
+        return EINVAL;
+    }
+
+    Rpmbd::MmcCmd chain[MAX_CMDS];
+    for (size_t i = 0; i < count; ++i) {
+        const mmc_ioc_cmd& c = multi->cmds[i];
+        chain[i].opcode = c.opcode;
+        chain[i].blocks = c.blocks;
+        chain[i].dataLen = 0;
+
+        if (c.opcode == 23 || c.opcode == 12) continue;
+        if (c.opcode != 25 && c.opcode != 18) {
+            ERR("unsupported opcode=%u -> EIO", c.opcode);
+            return EIO;
+        }
+
+        const size_t dlen = size_t(c.blocks) * size_t(c.blksz);
+        if (dlen == 0 || c.data_ptr == 0 || dlen > MAX_CMD_DATA) {
+            ERR("CMD%u bad buffer dlen=%zu -> EIO", c.opcode, dlen);
+            return EIO;
+        }
+        chain[i].dataLen = uint32_t(dlen);
+    }
+
+    DirectChainIo io(multi->cmds);
+    uint64_t readyAtNs;
+    {
+        std::lock_guard<std::mutex> lk(s.mu);
+        core.ExecuteChain(s, chain, count, io);
+        readyAtNs = s.readyAtNs;
+    }
+
+    // The caller blocks in the ioctl, as with a real device
+    if (readyAtNs) {
+        const timespec ts{ time_t(readyAtNs / 1000000000ull), long(readyAtNs % 1000000000ull) };
+        while (::clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR) {}
+    }
+    return 0;
+}
+
+// Opens the stand-in fd of a new session: a real fd, so that the fd number
+// is reserved and calls not interposed here (poll, fstat, ...) accept it
+int OpenDevice(int flags) {
+    static const OpenFn next = Next<OpenFn>("open");
+    Device& d = Dev();
+    std::call_once(d.once, [&d] { d.Init(); });
+
+    const int fd = next("/dev/null", O_RDWR | (flags & O_CLOEXEC));
+    if (fd < 0) return fd;
+
+    std::lock_guard<std::mutex> lk(d.mu);
+    std::shared_ptr<Rpmbd::Session> s = std::make_shared<Rpmbd::Session>();
+    s->id = d.nextSession++;
+    d.sessions[fd] = std::move(s);
+    return fd;
+}
+
+bool IsDevice(const char* path) {
+    return path && Dev().path == path;
+}
+
+mode_t ModeArg(int flags, va_list ap) {
+    return (flags & (O_CREAT | O_TMPFILE)) ? mode_t(va_arg(ap, int)) : 0;
+}
+
+} // namespace
+
+// ----------------------------------------------------------------------
+// Interposed libc entry points
+
+extern "C" {
+
+int open(const char* path, int flags, ...) {
+    static const OpenFn next = Next<OpenFn>("open");
+    va_list ap;
+    va_start(ap, flags);
+    const mode_t mode = ModeArg(flags, ap);
+    va_end(ap);
+    return IsDevice(path) ? OpenDevice(flags) : next(path, flags, mode);
+}
+
+int open64(const char* path, int flags, ...) {
+    static const OpenFn next = Next<OpenFn>("open64");
+    va_list ap;
+    va_start(ap, flags);
+    const mode_t mode = ModeArg(flags, ap);
+    va_end(ap);
+    return IsDevice(path) ? OpenDevice(flags) : next(path, flags, mode);
+}
+
+int openat(int dirfd, const char* path, int flags, ...) {
+    static const OpenatFn next = Next<OpenatFn>("openat");
+    va_list ap;
+    va_start(ap, flags);
+    const mode_t mode = ModeArg(flags, ap);
+    va_end(ap);
+    return IsDevice(path) ? OpenDevice(flags) : next(dirfd, path, flags, mode);
+}
+
+int openat64(int dirfd, const char* path, int flags, ...) {
+    static const OpenatFn next = Next<OpenatFn>("openat64");
+    va_list ap;
+    va_start(ap, flags);
+    const mode_t mode = ModeArg(flags, ap);
+    va_end(ap);
+    return IsDevice(path) ? OpenDevice(flags) : next(dirfd, path, flags, mode);
+}
+
+// Fortified callers (_FORTIFY_SOURCE) come in through these
+int __open_2(const char* path, int flags) { return open(path, flags); }
+int __open64_2(const char* path, int flags) { return open64(path, flags); }
+int __openat_2(int dirfd, const char* path, int flags) { return openat(dirfd, path, flags); }
+int __openat64_2(int dirfd, const char* path, int flags) { return openat64(dirfd, path, flags); }
+
+int close(int fd) {
+    static const CloseFn next = Next<CloseFn>("close");
+    Device& d = Dev();
+    {
+        std::lock_guard<std::mutex> lk(d.mu);
+        d.sessions.erase(fd);
+    }
+    return next(fd);
+}
+
+int dup(int fd) {
+    static const DupFn next = Next<DupFn>("dup");
+    const int newfd = next(fd);
+    Dev().Dup(fd, newfd);
+    return newfd;
+}
+
+int dup2(int fd, int newfd) {
+    static const Dup2Fn next = Next<Dup2Fn>("dup2");
+    const int r = next(fd, newfd);
+    Dev().Dup(fd, r);
+    return r;
+}
+
+int dup3(int fd, int newfd, int flags) {
+    static const Dup3Fn next = Next<Dup3Fn>("dup3");
+    const int r = next(fd, newfd, flags);
+    Dev().Dup(fd, r);
+    return r;
+}
+
+int fcntl(int fd, int cmd, ...) {
+    static const FcntlFn next = Next<FcntlFn>("fcntl");
+    va_list ap;
+    va_start(ap, cmd);
+    void* arg = va_arg(ap, void*);  // int or pointer, passed on as is
+    va_end(ap);
+
+    const int r = next(fd, cmd, arg);
+    if (cmd == F_DUPFD || cmd == F_DUPFD_CLOEXEC) Dev().Dup(fd, r);
+    return r;
+}
+
+int fcntl64(int fd, int cmd, ...) {
+    static const FcntlFn next = Next<FcntlFn>("fcntl64");
+    va_list ap;
+    va_start(ap, cmd);
+    void* arg = va_arg(ap, void*);
+    va_end(ap);
+
+    const int r = next(fd, cmd, arg);
+    if (cmd == F_DUPFD || cmd == F_DUPFD_CLOEXEC) Dev().Dup(fd, r);
+    return r;
+}
+
+int ioctl(int fd, unsigned long request, ...) {
+    static const IoctlFn next = Next<IoctlFn>("ioctl");
+    va_list ap;
+    va_start(ap, request);
+    void* arg = va_arg(ap, void*);
+    va_end(ap);
+
+    Device& d = Dev();
+    const std::shared_ptr<Rpmbd::Session> s = d.Find(fd);
+    if (!s) return next(fd, request, arg);
+
+    const int err = !d.core ? EIO
+        : (request == MMC_IOC_MULTI_CMD)
+        ? MultiCmd(*d.core, *s, static_cast<const mmc_ioc_multi_cmd*>(arg))
+        : ENOTTY;
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+} // extern "C"
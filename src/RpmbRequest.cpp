@@ -0,0 +1,93 @@
+#include "RpmbRequest.h"
+
+#include <cstring>
+
+static uint16_t Be16(const uint8_t* p) {
+    return (uint16_t(p[0]) << 8) | uint16_t(p[1]);
+}
+static uint32_t Be32(const uint8_t* p) {
+    return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) |
+           (uint32_t(p[2]) << 8) | uint32_t(p[3]);
+}
+static void SetBe16(uint8_t* p, uint16_t v) {
+    p[0] = uint8_t(v >> 8);
+    p[1] = uint8_t(v);
+}
+static void SetBe32(uint8_t* p, uint32_t v) {
+    p[0] = uint8_t(v >> 24);
+    p[1] = uint8_t(v >> 16);
+    p[2] = uint8_t(v >> 8);
+    p[3] = uint8_t(v);
+}
+
+// ----------------------------------------------------------------------
+
+void RpmbReqProgramKey(uint8_t* frame, const uint8_t key[32]) {
+    std::memset(frame, 0, RPMB_FRAME_SIZE);
+    std::memcpy(frame + OFF_MAC, key, 32);
+    SetBe16(frame + OFF_REQRESP, RPMB_REQ_PROGRAM_KEY);
+}
+
+void RpmbReqGetCounter(uint8_t* frame, const uint8_t nonce[16]) {
+    std::memset(frame, 0, RPMB_FRAME_SIZE);
+    std::memcpy(frame + OFF_NONCE, nonce, 16);
+    SetBe16(frame + OFF_REQRESP, RPMB_REQ_GET_COUNTER);
+}
+
+void RpmbReqResultRead(uint8_t* frame) {
+    std::memset(frame, 0, RPMB_FRAME_SIZE);
+    SetBe16(frame + OFF_REQRESP, RPMB_REQ_RESULT_READ);
+}
+
+void RpmbReqDataRead(uint8_t* frame, uint16_t addr, uint16_t blkCnt, const uint8_t nonce[16]) {
+    std::memset(frame, 0, RPMB_FRAME_SIZE);
+    std::memcpy(frame + OFF_NONCE, nonce, 16);
+    SetBe16(frame + OFF_ADDR, addr);
+    SetBe16(frame + OFF_BLOCK_COUNT, blkCnt);
+    SetBe16(frame + OFF_REQRESP, RPMB_REQ_DATA_READ);
+}
+
+void RpmbReqDataWrite(uint8_t* frames, uint16_t addr, uint16_t count,
+                      uint32_t writeCounter, const uint8_t* data, const RpmbMacKey& mac) {
+    for (uint16_t i = 0; i < count; ++i) {
+        uint8_t* f = frames + size_t(i) * RPMB_FRAME_SIZE;
+        std::memset(f, 0, RPMB_FRAME_SIZE);
+        std::memcpy(f + OFF_DATA, data + size_t(i) * 256, 256);
+        SetBe32(f + OFF_WCOUNTER, writeCounter);
+        SetBe16(f + OFF_ADDR, addr);
+        SetBe16(f + OFF_BLOCK_COUNT, count);
+        SetBe16(f + OFF_REQRESP, RPMB_REQ_DATA_WRITE);
+        mac.Mac(f, 1, f + OFF_MAC);
+    }
+}
+
+// ----------------------------------------------------------------------
+
+uint16_t RpmbRespType(const uint8_t* frame) {
+    return Be16(frame + OFF_REQRESP);
+}
+
+uint16_t RpmbRespResult(const uint8_t* frame) {
+    return Be16(frame + OFF_RESULT);
+}
+
+uint32_t RpmbRespWriteCounter(const uint8_t* frame) {
+    return Be32(frame + OFF_WCOUNTER);
+}
+
+bool RpmbRespCheck(const uint8_t* frames, size_t blkCnt, uint16_t respType,
+                   const RpmbMacKey* mac, const uint8_t* nonce) {
+    if (blkCnt == 0) return false;
+    const uint8_t* last = frames + (blkCnt - 1) * RPMB_FRAME_SIZE;
+
+    if (RpmbRespType(last) != respType || RpmbRespResult(last) != RPMB_RES_OK)
+        return false;
+    if (nonce && std::memcmp(last + OFF_NONCE, nonce, 16) != 0)
+        return false;
+    if (mac) {
+        uint8_t expect[32];
+        mac->Mac(frames, blkCnt, expect);
+        if (std::memcmp(expect, last + OFF_MAC, 32) != 0) return false;
+    }
+    return true;
+}
@@ -0,0 +1,31 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+#include "RpmbFrame.h"
+#include "RpmbMac.h"
+
+// Host side of the RPMB protocol: builds request frames and checks response
+// frames the way mmc-utils does. Used by the tools (rpmbd_bench,
+// rpmbd_loadgen); the daemon itself does not need it.
+//
+// All frames are RPMB_FRAME_SIZE bytes; builders zero the frame first.
+
+void RpmbReqProgramKey(uint8_t* frame, const uint8_t key[32]);
+void RpmbReqGetCounter(uint8_t* frame, const uint8_t nonce[16]);
+void RpmbReqResultRead(uint8_t* frame);
+void RpmbReqDataRead(uint8_t* frame, uint16_t addr, uint16_t blkCnt, const uint8_t nonce[16]);
+
+// count consecutive frames writing data (count * 256 bytes) to addr; every
+// frame carries its own MAC
+void RpmbReqDataWrite(uint8_t* frames, uint16_t addr, uint16_t count,
+                      uint32_t writeCounter, const uint8_t* data, const RpmbMacKey& mac);
+
+uint16_t RpmbRespType(const uint8_t* frame);
+uint16_t RpmbRespResult(const uint8_t* frame);
+uint32_t RpmbRespWriteCounter(const uint8_t* frame);
+
+// Checks type and result (OK) of a response of blkCnt frames; with mac
+// (and nonce, if given) also the MAC in the last frame and the nonce echo.
+bool RpmbRespCheck(const uint8_t* frames, size_t blkCnt, uint16_t respType,
+                   const RpmbMacKey* mac = nullptr, const uint8_t* nonce = nullptr);
@@ -0,0 +1,52 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// Accessors for state behind a seqlock (Rpmbd::seq_, RpmbMacCache entries).
+// Readers copy it while a writer may be changing it and drop the copy when
+// the sequence moved, so the two race by design. Both sides go through
+// relaxed atomic accesses, which keeps that race defined (and
+// ThreadSanitizer quiet) and still compiles to plain moves; the fences
+// around the sequence counter order them.
+
+template <class T>
+inline T SeqlockLoad(const T& src) {
+    return __atomic_load_n(&src, __ATOMIC_RELAXED);
+}
+
+template <class T>
+inline void SeqlockStore(T& dst, T v) {
+    __atomic_store_n(&dst, v, __ATOMIC_RELAXED);
+}
+
+namespace rpmb_seqlock {
+typedef uint64_t __attribute__((may_alias)) Word;
+}
+
+// len bytes out of shared memory, 8 at a time once shared is aligned
+inline void SeqlockRead(void* dst, const void* shared, size_t len) {
+    using rpmb_seqlock::Word;
+    uint8_t* d = static_cast<uint8_t*>(dst);
+    const uint8_t* s = static_cast<const uint8_t*>(shared);
+    for (; len && (uintptr_t(s) & 7); --len) *d++ = __atomic_load_n(s++, __ATOMIC_RELAXED);
+    for (; len >= 8; len -= 8, s += 8, d += 8) {
+        const Word w = __atomic_load_n(reinterpret_cast<const Word*>(s), __ATOMIC_RELAXED);
+        std::memcpy(d, &w, 8);
+    }
+    for (; len; --len) *d++ = __atomic_load_n(s++, __ATOMIC_RELAXED);
+}
+
+// len bytes into shared memory, split the same way as SeqlockRead
+inline void SeqlockWrite(void* shared, const void* src, size_t len) {
+    using rpmb_seqlock::Word;
+    uint8_t* d = static_cast<uint8_t*>(shared);
+    const uint8_t* s = static_cast<const uint8_t*>(src);
+    for (; len && (uintptr_t(d) & 7); --len) __atomic_store_n(d++, *s++, __ATOMIC_RELAXED);
+    for (; len >= 8; len -= 8, s += 8, d += 8) {
+        Word w;
+        std::memcpy(&w, s, 8);
+        __atomic_store_n(reinterpret_cast<Word*>(d), w, __ATOMIC_RELAXED);
+    }
+    for (; len; --len) __atomic_store_n(d++, *s++, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,213 @@
+#include "RpmbSha256.h"
+
+#include <cstring>
+#include <openssl/sha.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#define RPMB_SHA_X86 1
+#endif
+
+const uint32_t RPMB_SHA256_IV[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+const uint32_t RPMB_SHA256_K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+// ----------------------------------------------------------------------
+// Portable kernel
+
+static inline uint32_t Rotr(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+static inline uint32_t LoadBe32(const uint8_t* p) {
+    return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) |
+           (uint32_t(p[2]) <<  8) |  uint32_t(p[3]);
+}
+
+static void CompressScalar(uint32_t state[8], const uint8_t* blocks, size_t n) {
+    for (size_t blk = 0; blk < n; ++blk, blocks += 64) {
+        uint32_t w[64];
+        for (int t = 0; t < 16; ++t) w[t] = LoadBe32(blocks + 4 * t);
+        for (int t = 16; t < 64; ++t) {
+            const uint32_t s0 = Rotr(w[t - 15], 7) ^ Rotr(w[t - 15], 18) ^ (w[t - 15] >> 3);
+            const uint32_t s1 = Rotr(w[t - 2], 17) ^ Rotr(w[t - 2], 19) ^ (w[t - 2] >> 10);
+            w[t] = w[t - 16] + s0 + w[t - 7] + s1;
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+
+        for (int t = 0; t < 64; ++t) {
+            const uint32_t S1 = Rotr(e, 6) ^ Rotr(e, 11) ^ Rotr(e, 25);
+            const uint32_t ch = (e & f) ^ (~e & g);
+            const uint32_t t1 = h + S1 + ch + RPMB_SHA256_K[t] + w[t];
+            const uint32_t S0 = Rotr(a, 2) ^ Rotr(a, 13) ^ Rotr(a, 22);
+            const uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+            const uint32_t t2 = S0 + maj;
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+    }
+}
+
+// ----------------------------------------------------------------------
+// OpenSSL reference
+
+static void CompressOpenssl(uint32_t state[8], const uint8_t* blocks, size_t n) {
+    SHA256_CTX ctx;
+    SHA256_Init(&ctx);
+    std::memcpy(ctx.h, state, 32);
+    for (size_t blk = 0; blk < n; ++blk)
+        SHA256_Transform(&ctx, blocks + 64 * blk);
+    std::memcpy(state, ctx.h, 32);
+}
+
+// ----------------------------------------------------------------------
+// Lane fallbacks: one stream after the other
+
+template <RpmbShaBackend::CompressFn F>
+static void CompressLanesSerial(uint32_t* const states[], const uint8_t* const blocks[],
+                                size_t lanes, size_t n) {
+    for (size_t l = 0; l < lanes; ++l) F(states[l], blocks[l], n);
+}
+
+// ----------------------------------------------------------------------
+// CPU features
+
+#ifdef RPMB_SHA_X86
+static bool OsSavesYmm() {
+    unsigned a, b, c, d;
+    if (!__get_cpuid(1, &a, &b, &c, &d)) return false;
+    if (!(c & bit_OSXSAVE) || !(c & bit_AVX)) return false;
+    uint32_t lo, hi;
+    __asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+    return (lo & 0x6) == 0x6;   // XMM and YMM state enabled
+}
+
+bool RpmbCpuHasShaNi() {
+    unsigned a, b, c, d;
+    if (!__get_cpuid(1, &a, &b, &c, &d)) return false;
+    if (!(c & bit_SSE4_1) || !(c & bit_SSSE3)) return false;
+    if (!__get_cpuid_count(7, 0, &a, &b, &c, &d)) return false;
+    return (b & bit_SHA) != 0;
+}
+
+bool RpmbCpuHasAvx2() {
+    unsigned a, b, c, d;
+    if (!__get_cpuid_count(7, 0, &a, &b, &c, &d)) return false;
+    return (b & bit_AVX2) && OsSavesYmm();
+}
+#else
+bool RpmbCpuHasShaNi() { return false; }
+bool RpmbCpuHasAvx2() { return false; }
+#endif
+
+// ----------------------------------------------------------------------
+
+static const RpmbShaBackend kOpenssl = {
+    "openssl", CompressOpenssl, CompressLanesSerial<CompressOpenssl>
+};
+static const RpmbShaBackend kScalar = {
+    "scalar", CompressScalar, CompressLanesSerial<CompressScalar>
+};
+
+#ifdef RPMB_SHA_X86
+static const RpmbShaBackend kShaNi = {
+    "shani", RpmbSha256CompressShaNi, CompressLanesSerial<RpmbSha256CompressShaNi>
+};
+static const RpmbShaBackend kAvx2 = {
+    "avx2", CompressScalar, RpmbSha256CompressLanesAvx2
+};
+static const RpmbShaBackend kShaNiAvx2 = {
+    "shani+avx2", RpmbSha256CompressShaNi, RpmbSha256CompressLanesAvx2
+};
+#endif
+
+const RpmbShaBackend& RpmbShaReference() {
+    return kOpenssl;
+}
+
+const RpmbShaBackend* RpmbShaFind(const std::string& name) {
+    if (name == "openssl") return &kOpenssl;
+    if (name == "scalar") return &kScalar;
+#ifdef RPMB_SHA_X86
+    const bool sha = RpmbCpuHasShaNi();
+    const bool avx2 = RpmbCpuHasAvx2();
+    if (name == "shani") return sha ? &kShaNi : nullptr;
+    if (name == "avx2") return avx2 ? &kAvx2 : nullptr;
+    if (name == "auto") {
+        if (sha && avx2) return &kShaNiAvx2;
+        if (sha) return &kShaNi;
+        if (avx2) return &kAvx2;
+        return &kScalar;
+    }
+#else
+    if (name == "auto") return &kScalar;
+#endif
+    return nullptr;
+}
+
+// ----------------------------------------------------------------------
+// Self test
+
+bool RpmbShaSelfTest(const RpmbShaBackend& b) {
+    const size_t MAX_BLOCKS = 5;
+    uint8_t data[RpmbShaBackend::MAX_LANES][64 * MAX_BLOCKS];
+
+    // Deterministic pseudo-random input (xorshift)
+    uint32_t x = 0x2545f491;
+    for (auto& lane : data)
+        for (auto& byte : lane) {
+            x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+            byte = uint8_t(x);
+        }
+
+    for (size_t n = 1; n <= MAX_BLOCKS; ++n) {
+        uint32_t ref[RpmbShaBackend::MAX_LANES][8];
+        uint32_t got[RpmbShaBackend::MAX_LANES][8];
+        uint32_t* states[RpmbShaBackend::MAX_LANES];
+        const uint8_t* blocks[RpmbShaBackend::MAX_LANES];
+
+        for (size_t l = 0; l < RpmbShaBackend::MAX_LANES; ++l) {
+            // Different start states per lane
+            for (int i = 0; i < 8; ++i) ref[l][i] = RPMB_SHA256_IV[i] + uint32_t(l * 0x01010101);
+            std::memcpy(got[l], ref[l], 32);
+            CompressOpenssl(ref[l], data[l], n);
+        }
+
+        // Single stream
+        for (size_t l = 0; l < RpmbShaBackend::MAX_LANES; ++l) {
+            uint32_t s[8];
+            std::memcpy(s, got[l], 32);
+            b.compress(s, data[l], n);
+            if (std::memcmp(s, ref[l], 32) != 0) return false;
+        }
+
+        // All lane counts, so partially filled batches are covered too
+        for (size_t lanes = 1; lanes <= RpmbShaBackend::MAX_LANES; ++lanes) {
+            uint32_t s[RpmbShaBackend::MAX_LANES][8];
+            for (size_t l = 0; l < lanes; ++l) {
+                std::memcpy(s[l], got[l], 32);
+                states[l] = s[l];
+                blocks[l] = data[l];
+            }
+            b.compressLanes(states, blocks, lanes, n);
+            for (size_t l = 0; l < lanes; ++l)
+                if (std::memcmp(s[l], ref[l], 32) != 0) return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,52 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// SHA-256 compression backends used by the MAC code (RpmbMac).
+//
+// A backend only provides the block compression function, in a single-stream
+// and a multi-lane form; padding and HMAC framing are shared. Backends:
+//   openssl  reference, OpenSSL's SHA256_Transform
+//   scalar   portable C++
+//   shani    x86 SHA extensions
+//   avx2     8 independent streams per call in 256-bit lanes
+//   auto     best single-stream + best multi-lane kernel of this CPU
+struct RpmbShaBackend {
+    static const size_t MAX_LANES = 8;
+
+    // Compresses n consecutive 64-byte blocks into state
+    typedef void (*CompressFn)(uint32_t state[8], const uint8_t* blocks, size_t n);
+
+    // Compresses n consecutive blocks for each of lanes (<= MAX_LANES)
+    // independent streams
+    typedef void (*CompressLanesFn)(uint32_t* const states[], const uint8_t* const blocks[],
+                                    size_t lanes, size_t n);
+
+    const char* name;
+    CompressFn compress;
+    CompressLanesFn compressLanes;
+};
+
+// SHA-256 initial hash value and round constants
+extern const uint32_t RPMB_SHA256_IV[8];
+extern const uint32_t RPMB_SHA256_K[64];
+
+// The OpenSSL backend, always available
+const RpmbShaBackend& RpmbShaReference();
+
+// Returns the named backend, or nullptr if unknown or not supported by
+// this CPU
+const RpmbShaBackend* RpmbShaFind(const std::string& name);
+
+// Cross-checks a backend against the OpenSSL reference (single and
+// multi-lane, several block counts). Returns false on any mismatch.
+bool RpmbShaSelfTest(const RpmbShaBackend& b);
+
+// Kernels (RpmbSha256ShaNi.cpp / RpmbSha256Avx2.cpp); x86 only, callers
+// check RpmbCpuHasShaNi()/RpmbCpuHasAvx2() first
+bool RpmbCpuHasShaNi();
+bool RpmbCpuHasAvx2();
+void RpmbSha256CompressShaNi(uint32_t state[8], const uint8_t* blocks, size_t n);
+void RpmbSha256CompressLanesAvx2(uint32_t* const states[], const uint8_t* const blocks[],
+                                 size_t lanes, size_t n);
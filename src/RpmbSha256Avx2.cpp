@@ -0,0 +1,124 @@
+// Multi-buffer SHA-256: 8 independent streams, one per 32-bit lane of a
+// 256-bit register. Every stream compresses the same number of blocks;
+// unused lanes hash a copy of lane 0 and are discarded.
+// Compiled for the baseline target; only called after a CPUID check.
+
+#include "RpmbSha256.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+#define RPMB_AVX2_TARGET __attribute__((target("avx2")))
+
+template <int N>
+RPMB_AVX2_TARGET static inline __m256i Rotr(__m256i x) {
+    return _mm256_or_si256(_mm256_srli_epi32(x, N), _mm256_slli_epi32(x, 32 - N));
+}
+
+// r[l] = 8 message words of lane l  ->  r[j] = word j of all lanes
+RPMB_AVX2_TARGET static inline void Transpose8x8(__m256i r[8]) {
+    const __m256i t0 = _mm256_unpacklo_epi32(r[0], r[1]);
+    const __m256i t1 = _mm256_unpackhi_epi32(r[0], r[1]);
+    const __m256i t2 = _mm256_unpacklo_epi32(r[2], r[3]);
+    const __m256i t3 = _mm256_unpackhi_epi32(r[2], r[3]);
+    const __m256i t4 = _mm256_unpacklo_epi32(r[4], r[5]);
+    const __m256i t5 = _mm256_unpackhi_epi32(r[4], r[5]);
+    const __m256i t6 = _mm256_unpacklo_epi32(r[6], r[7]);
+    const __m256i t7 = _mm256_unpackhi_epi32(r[6], r[7]);
+
+    const __m256i u0 = _mm256_unpacklo_epi64(t0, t2);
+    const __m256i u1 = _mm256_unpackhi_epi64(t0, t2);
+    const __m256i u2 = _mm256_unpacklo_epi64(t1, t3);
+    const __m256i u3 = _mm256_unpackhi_epi64(t1, t3);
+    const __m256i u4 = _mm256_unpacklo_epi64(t4, t6);
+    const __m256i u5 = _mm256_unpackhi_epi64(t4, t6);
+    const __m256i u6 = _mm256_unpacklo_epi64(t5, t7);
+    const __m256i u7 = _mm256_unpackhi_epi64(t5, t7);
+
+    r[0] = _mm256_permute2x128_si256(u0, u4, 0x20);
+    r[1] = _mm256_permute2x128_si256(u1, u5, 0x20);
+    r[2] = _mm256_permute2x128_si256(u2, u6, 0x20);
+    r[3] = _mm256_permute2x128_si256(u3, u7, 0x20);
+    r[4] = _mm256_permute2x128_si256(u0, u4, 0x31);
+    r[5] = _mm256_permute2x128_si256(u1, u5, 0x31);
+    r[6] = _mm256_permute2x128_si256(u2, u6, 0x31);
+    r[7] = _mm256_permute2x128_si256(u3, u7, 0x31);
+}
+
+RPMB_AVX2_TARGET
+void RpmbSha256CompressLanesAvx2(uint32_t* const states[], const uint8_t* const blocks[],
+                                 size_t lanes, size_t n) {
+    if (lanes == 0) return;
+    if (lanes > RpmbShaBackend::MAX_LANES) lanes = RpmbShaBackend::MAX_LANES;
+
+    const uint8_t* src[8];
+    alignas(32) uint32_t st[8][8];      // st[word][lane]
+    for (size_t l = 0; l < 8; ++l) {
+        const size_t from = l < lanes ? l : 0;
+        src[l] = blocks[from];
+        for (int i = 0; i < 8; ++i) st[i][l] = states[from][i];
+    }
+
+    __m256i s[8];
+    for (int i = 0; i < 8; ++i)
+        s[i] = _mm256_load_si256(reinterpret_cast<const __m256i*>(st[i]));
+
+    const __m256i BSWAP = _mm256_set_epi64x(
+        0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL,
+        0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+    for (size_t blk = 0; blk < n; ++blk) {
+        __m256i w[16];
+        for (int half = 0; half < 2; ++half) {
+            __m256i* r = w + 8 * half;
+            for (int l = 0; l < 8; ++l) {
+                r[l] = _mm256_loadu_si256(
+                    reinterpret_cast<const __m256i*>(src[l] + 64 * blk + 32 * half));
+                r[l] = _mm256_shuffle_epi8(r[l], BSWAP);
+            }
+            Transpose8x8(r);
+        }
+
+        __m256i a = s[0], b = s[1], c = s[2], d = s[3];
+        __m256i e = s[4], f = s[5], g = s[6], h = s[7];
+
+        for (int t = 0; t < 64; ++t) {
+            __m256i& wt = w[t & 15];
+            if (t >= 16) {
+                const __m256i w15 = w[(t + 1) & 15];
+                const __m256i w2 = w[(t + 14) & 15];
+                const __m256i s0 = _mm256_xor_si256(_mm256_xor_si256(Rotr<7>(w15), Rotr<18>(w15)),
+                                                    _mm256_srli_epi32(w15, 3));
+                const __m256i s1 = _mm256_xor_si256(_mm256_xor_si256(Rotr<17>(w2), Rotr<19>(w2)),
+                                                    _mm256_srli_epi32(w2, 10));
+                wt = _mm256_add_epi32(_mm256_add_epi32(wt, s0),
+                                      _mm256_add_epi32(w[(t + 9) & 15], s1));
+            }
+
+            const __m256i S1 = _mm256_xor_si256(_mm256_xor_si256(Rotr<6>(e), Rotr<11>(e)), Rotr<25>(e));
+            const __m256i ch = _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g));
+            const __m256i k = _mm256_set1_epi32(int(RPMB_SHA256_K[t]));
+            const __m256i t1 = _mm256_add_epi32(_mm256_add_epi32(h, S1),
+                                                _mm256_add_epi32(_mm256_add_epi32(ch, k), wt));
+            const __m256i S0 = _mm256_xor_si256(_mm256_xor_si256(Rotr<2>(a), Rotr<13>(a)), Rotr<22>(a));
+            const __m256i maj = _mm256_or_si256(_mm256_and_si256(a, b),
+                                                _mm256_and_si256(c, _mm256_or_si256(a, b)));
+            const __m256i t2 = _mm256_add_epi32(S0, maj);
+
+            h = g; g = f; f = e; e = _mm256_add_epi32(d, t1);
+            d = c; c = b; b = a; a = _mm256_add_epi32(t1, t2);
+        }
+
+        s[0] = _mm256_add_epi32(s[0], a); s[1] = _mm256_add_epi32(s[1], b);
+        s[2] = _mm256_add_epi32(s[2], c); s[3] = _mm256_add_epi32(s[3], d);
+        s[4] = _mm256_add_epi32(s[4], e); s[5] = _mm256_add_epi32(s[5], f);
+        s[6] = _mm256_add_epi32(s[6], g); s[7] = _mm256_add_epi32(s[7], h);
+    }
+
+    for (int i = 0; i < 8; ++i)
+        _mm256_store_si256(reinterpret_cast<__m256i*>(st[i]), s[i]);
+    for (size_t l = 0; l < lanes; ++l)
+        for (int i = 0; i < 8; ++i) states[l][i] = st[i][l];
+}
+
+#endif
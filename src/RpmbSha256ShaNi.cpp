@@ -0,0 +1,70 @@
+// SHA-256 compression with the x86 SHA extensions (SHA-NI).
+// Compiled for the baseline target; the kernel enables the needed ISA via
+// function attributes and is only called after a CPUID check.
+
+#include "RpmbSha256.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+#define RPMB_SHANI_TARGET __attribute__((target("sha,sse4.1,ssse3")))
+
+RPMB_SHANI_TARGET
+void RpmbSha256CompressShaNi(uint32_t state[8], const uint8_t* blocks, size_t n) {
+    const __m128i BSWAP = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+    // state is ABCDEFGH; the instructions want ABEF / CDGH
+    __m128i tmp = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&state[0]));
+    __m128i st1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&state[4]));
+    tmp = _mm_shuffle_epi32(tmp, 0xB1);                 // CDAB
+    st1 = _mm_shuffle_epi32(st1, 0x1B);                 // EFGH
+    __m128i st0 = _mm_alignr_epi8(tmp, st1, 8);         // ABEF
+    st1 = _mm_blend_epi16(st1, tmp, 0xF0);              // CDGH
+
+    for (; n; --n, blocks += 64) {
+        const __m128i saveAbef = st0;
+        const __m128i saveCdgh = st1;
+
+        __m128i m[4];
+        for (int i = 0; i < 4; ++i) {
+            m[i] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(blocks + 16 * i));
+            m[i] = _mm_shuffle_epi8(m[i], BSWAP);
+        }
+
+        // 16 groups of 4 rounds; m[g % 4] holds W[4g..4g+3]. The schedule
+        // for later groups is advanced in the shadow of the round pairs.
+        for (int g = 0; g < 16; ++g) {
+            const __m128i k = _mm_loadu_si128(
+                reinterpret_cast<const __m128i*>(&RPMB_SHA256_K[4 * g]));
+            __m128i msg = _mm_add_epi32(m[g & 3], k);
+            st1 = _mm_sha256rnds2_epu32(st1, st0, msg);
+
+            if (g >= 3 && g <= 14) {
+                __m128i& next = m[(g + 1) & 3];
+                next = _mm_add_epi32(next, _mm_alignr_epi8(m[g & 3], m[(g + 3) & 3], 4));
+                next = _mm_sha256msg2_epu32(next, m[g & 3]);
+            }
+
+            msg = _mm_shuffle_epi32(msg, 0x0E);
+            st0 = _mm_sha256rnds2_epu32(st0, st1, msg);
+
+            if (g >= 1 && g <= 12) {
+                __m128i& prev = m[(g + 3) & 3];
+                prev = _mm_sha256msg1_epu32(prev, m[g & 3]);
+            }
+        }
+
+        st0 = _mm_add_epi32(st0, saveAbef);
+        st1 = _mm_add_epi32(st1, saveCdgh);
+    }
+
+    tmp = _mm_shuffle_epi32(st0, 0x1B);                 // FEBA
+    st1 = _mm_shuffle_epi32(st1, 0xB1);                 // DCHG
+    st0 = _mm_blend_epi16(tmp, st1, 0xF0);              // DCBA
+    st1 = _mm_alignr_epi8(st1, tmp, 8);                 // HGFE
+
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(&state[0]), st0);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(&state[4]), st1);
+}
+
+#endif
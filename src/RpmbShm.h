@@ -0,0 +1,73 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Wire format of the shared-memory frontend (RpmbShmServer, RpmbShmClient).
+//
+// A client connects to the Unix socket and sends a Hello. The server answers
+// with a HelloReply and passes three fds (SCM_RIGHTS): a sealed memfd with
+// the Ring, the request doorbell and the completion doorbell (eventfds).
+//
+// Each ring slot carries one MULTI_CMD chain: a SlotHeader with the command
+// list, followed by the data of its CMD25/CMD18 commands back to back in
+// chain order (raw 512-byte RPMB frames). The client fills slot head % slots
+// and advances head; the server runs the chains in order, stores each one's
+// status and advances done. Up to `slots` chains may be in flight, and the
+// server takes every chain that is ready in one go. A doorbell is only rung
+// while its peer sleeps (the *Waiting flags), so a busy ring costs no
+// syscalls. Closing the socket ends the session.
+namespace RpmbShm {
+
+const uint32_t MAGIC = 0x52504d42;      // "RPMB"
+const uint32_t VERSION = 1;
+const uint32_t MAX_CMDS = 255;          // per chain, as MMC_IOC_MAX_CMDS
+const size_t DEV_NAME_LEN = 64;
+
+struct Hello {
+    uint32_t magic;
+    uint32_t version;
+    char dev[DEV_NAME_LEN];     // device name; "" while only one is served
+};
+
+struct HelloReply {
+    int32_t status;             // 0, or -errno (and no fds follow)
+    uint32_t reserved;
+    uint64_t size;              // of the memfd
+};
+
+struct Cmd {
+    uint32_t opcode;            // 23, 25, 18 or 12
+    uint32_t blocks;
+    uint32_t dataLen;           // CMD25/CMD18: bytes in the slot data, n * 512
+    uint32_t reserved;
+};
+
+struct SlotHeader {
+    uint32_t count;             // commands
+    int32_t status;             // by the server: 0, or -errno as the ioctl fails
+    uint32_t reserved[2];
+    Cmd cmds[MAX_CMDS];
+};
+// slot data follows the header: one page in, 4 KiB aligned
+
+static_assert(sizeof(SlotHeader) == 4096, "slot data is page aligned");
+
+struct Ring {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slots;
+    uint32_t reserved;
+    uint64_t slotData;          // data bytes per slot
+    uint64_t slotStride;        // bytes from one slot to the next
+    uint64_t slotsOffset;       // of slot 0, from the start of the Ring
+
+    alignas(64) std::atomic<uint32_t> head;     // chains submitted (client)
+    std::atomic<uint32_t> serverWaiting;        // server sleeps on the request doorbell
+    alignas(64) std::atomic<uint32_t> done;     // chains completed (server)
+    std::atomic<uint32_t> clientWaiting;        // client sleeps on the completion doorbell
+};
+
+static_assert(std::atomic<uint32_t>::is_always_lock_free, "ring counters are shared between processes");
+
+} // namespace RpmbShm
@@ -0,0 +1,252 @@
+#include "RpmbShmClient.h"
+
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "RpmbShm.h"
+
+namespace {
+
+uint64_t NowNs() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000ull + uint64_t(ts.tv_nsec);
+}
+
+inline void CpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+size_t CmdDataLen(const mmc_ioc_cmd& c) {
+    return (c.opcode == 25 || c.opcode == 18) ? size_t(c.blocks) * size_t(c.blksz) : 0;
+}
+
+} // namespace
+
+// ----------------------------------------------------------------------
+
+int RpmbShmClient::Connect(const std::string& socketPath, const std::string& dev) {
+    Close();
+
+    sockaddr_un sa{};
+    sa.sun_family = AF_UNIX;
+    if (socketPath.empty() || socketPath.size() >= sizeof(sa.sun_path) ||
+        dev.size() >= RpmbShm::DEV_NAME_LEN)
+        return -EINVAL;
+    std::memcpy(sa.sun_path, socketPath.c_str(), socketPath.size() + 1);
+
+    fd_ = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd_ < 0) return -errno;
+    if (::connect(fd_, reinterpret_cast<sockaddr*>(&sa), sizeof(sa)) != 0) {
+        const int err = errno;
+        Close();
+        return -err;
+    }
+
+    RpmbShm::Hello hello{};
+    hello.magic = RpmbShm::MAGIC;
+    hello.version = RpmbShm::VERSION;
+    std::memcpy(hello.dev, dev.c_str(), dev.size());
+    if (::send(fd_, &hello, sizeof(hello), MSG_NOSIGNAL) != ssize_t(sizeof(hello))) {
+        const int err = errno;
+        Close();
+        return -err;
+    }
+
+    // Reply, with memfd + request doorbell + completion doorbell
+    RpmbShm::HelloReply reply{};
+    int fds[3] = { -1, -1, -1 };
+    alignas(cmsghdr) char ctl[CMSG_SPACE(sizeof(fds))] = {};
+    iovec iov{ &reply, sizeof(reply) };
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl;
+    msg.msg_controllen = sizeof(ctl);
+
+    ssize_t n;
+    do {
+        n = ::recvmsg(fd_, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+
+    const cmsghdr* cm = CMSG_FIRSTHDR(&msg);
+    if (cm && cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS &&
+        cm->cmsg_len == CMSG_LEN(sizeof(fds)))
+        std::memcpy(fds, CMSG_DATA(cm), sizeof(fds));
+    reqFd_ = fds[1];
+    doneFd_ = fds[2];
+
+    int rc = 0;
+    if (n != ssize_t(sizeof(reply))) rc = n < 0 ? -errno : -ECONNRESET;
+    else if (reply.status) rc = reply.status;
+    else if (fds[0] < 0 || reqFd_ < 0 || doneFd_ < 0) rc = -EPROTO;
+
+    if (!rc) {
+        void* m = ::mmap(nullptr, reply.size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+        if (m == MAP_FAILED) {
+            rc = -errno;
+        } else {
+            ring_ = static_cast<RpmbShm::Ring*>(m);
+            ringLen_ = reply.size;
+        }
+    }
+    if (fds[0] >= 0) ::close(fds[0]);
+
+    if (!rc) {
+        const RpmbShm::Ring& r = *ring_;
+        slots_ = r.slots;
+        slotData_ = r.slotData;
+        slotStride_ = r.slotStride;
+        slotsOffset_ = r.slotsOffset;
+        if (r.magic != RpmbShm::MAGIC || r.version != RpmbShm::VERSION || slots_ == 0 ||
+            slotStride_ < sizeof(RpmbShm::SlotHeader) + slotData_ ||
+            slotsOffset_ < sizeof(RpmbShm::Ring) ||
+            slotsOffset_ + size_t(slots_) * slotStride_ > ringLen_)
+            rc = -EPROTO;
+    }
+
+    if (rc) {
+        Close();
+        return rc;
+    }
+
+    head_ = completed_ = ring_->head.load(std::memory_order_relaxed);
+    outs_.assign(slots_, std::vector<Out>());
+    return 0;
+}
+
+void RpmbShmClient::Close() {
+    if (ring_) ::munmap(ring_, ringLen_);
+    ring_ = nullptr;
+    ringLen_ = 0;
+    for (int* fd : { &fd_, &reqFd_, &doneFd_ }) {
+        if (*fd >= 0) ::close(*fd);
+        *fd = -1;
+    }
+    slots_ = 0;
+    head_ = completed_ = 0;
+    outs_.clear();
+}
+
+uint32_t RpmbShmClient::DefaultSpinUs() {
+    return ::sysconf(_SC_NPROCESSORS_ONLN) > 1 ? 20 : 0;
+}
+
+uint8_t* RpmbShmClient::Slot(uint32_t seq) const {
+    return reinterpret_cast<uint8_t*>(ring_) + slotsOffset_ + size_t(seq % slots_) * slotStride_;
+}
+
+// ----------------------------------------------------------------------
+
+int RpmbShmClient::MultiCmd(const mmc_ioc_cmd* cmds, size_t count) {
+    if (InFlight()) return -EBUSY;
+    const int rc = Submit(cmds, count);
+    return rc ? rc : Complete();
+}
+
+int RpmbShmClient::Submit(const mmc_ioc_cmd* cmds, size_t count) {
+    if (!ring_) return -ENOTCONN;
+    if (InFlight() >= slots_) return -EBUSY;
+    if (count == 0 || count > RpmbShm::MAX_CMDS) return -EINVAL;
+
+    uint8_t* slot = Slot(head_);
+    RpmbShm::SlotHeader* h = reinterpret_cast<RpmbShm::SlotHeader*>(slot);
+    uint8_t* data = slot + sizeof(RpmbShm::SlotHeader);
+    std::vector<Out>& outs = outs_[head_ % slots_];
+    outs.clear();
+
+    size_t total = 0;
+    for (size_t i = 0; i < count; ++i) {
+        const mmc_ioc_cmd& c = cmds[i];
+        const size_t dlen = CmdDataLen(c);
+        uint8_t* buf = reinterpret_cast<uint8_t*>(uintptr_t(c.data_ptr));
+
+        if ((c.opcode == 25 || c.opcode == 18) && (dlen == 0 || !buf)) return -EIO;
+        if (dlen > slotData_ - total) return -E2BIG;
+
+        RpmbShm::Cmd& sc = h->cmds[i];
+        sc.opcode = c.opcode;
+        sc.blocks = c.blocks;
+        sc.dataLen = uint32_t(dlen);
+        sc.reserved = 0;
+
+        if (c.opcode == 25) std::memcpy(data + total, buf, dlen);
+        else if (c.opcode == 18) outs.push_back(Out{ buf, total, dlen });
+        total += dlen;
+    }
+    h->count = uint32_t(count);
+    h->status = 0;
+
+    // Pairs with the server's fence between setting serverWaiting and
+    // reading head: either it sees the new head or we see the flag
+    ring_->head.store(++head_, std::memory_order_release);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (ring_->serverWaiting.load(std::memory_order_relaxed)) {
+        const uint64_t one = 1;
+        ssize_t n = ::write(reqFd_, &one, sizeof(one));
+        (void)n;
+    }
+    return 0;
+}
+
+int RpmbShmClient::Complete() {
+    if (!ring_) return -ENOTCONN;
+    if (!InFlight()) return -EINVAL;
+
+    const uint32_t seq = completed_;
+    const int rc = WaitDone(seq);
+    if (rc) return rc;
+
+    uint8_t* slot = Slot(seq);
+    const int status = reinterpret_cast<RpmbShm::SlotHeader*>(slot)->status;
+    if (status == 0) {
+        const uint8_t* data = slot + sizeof(RpmbShm::SlotHeader);
+        for (const Out& o : outs_[seq % slots_])
+            std::memcpy(o.dst, data + o.off, o.len);
+    }
+    completed_++;
+    return status;
+}
+
+// Spins for a moment, then sleeps on the completion doorbell until chain
+// seq is done; -EPIPE if the server went away
+int RpmbShmClient::WaitDone(uint32_t seq) {
+    auto done = [&] {
+        return int32_t(ring_->done.load(std::memory_order_acquire) - seq) > 0;
+    };
+
+    if (done()) return 0;
+    const uint64_t until = NowNs() + uint64_t(spinUs_) * 1000;
+    while (NowNs() < until) {
+        if (done()) return 0;
+        CpuRelax();
+    }
+
+    for (;;) {
+        ring_->clientWaiting.store(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (done()) {
+            ring_->clientWaiting.store(0, std::memory_order_relaxed);
+            return 0;
+        }
+
+        pollfd p[2] = { { doneFd_, POLLIN, 0 }, { fd_, POLLIN, 0 } };
+        const int n = ::poll(p, 2, -1);
+        ring_->clientWaiting.store(0, std::memory_order_relaxed);
+        if (done()) return 0;
+        if (n < 0 && errno != EINTR) return -errno;
+        if (n > 0 && p[1].revents) return -EPIPE;
+
+        uint64_t v;
+        ssize_t got = ::read(doneFd_, &v, sizeof(v));
+        (void)got;
+    }
+}
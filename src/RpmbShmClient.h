@@ -0,0 +1,76 @@
+#pragma once
+#include <linux/mmc/ioctl.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace RpmbShm { struct Ring; }
+
+// Client of RpmbShmServer (rpmbd --shm <path>), built as its own small
+// library (rpmbd_client). Takes the same command chains as
+// ioctl(fd, MMC_IOC_MULTI_CMD, ...) on an RPMB device: CMD23, CMD25 with
+// request frames, CMD18 with room for response frames, CMD12.
+//
+// One client is one session (like an open file of the device) and is not
+// thread-safe; use one per thread. Errors are -errno, like the ioctl's.
+class RpmbShmClient {
+public:
+    RpmbShmClient() = default;
+    ~RpmbShmClient() { Close(); }
+
+    RpmbShmClient(const RpmbShmClient&) = delete;
+    RpmbShmClient& operator=(const RpmbShmClient&) = delete;
+
+    // dev may be empty while the daemon serves a single device
+    int Connect(const std::string& socketPath, const std::string& dev = std::string());
+    void Close();
+    bool IsOpen() const { return ring_ != nullptr; }
+
+    // Spin this long for a completion before sleeping (default 20 us, 0 on
+    // a single CPU)
+    void SetSpinUs(uint32_t us) { spinUs_ = us; }
+
+    // Runs one chain and waits for it
+    int MultiCmd(const mmc_ioc_cmd* cmds, size_t count);
+    int MultiCmd(const mmc_ioc_multi_cmd* multi) { return MultiCmd(multi->cmds, multi->num_of_cmds); }
+
+    // Pipelining: Submit() queues a chain (CMD25 data is copied right away)
+    // without waiting, while fewer than MaxInFlight() are outstanding.
+    // Complete() waits for the oldest one, copies its CMD18 data to the
+    // buffers passed to Submit() and returns its result.
+    int Submit(const mmc_ioc_cmd* cmds, size_t count);
+    int Complete();
+    size_t InFlight() const { return head_ - completed_; }
+    size_t MaxInFlight() const { return slots_; }
+
+    // Data bytes one chain may carry
+    size_t MaxChainData() const { return slotData_; }
+
+private:
+    struct Out {
+        uint8_t* dst;
+        size_t off;     // in the slot data
+        size_t len;
+    };
+
+    int fd_ = -1;
+    int reqFd_ = -1;
+    int doneFd_ = -1;
+    RpmbShm::Ring* ring_ = nullptr;
+    size_t ringLen_ = 0;
+    uint32_t slots_ = 0;
+    size_t slotData_ = 0;
+    size_t slotStride_ = 0;
+    size_t slotsOffset_ = 0;
+    uint32_t spinUs_ = DefaultSpinUs();
+
+    uint32_t head_ = 0;         // chains submitted
+    uint32_t completed_ = 0;    // chains returned by Complete()
+    std::vector<std::vector<Out>> outs_;    // per slot: where its CMD18 data goes
+
+    static uint32_t DefaultSpinUs();
+    uint8_t* Slot(uint32_t seq) const;
+    int WaitDone(uint32_t seq);
+};
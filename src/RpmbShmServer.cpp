@@ -0,0 +1,407 @@
+#include "RpmbShmServer.h"
+
+#include <cerrno>
+#include <cstring>
+#include <new>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "Rpmbd.h"
+#include "RpmbLog.h"
+#include "RpmbMetrics.h"
+#include "RpmbShm.h"
+#include "RpmbSpans.h"
+#include "RpmbTrace.h"     // RpmbMonotonicNs()
+
+#define ERR(fmt, ...) RPMB_LOG(RpmbLog::Error, "[rpmb-shm] " fmt, ##__VA_ARGS__)
+#define INFO(fmt, ...) RPMB_LOG(RpmbLog::Info, "[rpmb-shm] " fmt, ##__VA_ARGS__)
+
+namespace {
+
+const size_t MAX_CONNS = 64;
+const int HELLO_TIMEOUT_MS = 2000;
+const size_t PAGE = 4096;
+
+size_t RoundUp(size_t n, size_t to) { return (n + to - 1) / to * to; }
+
+inline void CpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#else
+    std::this_thread::yield();
+#endif
+}
+
+// Chain data in a ring slot. The client can change the slot at any time,
+// so nothing is used in place: CMD25 frames are copied out before they are
+// verified, CMD18 frames are only ever written.
+class SlotChainIo : public Rpmbd::ChainIo {
+public:
+    SlotChainIo(uint8_t* data, const size_t* offsets) : data_(data), offsets_(offsets) {}
+
+    uint8_t* Map(size_t, size_t, size_t) override { return nullptr; }
+
+    bool Read(size_t cmd, size_t off, uint8_t* dst, size_t len) override {
+        std::memcpy(dst, data_ + offsets_[cmd] + off, len);
+        return true;
+    }
+
+    bool Write(size_t cmd, size_t off, const uint8_t* src, size_t len) override {
+        std::memcpy(data_ + offsets_[cmd] + off, src, len);
+        return true;
+    }
+
+private:
+    uint8_t* data_;
+    const size_t* offsets_;
+};
+
+} // namespace
+
+// One client: its ring, doorbells and session
+struct RpmbShmServer::Conn {
+    int fd = -1;                // socket
+    int reqFd = -1;             // request doorbell
+    int doneFd = -1;            // completion doorbell
+    RpmbShm::Ring* ring = nullptr;
+    size_t ringLen = 0;
+    size_t slotsOffset = 0;     // geometry: our copy, the ring's may be changed
+    size_t slotStride = 0;
+    Rpmbd* core = nullptr;
+    Rpmbd::Session session;
+    uint32_t tail = 0;          // next chain to run
+    std::thread thread;
+    std::atomic<bool> finished{false};
+
+    ~Conn() {
+        if (thread.joinable()) thread.join();
+        for (int f : { fd, reqFd, doneFd })
+            if (f >= 0) ::close(f);
+        if (ring) ::munmap(ring, ringLen);
+    }
+};
+
+// ----------------------------------------------------------------------
+
+RpmbShmServer::RpmbShmServer(const Options& opt) : opt_(opt) {}
+
+RpmbShmServer::~RpmbShmServer() {
+    Stop();
+}
+
+bool RpmbShmServer::Start() {
+    if (opt_.slots == 0 || opt_.slotData == 0 || opt_.slotData % PAGE != 0) {
+        ERR("invalid ring geometry: %u slots of %zu bytes", opt_.slots, opt_.slotData);
+        return false;
+    }
+
+    sockaddr_un sa{};
+    sa.sun_family = AF_UNIX;
+    if (opt_.socketPath.empty() || opt_.socketPath.size() >= sizeof(sa.sun_path)) {
+        ERR("socket path invalid: '%s'", opt_.socketPath.c_str());
+        return false;
+    }
+    std::memcpy(sa.sun_path, opt_.socketPath.c_str(), opt_.socketPath.size() + 1);
+
+    listenFd_ = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    ::unlink(opt_.socketPath.c_str());
+    if (listenFd_ < 0 ||
+        ::bind(listenFd_, reinterpret_cast<sockaddr*>(&sa), sizeof(sa)) != 0 ||
+        ::listen(listenFd_, 16) != 0) {
+        ERR("socket '%s': %s", opt_.socketPath.c_str(), std::strerror(errno));
+        if (listenFd_ >= 0) ::close(listenFd_);
+        listenFd_ = -1;
+        return false;
+    }
+
+    if (::pipe2(wakeFd_, O_CLOEXEC) != 0) {
+        ERR("pipe: %s", std::strerror(errno));
+        Stop();
+        return false;
+    }
+
+    // Spinning only pays off while the client runs on another CPU
+    if (std::thread::hardware_concurrency() == 1) opt_.spinUs = 0;
+
+    thread_ = std::thread([this] { Loop(); });
+    return true;
+}
+
+void RpmbShmServer::Stop() {
+    if (thread_.joinable()) {
+        const char c = 0;
+        ssize_t n = ::write(wakeFd_[1], &c, 1);     // stays readable: wakes every thread
+        (void)n;
+        thread_.join();
+    }
+    for (int& fd : wakeFd_) {
+        if (fd >= 0) ::close(fd);
+        fd = -1;
+    }
+    if (listenFd_ >= 0) {
+        ::close(listenFd_);
+        ::unlink(opt_.socketPath.c_str());
+        listenFd_ = -1;
+    }
+}
+
+void RpmbShmServer::Loop() {
+    for (;;) {
+        pollfd p[2] = { { wakeFd_[0], POLLIN, 0 }, { listenFd_, POLLIN, 0 } };
+        if (::poll(p, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            ERR("poll: %s", std::strerror(errno));
+            break;
+        }
+        if (p[0].revents) break;
+        if (!(p[1].revents & POLLIN)) continue;
+
+        int fd = ::accept4(listenFd_, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0) continue;
+
+        ReapFinished();
+        if (conns_.size() >= MAX_CONNS) {
+            ERR("too many connections (%zu), rejecting one", conns_.size());
+            ::close(fd);
+            continue;
+        }
+        Accept(fd);
+    }
+
+    conns_.clear();     // joins: the wake pipe ends every session
+}
+
+void RpmbShmServer::Accept(int fd) {
+    conns_.emplace_back(new Conn());
+    Conn& c = *conns_.back();
+    c.fd = fd;
+    c.thread = std::thread([this, &c] {
+        Serve(c);
+        ::shutdown(c.fd, SHUT_RDWR);    // the client sees the end now, not once reaped
+        c.finished = true;
+    });
+}
+
+void RpmbShmServer::ReapFinished() {
+    for (size_t i = conns_.size(); i-- > 0; )
+        if (conns_[i]->finished) conns_.erase(conns_.begin() + long(i));
+}
+
+// ----------------------------------------------------------------------
+// One connection: handshake, then chains until the client goes away
+
+void RpmbShmServer::Serve(Conn& c) {
+    ucred cred{};
+    socklen_t credLen = sizeof(cred);
+    ::getsockopt(c.fd, SOL_SOCKET, SO_PEERCRED, &cred, &credLen);
+
+    // Hello (a single small message; no partial reads expected)
+    RpmbShm::Hello hello{};
+    pollfd p[2] = { { c.fd, POLLIN, 0 }, { wakeFd_[0], POLLIN, 0 } };
+    if (::poll(p, 2, HELLO_TIMEOUT_MS) <= 0 || p[1].revents ||
+        ::recv(c.fd, &hello, sizeof(hello), MSG_DONTWAIT) != ssize_t(sizeof(hello))) {
+        ERR("pid %d: no hello", int(cred.pid));
+        return;
+    }
+
+    RpmbShm::HelloReply reply{};
+    std::string devName(hello.dev, strnlen(hello.dev, sizeof(hello.dev)));
+    if (hello.magic != RpmbShm::MAGIC || hello.version != RpmbShm::VERSION) {
+        reply.status = -EPROTO;
+    } else if (devName.empty() && devs_.size() == 1) {
+        c.core = devs_[0].second;
+        devName = devs_[0].first;
+    } else {
+        for (auto& d : devs_)
+            if (d.first == devName) c.core = d.second;
+        if (!c.core) reply.status = -ENODEV;
+    }
+    if (reply.status) {
+        ERR("pid %d: hello rejected (device '%s'): %s", int(cred.pid), devName.c_str(),
+            std::strerror(-reply.status));
+        ::send(c.fd, &reply, sizeof(reply), MSG_NOSIGNAL);
+        return;
+    }
+
+    // Ring: sealed, so the client cannot shrink it under our mapping
+    c.slotStride = RoundUp(sizeof(RpmbShm::SlotHeader) + opt_.slotData, PAGE);
+    c.slotsOffset = RoundUp(sizeof(RpmbShm::Ring), PAGE);
+    c.ringLen = c.slotsOffset + opt_.slots * c.slotStride;
+
+    int memFd = ::memfd_create("rpmbd-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    void* m = MAP_FAILED;
+    if (memFd >= 0 && ::ftruncate(memFd, off_t(c.ringLen)) == 0 &&
+        ::fcntl(memFd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == 0)
+        m = ::mmap(nullptr, c.ringLen, PROT_READ | PROT_WRITE, MAP_SHARED, memFd, 0);
+    c.reqFd = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    c.doneFd = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+    if (m == MAP_FAILED || c.reqFd < 0 || c.doneFd < 0) {
+        ERR("pid %d: ring setup: %s", int(cred.pid), std::strerror(errno));
+        if (memFd >= 0) ::close(memFd);
+        reply.status = -ENOMEM;
+        ::send(c.fd, &reply, sizeof(reply), MSG_NOSIGNAL);
+        return;
+    }
+
+    c.ring = new (m) RpmbShm::Ring();
+    c.ring->magic = RpmbShm::MAGIC;
+    c.ring->version = RpmbShm::VERSION;
+    c.ring->slots = opt_.slots;
+    c.ring->slotData = opt_.slotData;
+    c.ring->slotStride = c.slotStride;
+    c.ring->slotsOffset = c.slotsOffset;
+
+    reply.size = c.ringLen;
+    const int fds[3] = { memFd, c.reqFd, c.doneFd };
+    alignas(cmsghdr) char ctl[CMSG_SPACE(sizeof(fds))] = {};
+    iovec iov{ &reply, sizeof(reply) };
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl;
+    msg.msg_controllen = sizeof(ctl);
+    cmsghdr* cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(fds));
+    std::memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+
+    const bool sent = ::sendmsg(c.fd, &msg, MSG_NOSIGNAL) == ssize_t(sizeof(reply));
+    ::close(memFd);
+    if (!sent) return;
+
+    c.session.id = nextSession_.fetch_add(1);
+    INFO("session %u: pid %d on %s", c.session.id, int(cred.pid), devName.c_str());
+
+    bool gone = false;
+    while (!gone && WaitForWork(c)) {
+        const uint32_t head = c.ring->head.load(std::memory_order_acquire);
+        if (head - c.tail > opt_.slots) {
+            ERR("session %u: ring overrun (head=%u done=%u)", c.session.id, head, c.tail);
+            break;
+        }
+        for (; c.tail != head; ++c.tail) {
+            RunSlot(c, c.tail);
+            if (c.session.readyAtNs && !WaitReady(c, c.session.readyAtNs)) {
+                gone = true;
+                break;
+            }
+            c.ring->done.store(c.tail + 1, std::memory_order_release);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (c.ring->clientWaiting.load(std::memory_order_relaxed)) {
+                const uint64_t one = 1;
+                ssize_t n = ::write(c.doneFd, &one, sizeof(one));
+                (void)n;
+            }
+        }
+    }
+
+    INFO("session %u: closed", c.session.id);
+}
+
+// Spins for a moment, then sleeps on the request doorbell. False once the
+// client is gone or the server stops.
+bool RpmbShmServer::WaitForWork(Conn& c) {
+    RpmbShm::Ring* r = c.ring;
+    auto ready = [&] { return r->head.load(std::memory_order_acquire) != c.tail; };
+
+    if (ready()) return true;
+    const uint64_t until = RpmbMonotonicNs() + uint64_t(opt_.spinUs) * 1000;
+    while (RpmbMonotonicNs() < until) {
+        if (ready()) return true;
+        CpuRelax();
+    }
+
+    for (;;) {
+        // Pairs with the client's fence between publishing head and
+        // reading serverWaiting: either it sees the flag or we see head
+        r->serverWaiting.store(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (ready()) {
+            r->serverWaiting.store(0, std::memory_order_relaxed);
+            return true;
+        }
+
+        // The client sends nothing after its hello: readable means closed
+        pollfd p[3] = { { c.reqFd, POLLIN, 0 }, { c.fd, POLLIN, 0 }, { wakeFd_[0], POLLIN, 0 } };
+        const int n = ::poll(p, 3, -1);
+        r->serverWaiting.store(0, std::memory_order_relaxed);
+        if (n < 0 && errno != EINTR) return false;
+        if (n > 0 && (p[1].revents || p[2].revents)) return false;
+
+        uint64_t v;
+        ssize_t got = ::read(c.reqFd, &v, sizeof(v));
+        (void)got;
+        if (ready()) return true;
+    }
+}
+
+// Holds a chain's completion back until the timing model's time (this
+// connection's thread only). False once the client is gone or the server
+// stops.
+bool RpmbShmServer::WaitReady(Conn& c, uint64_t readyAtNs) {
+    for (;;) {
+        const uint64_t now = RpmbMonotonicNs();
+        if (readyAtNs <= now) return true;
+
+        const uint64_t left = readyAtNs - now;
+        const timespec ts{ time_t(left / 1000000000ull), long(left % 1000000000ull) };
+        pollfd p[2] = { { c.fd, POLLIN, 0 }, { wakeFd_[0], POLLIN, 0 } };
+        const int n = ::ppoll(p, 2, &ts, nullptr);
+        if (n > 0 || (n < 0 && errno != EINTR)) return false;
+    }
+}
+
+// Validates the chain in slot seq (from a private copy of its command list)
+// and runs it; the result goes to the slot's status
+void RpmbShmServer::RunSlot(Conn& c, uint32_t seq) {
+    uint8_t* slot = reinterpret_cast<uint8_t*>(c.ring) + c.slotsOffset + size_t(seq % opt_.slots) * c.slotStride;
+    RpmbShm::SlotHeader* h = reinterpret_cast<RpmbShm::SlotHeader*>(slot);
+    uint8_t* data = slot + sizeof(RpmbShm::SlotHeader);
+
+    const uint64_t t0 = (RpmbMetrics::Enabled() || RpmbSpans::Enabled()) ? RpmbMonotonicNs() : 0;
+
+    const uint32_t count = h->count;
+    Rpmbd::MmcCmd chain[RpmbShm::MAX_CMDS];
+    size_t offsets[RpmbShm::MAX_CMDS];
+    size_t total = 0;
+    int status = (count == 0 || count > RpmbShm::MAX_CMDS) ? -EINVAL : 0;
+
+    for (uint32_t i = 0; i < count && !status; ++i) {
+        const RpmbShm::Cmd cmd = h->cmds[i];
+        chain[i].opcode = cmd.opcode;
+        chain[i].blocks = cmd.blocks;
+        chain[i].dataLen = 0;
+        offsets[i] = total;
+
+        if (cmd.opcode == 23 || cmd.opcode == 12) continue;
+        if ((cmd.opcode != 25 && cmd.opcode != 18) || cmd.dataLen == 0 ||
+            cmd.dataLen % 512 != 0 || cmd.dataLen > opt_.slotData - total) {
+            ERR("session %u: bad cmd[%u] opcode=%u dlen=%u", c.session.id, i, cmd.opcode, cmd.dataLen);
+            status = -EIO;
+            break;
+        }
+        chain[i].dataLen = cmd.dataLen;
+        total += cmd.dataLen;
+    }
+
+    if (!status) {
+        SlotChainIo io(data, offsets);
+        std::lock_guard<std::mutex> lk(c.session.mu);
+        if (!c.core->ExecuteChain(c.session, chain, count, io)) status = -EIO;
+    }
+    h->status = status;
+
+    if (t0) {
+        const uint64_t t1 = RpmbMonotonicNs();
+        RpmbMetrics::RecordStage(RpmbMetrics::STAGE_EXECUTE, t1 - t0);
+        RpmbSpans::Record("shm_chain", t0, t1);
+    }
+    RpmbMetrics::CountIoctl(status == 0);
+}
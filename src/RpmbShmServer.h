@@ -0,0 +1,56 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+class Rpmbd;
+
+// Frontend that serves the cores on a Unix socket with one shared-memory
+// frame ring per connection (protocol in RpmbShm.h, client in
+// RpmbShmClient.h): no kernel round trip and no process_vm_readv per
+// request, and no root or /dev/cuse needed. Every connection is a session
+// of its own (like an open file) and is served by its own thread.
+class RpmbShmServer {
+public:
+    struct Options {
+        std::string socketPath;
+        uint32_t slots = 8;                 // chains in flight per connection
+        size_t slotData = 1024 * 1024;      // data bytes per chain (multiple of 4 KiB)
+        uint32_t spinUs = 20;               // poll the ring this long before sleeping
+                                            // (not on a single CPU)
+    };
+
+    explicit RpmbShmServer(const Options& opt);
+    ~RpmbShmServer();
+
+    // core must outlive Stop()
+    void Add(const std::string& devName, Rpmbd& core) { devs_.emplace_back(devName, &core); }
+
+    bool Start();
+    void Stop();
+
+private:
+    struct Conn;
+
+    Options opt_;
+    std::vector<std::pair<std::string, Rpmbd*>> devs_;
+    int listenFd_ = -1;
+    int wakeFd_[2] = { -1, -1 };    // read end readable once stopping
+    std::thread thread_;
+
+    std::vector<std::unique_ptr<Conn>> conns_;     // Loop() only
+    std::atomic<uint32_t> nextSession_{1};
+
+    void Loop();
+    void Accept(int fd);
+    void Serve(Conn& c);
+    bool WaitForWork(Conn& c);
+    bool WaitReady(Conn& c, uint64_t readyAtNs);
+    void RunSlot(Conn& c, uint32_t seq);
+    void ReapFinished();
+};
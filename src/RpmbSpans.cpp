@@ -0,0 +1,212 @@
+#include "RpmbSpans.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "RpmbLog.h"
+#include "RpmbThreadShards.h"
+
+std::atomic<bool> RpmbSpans::enabled_{false};
+
+namespace {
+
+struct Event {
+    const char* name;
+    uint64_t startNs;
+    uint32_t durNs;     // clamped to ~4.29 s
+    uint32_t tid;
+};
+
+// One thread's ring. The mutex is only contended while a dump copies it.
+struct Buffer {
+    std::mutex mu;
+    std::unique_ptr<Event[]> events{ new Event[RpmbSpans::EVENTS_PER_THREAD] };
+    uint64_t head = 0;              // events ever recorded
+};
+
+typedef RpmbThreadShards<Buffer> Buffers;
+
+struct State {
+    std::mutex mu;                  // start/stop
+    std::string path;
+    int wakeFd[2] = { -1, -1 };     // SIGUSR1 / Stop() -> dumper thread
+    std::thread dumper;
+    struct sigaction oldAction;
+};
+
+State& St() {
+    static State* s = new State();  // never destroyed: SIGUSR1 may still fire
+    return *s;
+}
+
+uint32_t Tid() {
+    thread_local uint32_t tid = uint32_t(::syscall(SYS_gettid));
+    return tid;
+}
+
+const char DUMP = 'd';
+const char QUIT = 'q';
+
+void OnSigUsr1(int) {
+    const int saved = errno;
+    ssize_t n = ::write(St().wakeFd[1], &DUMP, 1);   // async-signal-safe
+    (void)n;
+    errno = saved;
+}
+
+void DumperLoop() {
+    State& st = St();
+    for (;;) {
+        pollfd p = { st.wakeFd[0], POLLIN, 0 };
+        if (::poll(&p, 1, -1) < 0 && errno != EINTR) return;
+        char c = 0;
+        if (::read(st.wakeFd[0], &c, 1) != 1) continue;
+        if (c == QUIT) return;
+        RpmbSpans::Dump();
+    }
+}
+
+// Span names are literals from this code base; escape anyway
+void AppendJsonString(std::string& out, const char* s) {
+    out += '"';
+    for (; *s; ++s) {
+        if (*s == '"' || *s == '\\') out += '\\';
+        if (uint8_t(*s) >= 0x20) out += *s;
+    }
+    out += '"';
+}
+
+} // namespace
+
+// ----------------------------------------------------------------------
+
+uint64_t RpmbSpans::Now() {
+    if (!Enabled()) return 0;
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000ull + uint64_t(ts.tv_nsec);
+}
+
+void RpmbSpans::Record(const char* name, uint64_t startNs, uint64_t endNs) {
+    if (!Enabled()) return;
+    Buffer& b = Buffers::Local();
+    const uint64_t d = endNs > startNs ? endNs - startNs : 0;
+
+    std::lock_guard<std::mutex> lk(b.mu);
+    Event& e = b.events[b.head % EVENTS_PER_THREAD];
+    e.name = name;
+    e.startNs = startNs;
+    e.durNs = d > UINT32_MAX ? UINT32_MAX : uint32_t(d);
+    e.tid = Tid();
+    b.head++;
+}
+
+bool RpmbSpans::Start(const std::string& path) {
+    State& st = St();
+    std::lock_guard<std::mutex> lk(st.mu);
+    if (st.dumper.joinable()) return true;
+
+    st.path = path;
+    if (::pipe2(st.wakeFd, O_CLOEXEC | O_NONBLOCK) != 0) {
+        RPMB_LOG(RpmbLog::Error, "[rpmbd] spans: pipe: %s", std::strerror(errno));
+        return false;
+    }
+
+    struct sigaction sa;
+    std::memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = OnSigUsr1;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, &st.oldAction);
+
+    enabled_.store(true, std::memory_order_relaxed);
+    st.dumper = std::thread(DumperLoop);
+    return true;
+}
+
+void RpmbSpans::Stop() {
+    State& st = St();
+    {
+        std::lock_guard<std::mutex> lk(st.mu);
+        if (!st.dumper.joinable()) return;
+        ssize_t n = ::write(st.wakeFd[1], &QUIT, 1);
+        (void)n;
+    }
+    st.dumper.join();
+    sigaction(SIGUSR1, &st.oldAction, nullptr);
+
+    Dump();
+    enabled_.store(false, std::memory_order_relaxed);
+
+    std::lock_guard<std::mutex> lk(st.mu);
+    for (int& fd : st.wakeFd) {
+        ::close(fd);
+        fd = -1;
+    }
+}
+
+bool RpmbSpans::Dump() {
+    State& st = St();
+    std::vector<Event> all;
+    std::string path;
+    {
+        std::lock_guard<std::mutex> lk(st.mu);
+        path = st.path;
+    }
+    Buffers::ForEach([&](Buffer& b) {
+        std::lock_guard<std::mutex> blk(b.mu);
+        const uint64_t n = std::min<uint64_t>(b.head, EVENTS_PER_THREAD);
+        for (uint64_t i = b.head - n; i < b.head; ++i)
+            all.push_back(b.events[i % EVENTS_PER_THREAD]);
+    });
+    if (path.empty()) return false;
+
+    std::string out;
+    out.reserve(all.size() * 96 + 256);
+    char line[160];
+    std::snprintf(line, sizeof(line),
+                  "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n"
+                  "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"rpmbd\"}}",
+                  int(::getpid()));
+    out += line;
+
+    const int pid = int(::getpid());
+    for (const Event& e : all) {
+        out += ",\n{\"name\":";
+        AppendJsonString(out, e.name);
+        // Chrome trace timestamps are microseconds
+        std::snprintf(line, sizeof(line),
+                      ",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%u}",
+                      double(e.startNs) / 1e3, double(e.durNs) / 1e3, pid, e.tid);
+        out += line;
+    }
+    out += "\n]}\n";
+
+    const std::string tmp = path + ".tmp";
+    FILE* f = std::fopen(tmp.c_str(), "w");
+    if (!f) {
+        RPMB_LOG(RpmbLog::Error, "[rpmbd] spans: cannot write '%s': %s", tmp.c_str(), std::strerror(errno));
+        return false;
+    }
+    const bool ok = std::fwrite(out.data(), 1, out.size(), f) == out.size();
+    if (std::fclose(f) != 0 || !ok || std::rename(tmp.c_str(), path.c_str()) != 0) {
+        RPMB_LOG(RpmbLog::Error, "[rpmbd] spans: cannot write '%s': %s", path.c_str(), std::strerror(errno));
+        std::remove(tmp.c_str());
+        return false;
+    }
+
+    RPMB_LOG(RpmbLog::Info, "[rpmbd] spans: %zu event(s) written to %s", all.size(), path.c_str());
+    return true;
+}
@@ -0,0 +1,53 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <string>
+
+// Optional span instrumentation, exported as Chrome trace-event JSON
+// (chrome://tracing, ui.perfetto.dev).
+//
+// Spans are recorded into a bounded per-thread ring (the oldest are
+// overwritten) and written to the output file on SIGUSR1 and on Stop().
+// Span names must be string literals (only the pointer is stored). While
+// disabled a span costs one relaxed load.
+class RpmbSpans {
+public:
+    static const size_t EVENTS_PER_THREAD = 65536;
+
+    // Enables recording and dumps to path on SIGUSR1
+    static bool Start(const std::string& path);
+    static void Stop();     // final dump
+
+    static bool Enabled() { return enabled_.load(std::memory_order_relaxed); }
+
+    // Monotonic ns, or 0 while disabled
+    static uint64_t Now();
+
+    static void Record(const char* name, uint64_t startNs, uint64_t endNs);
+
+    // Writes all buffered spans now
+    static bool Dump();
+
+private:
+    static std::atomic<bool> enabled_;
+};
+
+// Records the enclosing scope (or up to End()) as one span
+class RpmbSpan {
+public:
+    explicit RpmbSpan(const char* name) : name_(name), t0_(RpmbSpans::Now()) {}
+    ~RpmbSpan() { End(); }
+
+    void End() {
+        if (t0_) RpmbSpans::Record(name_, t0_, RpmbSpans::Now());
+        t0_ = 0;
+    }
+
+    RpmbSpan(const RpmbSpan&) = delete;
+    RpmbSpan& operator=(const RpmbSpan&) = delete;
+
+private:
+    const char* name_;
+    uint64_t t0_;
+};
@@ -0,0 +1,766 @@
+#include "RpmbStateFile.h"
+
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <climits>
+#include <algorithm>
+#include <chrono>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <openssl/sha.h>
+
+#include "RpmbLog.h"
+#include "RpmbSeqlock.h"
+
+#define DBG(fmt, ...) RPMB_LOG(RpmbLog::Debug, fmt, ##__VA_ARGS__)
+
+// Header field offsets
+static const size_t HOFF_MAGIC      = 0;
+static const size_t HOFF_KEYPROG    = 8;
+static const size_t HOFF_KEY        = 9;
+static const size_t HOFF_WCOUNTER   = 41;
+static const size_t HOFF_MAXBLOCKS  = 45;
+
+// Journal record:
+//   "RPMBJv1\0" | fileId(8) | keyProgrammed(1) | key(32) | writeCounter(4) |
+//   count(4) | count * { addr(2) | data(256) } | sha256(all previous bytes)
+static const char     JOURNAL_MAGIC[8] = "RPMBJv1";
+static const size_t   JOFF_FILEID   = 8;
+static const size_t   JOFF_KEYPROG  = 16;
+static const size_t   JOFF_KEY      = 17;
+static const size_t   JOFF_WCOUNTER = 49;
+static const size_t   JOFF_COUNT    = 53;
+static const size_t   JOFF_ENTRIES  = 57;
+static const size_t   JENTRY_SIZE   = 2 + 256;
+
+static bool PWriteAll(int fd, const void* buf, size_t len, off_t off) {
+    const uint8_t* p = static_cast<const uint8_t*>(buf);
+    while (len > 0) {
+        ssize_t n = ::pwrite(fd, p, len, off);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        p += n;
+        len -= size_t(n);
+        off += n;
+    }
+    return true;
+}
+
+static size_t PReadAll(int fd, void* buf, size_t len, off_t off) {
+    uint8_t* p = static_cast<uint8_t*>(buf);
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = ::pread(fd, p + done, len - done, off + off_t(done));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (n == 0) break;
+        done += size_t(n);
+    }
+    return done;
+}
+
+const uint8_t RpmbStateFile::ZERO_BLOCK[256] = {};
+
+// ----------------------------------------------------------------------
+
+RpmbStateFile::RpmbStateFile(const Options& opt)
+    : opt_(opt), journalPath_(opt.path + ".journal") {
+    // Group commit relies on the file not changing behind the journal,
+    // which a shared mapping cannot guarantee.
+    if (opt_.mode == Mode::Mmap && opt_.durability == Durability::Group)
+        opt_.durability = Durability::Strict;
+    UseMemoryStorage();
+}
+
+RpmbStateFile::~RpmbStateFile() {
+    Close();
+    if (map_) ::munmap(map_, mapLen_);
+    FreeChunks();
+}
+
+void RpmbStateFile::Close() {
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        stop_ = true;
+    }
+    cv_.notify_all();
+    if (flusher_.joinable()) flusher_.join();
+    else Flush();
+
+    groupWritable_.store(false, std::memory_order_release);
+    CloseFiles();
+}
+
+// Closes the files only; storage stays readable (a mapping keeps its own reference)
+void RpmbStateFile::CloseFiles() {
+    if (journalFd_ >= 0) ::close(journalFd_);
+    if (fd_ >= 0) ::close(fd_);
+    journalFd_ = -1;
+    fd_ = -1;
+}
+
+bool RpmbStateFile::OpenJournal(bool truncate) {
+    int flags = O_RDWR | O_CREAT | O_CLOEXEC;
+    if (truncate) flags |= O_TRUNC;
+    journalFd_ = ::open(journalPath_.c_str(), flags, 0644);
+    if (journalFd_ < 0) {
+        DBG("[rpmbd] cannot open journal '%s': %s", journalPath_.c_str(), std::strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+bool RpmbStateFile::WriteHeader(const Header& hdr) {
+    // keyProgrammed, key and writeCounter are contiguous
+    uint8_t buf[HOFF_MAXBLOCKS - HOFF_KEYPROG];
+    buf[0] = hdr.keyProgrammed ? 1 : 0;
+    std::memcpy(buf + (HOFF_KEY - HOFF_KEYPROG), hdr.key, 32);
+    std::memcpy(buf + (HOFF_WCOUNTER - HOFF_KEYPROG), &hdr.writeCounter, 4);
+    return PWriteAll(fd_, buf, sizeof(buf), HOFF_KEYPROG);
+}
+
+bool RpmbStateFile::StartFresh(const Header& hdr) {
+    if (opt_.durability != Durability::Volatile) return CreateFresh(hdr);
+    CloseFiles();   // volatile: never create or overwrite the file
+    return true;
+}
+
+bool RpmbStateFile::CreateFresh(const Header& hdr) {
+    CloseFiles();
+
+    fd_ = ::open(opt_.path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd_ < 0) {
+        DBG("[rpmbd] cannot create state '%s': %s", opt_.path.c_str(), std::strerror(errno));
+        return false;
+    }
+
+    uint8_t head[HEADER_SIZE]{};
+    std::memcpy(head + HOFF_MAGIC, "RPMBDv1", 8);
+    std::memcpy(head + HOFF_MAXBLOCKS, &opt_.maxBlocks, 4);
+
+    // Block area stays a hole until written
+    if (!PWriteAll(fd_, head, sizeof(head), 0) ||
+        !WriteHeader(hdr) ||
+        ::ftruncate(fd_, off_t(HEADER_SIZE) + off_t(opt_.maxBlocks) * 256) != 0 ||
+        ::fdatasync(fd_) != 0) {
+        DBG("[rpmbd] cannot initialize state '%s': %s", opt_.path.c_str(), std::strerror(errno));
+        return false;
+    }
+
+    struct stat st{};
+    ::fstat(fd_, &st);
+    fileId_ = (uint64_t(st.st_dev) << 32) ^ uint64_t(st.st_ino);
+
+    // A journal left over from a previous file must never be replayed here
+    return OpenJournal(true);
+}
+
+// ----------------------------------------------------------------------
+
+// Empty (all zero) chunk table
+void RpmbStateFile::UseMemoryStorage() {
+    if (map_) ::munmap(map_, mapLen_);
+    map_ = nullptr;
+    mapLen_ = 0;
+    FreeChunks();
+    chunkCount_ = (size_t(opt_.maxBlocks) + CHUNK_BLOCKS - 1) / CHUNK_BLOCKS;
+    chunks_.reset(new std::atomic<uint8_t*>[chunkCount_]);
+    for (size_t i = 0; i < chunkCount_; ++i) chunks_[i].store(nullptr, std::memory_order_relaxed);
+}
+
+// Drops the table's references (snapshots keep theirs)
+void RpmbStateFile::FreeChunks() {
+    for (size_t i = 0; i < chunkCount_; ++i)
+        Release(chunks_[i].load(std::memory_order_relaxed));
+    chunks_.reset();
+    chunkCount_ = 0;
+}
+
+// Unreferenced chunk (one reference, contents undefined)
+uint8_t* RpmbStateFile::NewChunk() {
+    Chunk* c;
+    if (!freeChunks_.empty()) {
+        c = freeChunks_.back();
+        freeChunks_.pop_back();
+    } else {
+        allChunks_.emplace_back(new Chunk());
+        c = allChunks_.back().get();
+    }
+    c->refs = 1;
+    return c->data;
+}
+
+void RpmbStateFile::Retain(uint8_t* c) {
+    if (c) reinterpret_cast<Chunk*>(c)->refs++;
+}
+
+void RpmbStateFile::Release(uint8_t* c) {
+    if (c && --reinterpret_cast<Chunk*>(c)->refs == 0)
+        freeChunks_.push_back(reinterpret_cast<Chunk*>(c));
+}
+
+// Writer side (commits are serialized by the caller); new chunks start
+// zeroed, shared ones are copied first
+uint8_t* RpmbStateFile::MutableBlock(uint16_t addr) {
+    if (map_) return map_ + HEADER_SIZE + size_t(addr) * 256;
+    std::atomic<uint8_t*>& slot = chunks_[addr / CHUNK_BLOCKS];
+    uint8_t* c = slot.load(std::memory_order_relaxed);
+    if (!c || reinterpret_cast<Chunk*>(c)->refs > 1) {
+        uint8_t* n = NewChunk();
+        if (c) std::memcpy(n, c, CHUNK_BLOCKS * 256);
+        else std::memset(n, 0, CHUNK_BLOCKS * 256);
+        slot.store(n, std::memory_order_release);
+        Release(c);
+        c = n;
+    }
+    return c + size_t(addr % CHUNK_BLOCKS) * 256;
+}
+
+size_t RpmbStateFile::ResidentBytes() const {
+    size_t n = 0;
+    for (size_t i = 0; i < chunkCount_; ++i)
+        if (chunks_[i].load(std::memory_order_relaxed)) n += CHUNK_BLOCKS * 256;
+    return n;
+}
+
+// Loads the chunks that hold data: holes are skipped via SEEK_DATA, chunks
+// that read as all zeros are not kept.
+bool RpmbStateFile::LoadChunks() {
+    const size_t chunkBytes = CHUNK_BLOCKS * 256;
+    const size_t areaBytes = size_t(opt_.maxBlocks) * 256;
+    uint8_t* buf = nullptr;
+
+    for (size_t i = 0; i < chunkCount_; ++i) {
+        const size_t start = i * chunkBytes;
+        const size_t len = std::min(chunkBytes, areaBytes - start);
+        const off_t off = off_t(HEADER_SIZE + start);
+
+        const off_t data = ::lseek(fd_, off, SEEK_DATA);
+        if (data < 0 && errno == ENXIO) break;      // only holes from here on
+        if (data >= off + off_t(len)) {
+            // Continue with the chunk the data is in
+            i = (size_t(data) - HEADER_SIZE) / chunkBytes - 1;
+            continue;
+        }
+
+        if (!buf) buf = NewChunk();
+        std::memset(buf, 0, chunkBytes);
+        errno = 0;
+        if (PReadAll(fd_, buf, len, off) != len) {
+            // A short file or a read error: blocks would silently read as zeros
+            RPMB_LOG(RpmbLog::Error, "[rpmbd] cannot read blocks of '%s' at %lld: %s",
+                     opt_.path.c_str(), (long long)off, errno ? std::strerror(errno) : "file too short");
+            Release(buf);
+            return false;
+        }
+
+        if (std::all_of(buf, buf + len, [](uint8_t b) { return b == 0; }))
+            continue;
+        chunks_[i].store(buf, std::memory_order_relaxed);
+        buf = nullptr;
+    }
+    Release(buf);
+    return true;
+}
+
+// ----------------------------------------------------------------------
+// Snapshots
+
+bool RpmbStateFile::TakeSnapshot(const Header& hdr, Snapshot& out) {
+    if (map_) return false;
+    DropSnapshot(out);
+    out.hdr = hdr;
+    out.chunks.resize(chunkCount_);
+    for (size_t i = 0; i < chunkCount_; ++i) {
+        out.chunks[i] = chunks_[i].load(std::memory_order_relaxed);
+        Retain(out.chunks[i]);
+    }
+    return true;
+}
+
+void RpmbStateFile::DropSnapshot(Snapshot& snap) {
+    for (uint8_t* c : snap.chunks) Release(c);
+    snap.chunks.clear();
+}
+
+bool RpmbStateFile::PersistRestore(const Snapshot& snap, std::vector<uint16_t>& changed) {
+    if (map_) return false;
+
+    changed.clear();
+    std::vector<Block> blocks;
+    for (size_t i = 0; i < chunkCount_; ++i) {
+        const uint8_t* live = chunks_[i].load(std::memory_order_relaxed);
+        const uint8_t* want = i < snap.chunks.size() ? snap.chunks[i] : nullptr;
+        if (live == want) continue;
+
+        const size_t end = std::min(size_t(opt_.maxBlocks), (i + 1) * CHUNK_BLOCKS);
+        for (size_t a = i * CHUNK_BLOCKS; a < end; ++a) {
+            const size_t off = (a % CHUNK_BLOCKS) * 256;
+            const uint8_t* from = live ? live + off : ZERO_BLOCK;
+            const uint8_t* to = want ? want + off : ZERO_BLOCK;
+            if (std::memcmp(from, to, 256) == 0) continue;
+            changed.push_back(uint16_t(a));
+            blocks.push_back(Block{ uint16_t(a), to });
+        }
+    }
+    return Persist(snap.hdr, blocks.data(), blocks.size());
+}
+
+void RpmbStateFile::ApplyRestore(const Snapshot& snap, const std::vector<uint16_t>& changed) {
+    std::unique_lock<std::mutex> lk(mu_, std::defer_lock);
+    if (opt_.durability == Durability::Group) lk.lock();
+
+    for (size_t i = 0; i < chunkCount_; ++i) {
+        uint8_t* live = chunks_[i].load(std::memory_order_relaxed);
+        uint8_t* want = i < snap.chunks.size() ? snap.chunks[i] : nullptr;
+        if (live == want) continue;
+        Retain(want);
+        chunks_[i].store(want, std::memory_order_release);
+        Release(live);
+    }
+
+    if (opt_.durability == Durability::Group) {
+        for (uint16_t a : changed) {
+            if (!dirtyMap_[a]) {
+                dirtyMap_[a] = 1;
+                dirtyList_.push_back(a);
+            }
+        }
+        pendingHdr_ = snap.hdr;
+        hdrDirty_ = true;
+        cv_.notify_one();
+    }
+}
+
+// ----------------------------------------------------------------------
+
+bool RpmbStateFile::AttachStorage() {
+    UseMemoryStorage();
+    if (fd_ < 0) return true;
+
+    if (opt_.mode == Mode::Buffered) return LoadChunks();
+
+    // Mapping past EOF would fault, so make sure the file has its full size
+    struct stat st{};
+    if (::fstat(fd_, &st) != 0) return false;
+    if (size_t(st.st_size) < FileSize() && ::ftruncate(fd_, off_t(FileSize())) != 0)
+        return false;
+
+    // Volatile: private copy-on-write mapping, changes never reach the file
+    const int share = (opt_.durability == Durability::Volatile) ? MAP_PRIVATE : MAP_SHARED;
+    void* m = ::mmap(nullptr, FileSize(), PROT_READ | PROT_WRITE, share, fd_, 0);
+    if (m == MAP_FAILED) {
+        DBG("[rpmbd] mmap '%s' failed: %s", opt_.path.c_str(), std::strerror(errno));
+        return false;
+    }
+
+    FreeChunks();
+    map_ = static_cast<uint8_t*>(m);
+    mapLen_ = FileSize();
+    return true;
+}
+
+bool RpmbStateFile::Open(Header& hdr) {
+    Close();
+    if (map_) ::munmap(map_, mapLen_);
+    map_ = nullptr;
+
+    if (!OpenFile(hdr) || !AttachStorage()) {
+        CloseFiles();
+        UseMemoryStorage();
+        return false;
+    }
+
+    if (opt_.durability == Durability::Volatile) {
+        CloseFiles();
+    } else if (opt_.durability == Durability::Group) {
+        stop_ = false;
+        hdrDirty_ = false;
+        dirtyList_.clear();
+        dirtyMap_.assign(opt_.maxBlocks, 0);
+        groupWritable_.store(true, std::memory_order_release);
+        flusher_ = std::thread(&RpmbStateFile::FlushLoop, this);
+    }
+
+    static const char* const durNames[] = { "strict", "group", "volatile" };
+    DBG("[rpmbd] state loaded: keyProg=%d writeCounter=%u mode=%s durability=%s",
+        hdr.keyProgrammed ? 1 : 0, hdr.writeCounter,
+        opt_.mode == Mode::Mmap ? "mmap" : "buffered",
+        durNames[int(opt_.durability)]);
+    return true;
+}
+
+bool RpmbStateFile::OpenFile(Header& hdr) {
+    fd_ = ::open(opt_.path.c_str(), O_RDWR | O_CLOEXEC);
+    if (fd_ < 0) {
+        DBG("[rpmbd] state not found -> init fresh");
+        hdr = Header{};
+        return StartFresh(hdr);
+    }
+
+    uint8_t head[HEADER_SIZE];
+    if (PReadAll(fd_, head, sizeof(head), 0) != sizeof(head) ||
+        std::memcmp(head + HOFF_MAGIC, "RPMBDv1", 7) != 0) {
+        DBG("[rpmbd] state magic mismatch -> ignore");
+        hdr = Header{};
+        return StartFresh(hdr);
+    }
+
+    hdr.keyProgrammed = (head[HOFF_KEYPROG] != 0);
+    std::memcpy(hdr.key, head + HOFF_KEY, 32);
+    std::memcpy(&hdr.writeCounter, head + HOFF_WCOUNTER, 4);
+
+    uint32_t maxBlocks = 0;
+    std::memcpy(&maxBlocks, head + HOFF_MAXBLOCKS, 4);
+
+    struct stat st{};
+    ::fstat(fd_, &st);
+    fileId_ = (uint64_t(st.st_dev) << 32) ^ uint64_t(st.st_ino);
+
+    if (maxBlocks != opt_.maxBlocks) {
+        DBG("[rpmbd] state maxBlocks mismatch -> reset storage");
+        if (opt_.durability == Durability::Volatile) {
+            CloseFiles();
+            return true;
+        }
+        std::memcpy(head + HOFF_MAXBLOCKS, &opt_.maxBlocks, 4);
+        if (::ftruncate(fd_, off_t(HEADER_SIZE)) != 0 ||
+            ::ftruncate(fd_, off_t(HEADER_SIZE) + off_t(opt_.maxBlocks) * 256) != 0 ||
+            !PWriteAll(fd_, head + HOFF_MAXBLOCKS, 4, HOFF_MAXBLOCKS) ||
+            ::fdatasync(fd_) != 0) {
+            return false;
+        }
+        return OpenJournal(true);
+    }
+
+    if (!OpenJournal(false)) return false;
+    return Recover(hdr);
+}
+
+// Replays the last journal record if it is complete and belongs to this file.
+// Replaying an already applied record is a no-op, so no "applied" marker is kept.
+bool RpmbStateFile::Recover(Header& hdr) {
+    struct stat st{};
+    if (::fstat(journalFd_, &st) != 0 || size_t(st.st_size) < JOFF_ENTRIES + 32)
+        return true;
+
+    std::vector<uint8_t> rec(size_t(st.st_size));
+    if (PReadAll(journalFd_, rec.data(), rec.size(), 0) != rec.size())
+        return true;
+
+    uint32_t count = 0;
+    std::memcpy(&count, rec.data() + JOFF_COUNT, 4);
+
+    const size_t body = JOFF_ENTRIES + size_t(count) * JENTRY_SIZE;
+    if (std::memcmp(rec.data(), JOURNAL_MAGIC, 8) != 0 ||
+        count > opt_.maxBlocks || body + 32 > rec.size()) {
+        return true;
+    }
+
+    uint8_t digest[32];
+    SHA256(rec.data(), body, digest);
+    if (std::memcmp(digest, rec.data() + body, 32) != 0) {
+        DBG("[rpmbd] journal record torn -> discard");
+        return true;
+    }
+
+    uint64_t fileId = 0;
+    std::memcpy(&fileId, rec.data() + JOFF_FILEID, 8);
+    if (fileId != fileId_) {
+        DBG("[rpmbd] journal belongs to another state file -> discard");
+        return true;
+    }
+
+    Header jh;
+    jh.keyProgrammed = (rec[JOFF_KEYPROG] != 0);
+    std::memcpy(jh.key, rec.data() + JOFF_KEY, 32);
+    std::memcpy(&jh.writeCounter, rec.data() + JOFF_WCOUNTER, 4);
+
+    std::vector<Block> blocks(count);
+    for (uint32_t i = 0; i < count; ++i) {
+        const uint8_t* e = rec.data() + JOFF_ENTRIES + size_t(i) * JENTRY_SIZE;
+        std::memcpy(&blocks[i].addr, e, 2);
+        blocks[i].data = e + 2;
+        if (blocks[i].addr >= opt_.maxBlocks) return true;
+    }
+
+    if (!ApplyInPlace(jh, blocks.data(), blocks.size()) || ::fdatasync(fd_) != 0) {
+        DBG("[rpmbd] journal replay failed: %s", std::strerror(errno));
+        return false;
+    }
+
+    DBG("[rpmbd] journal replayed: writeCounter=%u blocks=%u", jh.writeCounter, count);
+    hdr = jh;
+    return true;
+}
+
+// ----------------------------------------------------------------------
+
+bool RpmbStateFile::ApplyInPlace(const Header& hdr, const Block* blocks, size_t count) {
+    // Coalesce runs of consecutive addresses into one pwritev each
+    size_t i = 0;
+    while (i < count) {
+        struct iovec iov[IOV_MAX < 64 ? IOV_MAX : 64];
+        const size_t maxIov = sizeof(iov) / sizeof(iov[0]);
+        size_t n = 0;
+        const uint16_t first = blocks[i].addr;
+        while (i + n < count && n < maxIov && blocks[i + n].addr == first + n) {
+            iov[n].iov_base = const_cast<uint8_t*>(blocks[i + n].data);
+            iov[n].iov_len = 256;
+            ++n;
+        }
+
+        off_t off = off_t(HEADER_SIZE) + off_t(first) * 256;
+        size_t want = n * 256;
+        ssize_t w;
+        do {
+            w = ::pwritev(fd_, iov, int(n), off);
+        } while (w < 0 && errno == EINTR);
+        if (w != ssize_t(want)) {
+            // Short vector write: finish block by block
+            for (size_t k = 0; k < n; ++k) {
+                if (!PWriteAll(fd_, blocks[i + k].data, 256, off + off_t(k) * 256))
+                    return false;
+            }
+        }
+        i += n;
+    }
+
+    return WriteHeader(hdr);
+}
+
+// Syncs the pages touched by a mapped commit (header page included)
+bool RpmbStateFile::SyncMapped(const Block* blocks, size_t count) {
+    static const size_t page = size_t(::sysconf(_SC_PAGESIZE));
+    size_t runStart = 0;
+    size_t runEnd = page;   // header page
+    for (size_t i = 0; i <= count; ++i) {
+        size_t start = 0, end = 0;
+        if (i < count) {
+            const size_t off = HEADER_SIZE + size_t(blocks[i].addr) * 256;
+            start = off & ~(page - 1);
+            end = (off + 256 + page - 1) & ~(page - 1);
+            if (start <= runEnd && end >= runStart) {
+                runStart = std::min(runStart, start);
+                runEnd = std::max(runEnd, end);
+                continue;
+            }
+        }
+        if (::msync(map_ + runStart, std::min(runEnd, mapLen_) - runStart, MS_SYNC) != 0)
+            return false;
+        runStart = start;
+        runEnd = end;
+    }
+    return true;
+}
+
+void RpmbStateFile::ApplyToMemory(const Block* blocks, size_t count) {
+    for (size_t i = 0; i < count; ++i)
+        SeqlockWrite(MutableBlock(blocks[i].addr), blocks[i].data, 256);
+}
+
+// Journal record, synced before the state file is touched.
+// The record stays valid until the next one replaces it.
+bool RpmbStateFile::WriteJournal(const Header& hdr, const Block* blocks, size_t count) {
+    if (fd_ < 0 || journalFd_ < 0) return false;
+
+    const size_t body = JOFF_ENTRIES + count * JENTRY_SIZE;
+    record_.resize(body + 32);
+    uint8_t* r = record_.data();
+
+    std::memcpy(r, JOURNAL_MAGIC, 8);
+    std::memcpy(r + JOFF_FILEID, &fileId_, 8);
+    r[JOFF_KEYPROG] = hdr.keyProgrammed ? 1 : 0;
+    std::memcpy(r + JOFF_KEY, hdr.key, 32);
+    std::memcpy(r + JOFF_WCOUNTER, &hdr.writeCounter, 4);
+    const uint32_t cnt32 = uint32_t(count);
+    std::memcpy(r + JOFF_COUNT, &cnt32, 4);
+    for (size_t i = 0; i < count; ++i) {
+        uint8_t* e = r + JOFF_ENTRIES + i * JENTRY_SIZE;
+        std::memcpy(e, &blocks[i].addr, 2);
+        std::memcpy(e + 2, blocks[i].data, 256);
+    }
+    SHA256(r, body, r + body);
+
+    if (!PWriteAll(journalFd_, r, record_.size(), 0) || ::fdatasync(journalFd_) != 0) {
+        DBG("[rpmbd] journal write failed: %s", std::strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+// Journal + in-place file update (buffered file I/O, storage untouched)
+bool RpmbStateFile::WriteRecord(const Header& hdr, const Block* blocks, size_t count) {
+    if (!WriteJournal(hdr, blocks, count)) return false;
+
+    // The synced journal record is the commit: a failed in-place update
+    // is still acked, and the record is replayed on restart. Later commits
+    // fail, as their journal record would replace this one.
+    if (!ApplyInPlace(hdr, blocks, count) || ::fdatasync(fd_) != 0) {
+        RPMB_LOG(RpmbLog::Error, "[rpmbd] state write failed: %s -> kept in the journal, "
+                 "further writes fail until restart", std::strerror(errno));
+        CloseFiles();
+        return true;
+    }
+
+    DBG("[rpmbd] SaveState: %zu block(s) writeCounter=%u -> '%s'",
+        count, hdr.writeCounter, opt_.path.c_str());
+    return true;
+}
+
+bool RpmbStateFile::Persist(const Header& hdr, const Block* blocks, size_t count) {
+    if (opt_.durability == Durability::Group) return groupWritable_.load(std::memory_order_acquire);
+    if (opt_.durability != Durability::Strict) return true;
+    if (opt_.mode == Mode::Mmap) return WriteJournal(hdr, blocks, count);
+    return WriteRecord(hdr, blocks, count);
+}
+
+void RpmbStateFile::Apply(const Header& hdr, const Block* blocks, size_t count) {
+    switch (opt_.durability) {
+    case Durability::Group: {
+        std::lock_guard<std::mutex> lk(mu_);
+        ApplyToMemory(blocks, count);
+        for (size_t i = 0; i < count; ++i) {
+            const uint16_t a = blocks[i].addr;
+            if (!dirtyMap_[a]) {
+                dirtyMap_[a] = 1;
+                dirtyList_.push_back(a);
+            }
+        }
+        pendingHdr_ = hdr;
+        hdrDirty_ = true;
+        cv_.notify_one();
+        break;
+    }
+
+    case Durability::Strict:
+    case Durability::Volatile:
+    default:
+        ApplyToMemory(blocks, count);
+        if (map_ && opt_.durability == Durability::Strict) {
+            map_[HOFF_KEYPROG] = hdr.keyProgrammed ? 1 : 0;
+            std::memcpy(map_ + HOFF_KEY, hdr.key, 32);
+            std::memcpy(map_ + HOFF_WCOUNTER, &hdr.writeCounter, 4);
+        }
+        break;
+    }
+}
+
+void RpmbStateFile::Sync(const Block* blocks, size_t count) {
+    if (opt_.durability != Durability::Strict || !map_ || fd_ < 0) return;
+
+    // The journal already made the commit durable; a failed msync only means
+    // the record is replayed on the next start.
+    if (!SyncMapped(blocks, count))
+        DBG("[rpmbd] msync failed: %s", std::strerror(errno));
+}
+
+bool RpmbStateFile::Commit(const Header& hdr, const Block* blocks, size_t count) {
+    if (!Persist(hdr, blocks, count)) return false;
+    Apply(hdr, blocks, count);
+    Sync(blocks, count);
+    return true;
+}
+
+// ----------------------------------------------------------------------
+// Group commit
+
+bool RpmbStateFile::Flush() {
+    if (opt_.durability != Durability::Group) return true;
+    std::unique_lock<std::mutex> lk(mu_);
+    return FlushLocked(lk);
+}
+
+// Waits for the first dirty commit, lets the batch grow for at most
+// flushIntervalMs and writes it out as one record. A failed batch is
+// retried after a growing delay.
+void RpmbStateFile::FlushLoop() {
+    using std::chrono::milliseconds;
+    std::unique_lock<std::mutex> lk(mu_);
+    const milliseconds interval(opt_.flushIntervalMs);
+    milliseconds retry(0);
+    for (;;) {
+        cv_.wait(lk, [&] { return stop_ || hdrDirty_; });
+        if (!stop_) cv_.wait_for(lk, std::max(interval, retry), [&] { return stop_; });
+        if (FlushLocked(lk))
+            retry = milliseconds(0);
+        else
+            retry = std::min(milliseconds(1000), std::max(milliseconds(10), retry * 2));
+        if (stop_) break;
+    }
+}
+
+// Forgets pending group commits that can no longer be written
+void RpmbStateFile::DropDirtyLocked() {
+    for (uint16_t a : dirtyList_) dirtyMap_[a] = 0;
+    dirtyList_.clear();
+    hdrDirty_ = false;
+}
+
+// Snapshot the dirty set under mu_, write it without holding the lock.
+// Only the flusher (or Close after it stopped) gets here, so file I/O is serialized.
+bool RpmbStateFile::FlushLocked(std::unique_lock<std::mutex>& lk) {
+    if (fd_ < 0) DropDirtyLocked();    // files closed after a failed update
+    if (!hdrDirty_) return true;
+
+    const Header hdr = pendingHdr_;
+    std::vector<uint16_t> addrs;
+    addrs.swap(dirtyList_);
+    std::sort(addrs.begin(), addrs.end());
+
+    std::vector<uint8_t> data(addrs.size() * 256);
+    std::vector<Block> blocks(addrs.size());
+    for (size_t i = 0; i < addrs.size(); ++i) {
+        dirtyMap_[addrs[i]] = 0;
+        std::memcpy(&data[i * 256], BlockData(addrs[i]), 256);
+        blocks[i].addr = addrs[i];
+        blocks[i].data = &data[i * 256];
+    }
+    hdrDirty_ = false;
+
+    lk.unlock();
+    const bool ok = WriteRecord(hdr, blocks.data(), blocks.size());
+    lk.lock();
+
+    // The in-place update failed after the journal took the batch, and the
+    // files are closed: no flush can succeed again, so stop accepting
+    // writes now (WriteRecord logged it) and do not retry
+    if (fd_ < 0) {
+        groupWritable_.store(false, std::memory_order_release);
+        DropDirtyLocked();
+        return true;
+    }
+
+    // Until a batch is on disk again, new commits fail instead of being
+    // acked and piling up in memory
+    if (groupWritable_.exchange(ok, std::memory_order_acq_rel) != ok) {
+        if (ok)
+            RPMB_LOG(RpmbLog::Info, "[rpmbd] group flush succeeded -> writes accepted again");
+        else
+            RPMB_LOG(RpmbLog::Error, "[rpmbd] group flush to '%s' failed -> writes fail (WRITE_FAIL) until a flush succeeds",
+                     opt_.path.c_str());
+    }
+
+    if (!ok) {
+        // Keep the batch for the next attempt; newer commits already superseded hdr
+        for (uint16_t a : addrs) {
+            if (!dirtyMap_[a]) {
+                dirtyMap_[a] = 1;
+                dirtyList_.push_back(a);
+            }
+        }
+        if (!hdrDirty_) {
+            pendingHdr_ = hdr;
+            hdrDirty_ = true;
+        }
+    }
+    return ok;
+}
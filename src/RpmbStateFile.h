@@ -0,0 +1,197 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <sys/types.h>
+
+// Persistent RPMB state file, also owning the in-memory block storage.
+//
+// Layout (unchanged from the original full-rewrite format):
+//   "RPMBDv1\0" | keyProgrammed(1) | key(32) | writeCounter(4) | maxBlocks(4) | blocks
+//
+// Commits are applied in place with positioned writes. Every commit is first
+// written as one self-checking record to "<stateFile>.journal" and synced, so a
+// crash in the middle of the in-place update is repaired on the next Open() by
+// replaying the record: data blocks and write counter never get out of step.
+//
+// The block area is sparse on both sides: the file is extended with
+// ftruncate() (unwritten blocks stay holes) and memory is only used for
+// blocks that were written. Unwritten blocks read as zeros.
+//
+// Storage modes:
+//   Buffered: blocks live in 16 KiB chunks allocated on first write; Open()
+//             only loads chunks holding data. Commits pwrite + fdatasync.
+//   Mmap:     blocks are served from a shared mapping of the file (pages are
+//             faulted in on use), commits update the mapping and msync only
+//             the touched pages.
+//
+// Durability:
+//   Strict:   every Commit() is on disk when it returns.
+//   Group:    Commit() only updates memory; a flusher thread writes all blocks
+//             dirtied within flushIntervalMs as one journal record (one sync pair).
+//             A crash loses at most that window, never consistency. Buffered only.
+//   Volatile: the file is loaded (if present) but never written.
+class RpmbStateFile {
+public:
+    enum class Mode { Buffered, Mmap };
+    enum class Durability { Strict, Group, Volatile };
+
+    struct Options {
+        std::string path = "rpmb_state.bin";
+        uint32_t maxBlocks = 128;           // 1 .. MAX_BLOCKS
+        Mode mode = Mode::Buffered;
+        Durability durability = Durability::Strict;
+        uint32_t flushIntervalMs = 10;   // Group only
+    };
+
+    struct Header {
+        bool keyProgrammed = false;
+        uint8_t key[32]{};
+        uint32_t writeCounter = 0;
+    };
+
+    // One dirty block (data points to 256 bytes)
+    struct Block {
+        uint16_t addr;
+        const uint8_t* data;
+    };
+
+    explicit RpmbStateFile(const Options& opt);
+    ~RpmbStateFile();
+
+    RpmbStateFile(const RpmbStateFile&) = delete;
+    RpmbStateFile& operator=(const RpmbStateFile&) = delete;
+
+    // Opens or creates the state file and recovers an interrupted commit.
+    // On failure the storage is still usable (zeroed) but commits fail.
+    bool Open(Header& hdr);
+
+    // Persists the header and the given blocks (atomically, as far as the
+    // durability mode persists at all) and updates storage.
+    bool Commit(const Header& hdr, const Block* blocks, size_t count);
+
+    // Commit() in three steps, for callers that publish the change to
+    // concurrent readers themselves:
+    //   Persist(): I/O that must precede visibility (may block on fsync)
+    //   Apply():   updates storage, no I/O (short; wrap in the publish window)
+    //   Sync():    I/O that may follow visibility
+    bool Persist(const Header& hdr, const Block* blocks, size_t count);
+    void Apply(const Header& hdr, const Block* blocks, size_t count);
+    void Sync(const Block* blocks, size_t count);
+
+    // Writes out everything committed so far (Group); no-op otherwise.
+    bool Flush();
+
+    // Stops the flusher after a final flush and closes the files.
+    void Close();
+
+    // 256 bytes of block addr (< maxBlocks). Safe against a concurrent
+    // Apply() in the sense of a seqlock: the bytes may be torn, never freed.
+    // Copy them out with SeqlockRead() when racing a writer.
+    const uint8_t* BlockData(uint16_t addr) const {
+        if (map_) return map_ + HEADER_SIZE + size_t(addr) * 256;
+        const uint8_t* c = chunks_[addr / CHUNK_BLOCKS].load(std::memory_order_acquire);
+        return c ? c + size_t(addr % CHUNK_BLOCKS) * 256 : ZERO_BLOCK;
+    }
+
+    // Block storage allocated in memory (Buffered), in bytes
+    size_t ResidentBytes() const;
+
+    // Header and block storage at one point in time (Buffered only). Taking
+    // one copies nothing: chunks are shared with the live storage and other
+    // snapshots and only copied when the live storage writes to them.
+    // Unreferenced chunks are kept for reuse, never freed while this object
+    // lives, so BlockData() readers racing a restore stay safe.
+    struct Snapshot {
+        Header hdr;
+        std::vector<uint8_t*> chunks;   // empty or nullptr: all zeros
+    };
+
+    // Snapshot calls are serialized with commits by the caller, like commits
+    bool TakeSnapshot(const Header& hdr, Snapshot& out);
+    void DropSnapshot(Snapshot& snap);
+
+    // Restore in the steps of Commit(): PersistRestore() writes the blocks
+    // that differ from snap (journaled like a commit) and returns their
+    // addresses; ApplyRestore() switches storage to snap's chunks (no I/O).
+    // A Snapshot with no chunks restores all-zero storage.
+    bool PersistRestore(const Snapshot& snap, std::vector<uint16_t>& changed);
+    void ApplyRestore(const Snapshot& snap, const std::vector<uint16_t>& changed);
+
+    static const size_t HEADER_SIZE = 49;
+    static const uint32_t MAX_BLOCKS = 65536;   // 16 MiB, 16-bit addresses
+
+private:
+    Options opt_;
+    std::string journalPath_;
+
+    int fd_ = -1;
+    int journalFd_ = -1;
+    uint64_t fileId_ = 0;           // st_dev/st_ino of the state file
+    std::vector<uint8_t> record_;   // reused journal record buffer
+
+    // Buffered mode: chunk table, nullptr = all zeros. Chunks are published
+    // with release stores. A chunk is referenced by the table and by
+    // snapshots; one that is shared is copied before it is written. Chunk
+    // memory is only freed on destruction: unreferenced chunks go to
+    // freeChunks_ and are reused by writers, inside their publish window.
+    static const size_t CHUNK_BLOCKS = 64;
+    static const uint8_t ZERO_BLOCK[256];
+    struct Chunk {
+        uint8_t data[CHUNK_BLOCKS * 256];   // first: data pointer == Chunk*
+        uint32_t refs = 0;                  // writer side only
+    };
+    std::unique_ptr<std::atomic<uint8_t*>[]> chunks_;
+    size_t chunkCount_ = 0;
+    std::vector<std::unique_ptr<Chunk>> allChunks_;
+    std::vector<Chunk*> freeChunks_;
+
+    uint8_t* map_ = nullptr;        // Mmap mode
+    size_t mapLen_ = 0;
+
+    // Group commit state (guarded by mu_)
+    std::mutex mu_;
+    std::condition_variable cv_;
+    std::thread flusher_;
+    bool stop_ = false;
+    Header pendingHdr_;
+    bool hdrDirty_ = false;
+    std::vector<uint16_t> dirtyList_;
+    std::vector<uint8_t> dirtyMap_;
+    // Commits are refused while there is no file or the last flush failed
+    std::atomic<bool> groupWritable_{false};
+
+    size_t FileSize() const { return HEADER_SIZE + size_t(opt_.maxBlocks) * 256; }
+
+    bool OpenFile(Header& hdr);
+    bool StartFresh(const Header& hdr);
+    bool CreateFresh(const Header& hdr);
+    bool OpenJournal(bool truncate);
+    bool Recover(Header& hdr);
+    bool AttachStorage();
+    bool LoadChunks();
+    void UseMemoryStorage();
+    void FreeChunks();
+    uint8_t* NewChunk();
+    static void Retain(uint8_t* c);
+    void Release(uint8_t* c);
+    uint8_t* MutableBlock(uint16_t addr);
+    void CloseFiles();
+
+    bool WriteJournal(const Header& hdr, const Block* blocks, size_t count);
+    bool WriteRecord(const Header& hdr, const Block* blocks, size_t count);
+    bool ApplyInPlace(const Header& hdr, const Block* blocks, size_t count);
+    bool SyncMapped(const Block* blocks, size_t count);
+    bool WriteHeader(const Header& hdr);
+    void ApplyToMemory(const Block* blocks, size_t count);
+
+    void FlushLoop();
+    bool FlushLocked(std::unique_lock<std::mutex>& lk);
+    void DropDirtyLocked();
+};
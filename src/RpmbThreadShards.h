@@ -0,0 +1,62 @@
+#pragma once
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// One T per thread for hot-path instrumentation (metrics shards, span
+// rings). A thread takes a free T on first use and hands it back, contents
+// kept, when it exits; the next new thread reuses it. Ts are never freed,
+// so ForEach() can read them while their threads are still writing.
+// T is value-initialized, so plain counters start at zero.
+template <class T>
+class RpmbThreadShards {
+public:
+    static T& Local() {
+        thread_local Holder h;
+        if (!h.slot) h.slot = Acquire();
+        return h.slot->value;
+    }
+
+    // f(T&) for every T handed out so far, with the list locked
+    template <class F>
+    static void ForEach(F&& f) {
+        Registry& r = Reg();
+        std::lock_guard<std::mutex> lk(r.mu);
+        for (auto& s : r.slots) f(s->value);
+    }
+
+private:
+    struct Slot {
+        T value{};
+        std::atomic<bool> inUse{true};
+    };
+
+    struct Registry {
+        std::mutex mu;
+        std::vector<std::unique_ptr<Slot>> slots;
+    };
+
+    struct Holder {
+        Slot* slot = nullptr;
+        ~Holder() {
+            if (slot) slot->inUse.store(false, std::memory_order_release);
+        }
+    };
+
+    static Registry& Reg() {
+        static Registry* r = new Registry();    // outlives thread_local holders
+        return *r;
+    }
+
+    static Slot* Acquire() {
+        Registry& r = Reg();
+        std::lock_guard<std::mutex> lk(r.mu);
+        for (auto& s : r.slots) {
+            bool expected = false;
+            if (s->inUse.compare_exchange_strong(expected, true)) return s.get();
+        }
+        r.slots.emplace_back(new Slot());
+        return r.slots.back().get();
+    }
+};
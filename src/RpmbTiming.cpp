@@ -0,0 +1,100 @@
+#include "RpmbTiming.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+
+#include "RpmbTrace.h"  // RpmbMonotonicNs
+
+namespace {
+
+struct NamedProfile {
+    const char* name;
+    RpmbTiming::Profile p;
+};
+
+// Rough figures for typical parts, not taken from any one datasheet:
+// an authenticated one-block write costs a few ms on eMMC, about 1 ms on
+// UFS, and every few hundred writes the device goes busy for a while.
+//                                 cmd  read  write  commit  busy every/us
+const NamedProfile PROFILES[] = {
+    { "none",      { 0,    0,    0,     0,      0,   0 } },
+    { "emmc",      { 100,  150,  500,   2500,   128, 25000 } },
+    { "emmc-slow", { 200,  400,  1500,  8000,   32,  80000 } },
+    { "ufs",       { 40,   40,   150,   800,    256, 10000 } },
+};
+
+bool ParseU32(const std::string& s, uint32_t& out) {
+    char* end = nullptr;
+    errno = 0;
+    const unsigned long v = std::strtoul(s.c_str(), &end, 10);
+    if (errno || s.empty() || *end || v > UINT32_MAX) return false;
+    out = uint32_t(v);
+    return true;
+}
+
+} // namespace
+
+bool RpmbTiming::Parse(const std::string& spec, Profile& out, std::string& err) {
+    const size_t comma = spec.find(',');
+    const std::string name = spec.substr(0, comma);
+
+    const NamedProfile* found = nullptr;
+    for (const NamedProfile& np : PROFILES)
+        if (name == np.name) found = &np;
+    if (!found) {
+        err = "unknown timing profile '" + name + "' (" + ProfileNames() + ")";
+        return false;
+    }
+    Profile p = found->p;
+
+    size_t pos = comma;
+    while (pos != std::string::npos) {
+        const size_t next = spec.find(',', pos + 1);
+        const std::string kv = spec.substr(pos + 1, next == std::string::npos ? next : next - pos - 1);
+        pos = next;
+
+        const size_t eq = kv.find('=');
+        const std::string key = kv.substr(0, eq);
+        uint32_t* field = key == "cmd-us"         ? &p.cmdUs
+                        : key == "read-block-us"  ? &p.readBlockUs
+                        : key == "write-block-us" ? &p.writeBlockUs
+                        : key == "commit-us"      ? &p.commitUs
+                        : key == "busy-every"     ? &p.busyEvery
+                        : key == "busy-us"        ? &p.busyUs
+                        : nullptr;
+        if (!field || eq == std::string::npos || !ParseU32(kv.substr(eq + 1), *field)) {
+            err = "bad timing setting '" + kv + "'";
+            return false;
+        }
+    }
+
+    out = p;
+    return true;
+}
+
+std::string RpmbTiming::ProfileNames() {
+    std::string s;
+    for (const NamedProfile& np : PROFILES) {
+        if (!s.empty()) s += " | ";
+        s += np.name;
+    }
+    return s;
+}
+
+uint64_t RpmbTiming::CommitNs() {
+    uint64_t us = p_.commitUs;
+    if (p_.busyEvery && (commits_.fetch_add(1, std::memory_order_relaxed) + 1) % p_.busyEvery == 0)
+        us += p_.busyUs;
+    return us * 1000;
+}
+
+uint64_t RpmbTiming::Reserve(uint64_t costNs) {
+    const uint64_t now = RpmbMonotonicNs();
+    uint64_t prev = busyUntil_.load(std::memory_order_relaxed);
+    uint64_t end;
+    do {
+        end = std::max(now, prev) + costNs;
+    } while (!busyUntil_.compare_exchange_weak(prev, end, std::memory_order_relaxed));
+    return end;
+}
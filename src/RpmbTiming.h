@@ -0,0 +1,55 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+// Device timing model: how long a real part would take for a chain. The core
+// adds up the cost of each chain and books it on the device's timeline
+// (one chain at a time, as on a real RPMB partition); the frontend then
+// holds the completion back until that time. Costs are in microseconds.
+class RpmbTiming {
+public:
+    struct Profile {
+        uint32_t cmdUs = 0;         // per MMC command of a chain
+        uint32_t readBlockUs = 0;   // per 256-byte block of a DATA_READ
+        uint32_t writeBlockUs = 0;  // per 256-byte block of a DATA_WRITE
+        uint32_t commitUs = 0;      // per write counter commit (DATA_WRITE,
+                                    // PROGRAM_KEY)
+        uint32_t busyEvery = 0;     // every n-th commit also costs busyUs
+        uint32_t busyUs = 0;        // (garbage collection, wear leveling)
+
+        bool Enabled() const {
+            return cmdUs || readBlockUs || writeBlockUs || commitUs || (busyEvery && busyUs);
+        }
+    };
+
+    // "<profile>[,<key>=<n>...]", e.g. "emmc" or "ufs,busy-every=100".
+    // Keys: cmd-us, read-block-us, write-block-us, commit-us, busy-every,
+    // busy-us. On failure err says why.
+    static bool Parse(const std::string& spec, Profile& out, std::string& err);
+
+    // Built-in profile names, "a | b | ..."
+    static std::string ProfileNames();
+
+    explicit RpmbTiming(const Profile& p) : p_(p), enabled_(p.Enabled()) {}
+
+    bool Enabled() const { return enabled_; }
+    const Profile& Get() const { return p_; }
+
+    uint64_t CmdNs(size_t commands) const { return uint64_t(p_.cmdUs) * 1000 * commands; }
+    uint64_t ReadNs(size_t blocks) const { return uint64_t(p_.readBlockUs) * 1000 * blocks; }
+    uint64_t WriteNs(size_t blocks) const { return uint64_t(p_.writeBlockUs) * 1000 * blocks; }
+
+    // One commit, with a busy period every busyEvery commits
+    uint64_t CommitNs();
+
+    // Books costNs on the device: starts when the previous chain is done (or
+    // now). Returns when it completes, in RpmbMonotonicNs() time.
+    uint64_t Reserve(uint64_t costNs);
+
+private:
+    Profile p_;
+    bool enabled_;
+    std::atomic<uint64_t> commits_{0};
+    std::atomic<uint64_t> busyUntil_{0};
+};
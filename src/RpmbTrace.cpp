@@ -0,0 +1,196 @@
+#include "RpmbTrace.h"
+
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+
+#include "RpmbLog.h"
+
+// File header:
+//   "RPMBTRC1" | version(4) | maxBlocks(4) | startRealtimeNs(8)
+// maxBlocks is the size of the recorded device, 0 if not known.
+//
+// Record (host byte order):
+//   tsNs(8) | session(4) | count(4) | inLen(8) | outLen(8) |
+//   count * { opcode(4) | blocks(4) | dataLen(4) } |
+//   CMD25 payloads (inLen) | CMD18 responses (outLen)
+static const char     TRACE_MAGIC[8] = { 'R', 'P', 'M', 'B', 'T', 'R', 'C', '1' };
+static const uint32_t TRACE_VERSION  = 2;    // 2: up to 255 commands, 64-bit lengths
+static const size_t   FILE_HDR_SIZE  = 24;
+static const size_t   ROFF_TS        = 0;
+static const size_t   ROFF_SESSION   = 8;
+static const size_t   ROFF_COUNT     = 12;
+static const size_t   ROFF_INLEN     = 16;
+static const size_t   ROFF_OUTLEN    = 24;
+static const size_t   REC_HDR_SIZE   = 32;
+static const size_t   CMD_SIZE       = 12;
+
+// Limits of one chain (match the frontends' MULTI_CMD limits)
+static const uint32_t MAX_TRACE_CMDS = 255;
+static const uint64_t MAX_TRACE_DATA = uint64_t(MAX_TRACE_CMDS) * 0xFFFFu * 512u;
+
+template <class T>
+static void Put(uint8_t* p, T v) { std::memcpy(p, &v, sizeof(v)); }
+
+template <class T>
+static T Get(const uint8_t* p) {
+    T v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+uint64_t RpmbMonotonicNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000ull + uint64_t(ts.tv_nsec);
+}
+
+// ----------------------------------------------------------------------
+
+bool RpmbTraceWriter::Open(const std::string& path, uint32_t maxBlocks) {
+    Close();
+
+    f_ = std::fopen(path.c_str(), "wb");
+    if (!f_) {
+        RPMB_LOG(RpmbLog::Error, "[rpmbd] cannot create trace '%s': %s",
+                 path.c_str(), std::strerror(errno));
+        return false;
+    }
+    std::setvbuf(f_, nullptr, _IOFBF, 1 << 20);
+
+    struct timespec rt;
+    clock_gettime(CLOCK_REALTIME, &rt);
+
+    uint8_t hdr[FILE_HDR_SIZE]{};
+    std::memcpy(hdr, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+    Put<uint32_t>(hdr + 8, TRACE_VERSION);
+    Put<uint32_t>(hdr + 12, maxBlocks);
+    Put<uint64_t>(hdr + 16, uint64_t(rt.tv_sec) * 1000000000ull + uint64_t(rt.tv_nsec));
+
+    startNs_ = RpmbMonotonicNs();
+    failed_ = std::fwrite(hdr, sizeof(hdr), 1, f_) != 1;
+    return !failed_;
+}
+
+void RpmbTraceWriter::Close() {
+    std::lock_guard<std::mutex> lk(mu_);
+    if (!f_) return;
+    if (std::fclose(f_) != 0) failed_ = true;
+    if (failed_)
+        RPMB_LOG(RpmbLog::Error, "[rpmbd] trace incomplete: recording stopped early");
+    f_ = nullptr;
+}
+
+void RpmbTraceWriter::Append(uint64_t tsNs, uint32_t session,
+                             const Rpmbd::MmcCmd* cmds, size_t count,
+                             const uint8_t* in, size_t inLen,
+                             const uint8_t* out, size_t outLen) {
+    uint8_t hdr[REC_HDR_SIZE + MAX_TRACE_CMDS * CMD_SIZE];
+    if (count > MAX_TRACE_CMDS || inLen > MAX_TRACE_DATA || outLen > MAX_TRACE_DATA) {
+        // Never leave a gap: replay would diverge from here on
+        std::lock_guard<std::mutex> lk(mu_);
+        if (f_ && !failed_)
+            RPMB_LOG(RpmbLog::Error, "[rpmbd] chain of %zu commands exceeds the trace format"
+                     " -> recording stopped", count);
+        failed_ = true;
+        return;
+    }
+
+    const uint64_t ts = tsNs > startNs_ ? tsNs - startNs_ : 0;
+    Put<uint64_t>(hdr + ROFF_TS, ts);
+    Put<uint32_t>(hdr + ROFF_SESSION, session);
+    Put<uint32_t>(hdr + ROFF_COUNT, uint32_t(count));
+    Put<uint64_t>(hdr + ROFF_INLEN, uint64_t(inLen));
+    Put<uint64_t>(hdr + ROFF_OUTLEN, uint64_t(outLen));
+    for (size_t i = 0; i < count; ++i) {
+        uint8_t* c = hdr + REC_HDR_SIZE + i * CMD_SIZE;
+        Put<uint32_t>(c + 0, cmds[i].opcode);
+        Put<uint32_t>(c + 4, cmds[i].blocks);
+        Put<uint32_t>(c + 8, cmds[i].dataLen);
+    }
+    const size_t hdrLen = REC_HDR_SIZE + count * CMD_SIZE;
+
+    std::lock_guard<std::mutex> lk(mu_);
+    if (!f_ || failed_) return;
+    if (std::fwrite(hdr, hdrLen, 1, f_) != 1 ||
+        (inLen && std::fwrite(in, inLen, 1, f_) != 1) ||
+        (outLen && std::fwrite(out, outLen, 1, f_) != 1)) {
+        RPMB_LOG(RpmbLog::Error, "[rpmbd] trace write failed: %s -> recording stopped",
+                 std::strerror(errno));
+        failed_ = true;
+    }
+}
+
+// ----------------------------------------------------------------------
+
+bool RpmbTraceReader::Open(const std::string& path) {
+    Close();
+    truncated_ = false;
+
+    f_ = std::fopen(path.c_str(), "rb");
+    if (!f_) return false;
+
+    uint8_t hdr[FILE_HDR_SIZE];
+    if (std::fread(hdr, sizeof(hdr), 1, f_) != 1 ||
+        std::memcmp(hdr, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0 ||
+        Get<uint32_t>(hdr + 8) != TRACE_VERSION) {
+        Close();
+        return false;
+    }
+    maxBlocks_ = Get<uint32_t>(hdr + 12);
+    return true;
+}
+
+void RpmbTraceReader::Close() {
+    if (f_) std::fclose(f_);
+    f_ = nullptr;
+}
+
+bool RpmbTraceReader::Next(RpmbTraceRecord& r) {
+    if (!f_) return false;
+
+    uint8_t hdr[REC_HDR_SIZE];
+    size_t n = std::fread(hdr, 1, sizeof(hdr), f_);
+    if (n == 0) return false;
+    if (n != sizeof(hdr)) {
+        truncated_ = true;
+        return false;
+    }
+
+    r.tsNs = Get<uint64_t>(hdr + ROFF_TS);
+    r.session = Get<uint32_t>(hdr + ROFF_SESSION);
+    const uint32_t count = Get<uint32_t>(hdr + ROFF_COUNT);
+    const uint64_t inLen = Get<uint64_t>(hdr + ROFF_INLEN);
+    const uint64_t outLen = Get<uint64_t>(hdr + ROFF_OUTLEN);
+    if (count > MAX_TRACE_CMDS || inLen > MAX_TRACE_DATA || outLen > MAX_TRACE_DATA) {
+        truncated_ = true;
+        return false;
+    }
+
+    uint8_t cmdBuf[MAX_TRACE_CMDS * CMD_SIZE];
+    r.cmds.resize(count);
+    r.in.resize(inLen);
+    r.out.resize(outLen);
+    if ((count && std::fread(cmdBuf, count * CMD_SIZE, 1, f_) != 1) ||
+        (inLen && std::fread(r.in.data(), inLen, 1, f_) != 1) ||
+        (outLen && std::fread(r.out.data(), outLen, 1, f_) != 1)) {
+        truncated_ = true;
+        return false;
+    }
+
+    size_t inSum = 0, outSum = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+        const uint8_t* c = cmdBuf + i * CMD_SIZE;
+        Rpmbd::MmcCmd& m = r.cmds[i];
+        m.opcode = Get<uint32_t>(c + 0);
+        m.blocks = Get<uint32_t>(c + 4);
+        m.dataLen = Get<uint32_t>(c + 8);
+        if (m.opcode == 25) inSum += m.dataLen;
+        if (m.opcode == 18) outSum += m.dataLen;
+    }
+    if (inSum != inLen || outSum != outLen) {
+        truncated_ = true;   // inconsistent record, treat as corrupt
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,72 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "Rpmbd.h"
+
+// Binary trace of executed MULTI_CMD chains (rpmbd --trace, rpmbd_replay).
+//
+// Each record holds one chain: timestamp, session, the command list, the
+// CMD25 payloads and the CMD18 responses, both packed back to back exactly
+// as Rpmbd::ExecuteChain() takes and fills them. Timestamps are arrival
+// times in CLOCK_MONOTONIC nanoseconds since the trace was opened. The file
+// format is described in RpmbTrace.cpp.
+
+// One recorded chain
+struct RpmbTraceRecord {
+    uint64_t tsNs = 0;
+    uint32_t session = 0;       // per open() of the device
+    std::vector<Rpmbd::MmcCmd> cmds;
+    std::vector<uint8_t> in;
+    std::vector<uint8_t> out;
+};
+
+// Appends records from any thread. Output is buffered by stdio and written
+// when the buffer fills and on Close().
+class RpmbTraceWriter {
+public:
+    ~RpmbTraceWriter() { Close(); }
+
+    // maxBlocks: size of the recorded device, for the replay
+    bool Open(const std::string& path, uint32_t maxBlocks);
+    void Close();
+    bool IsOpen() const { return f_ != nullptr; }
+
+    // tsNs: RpmbMonotonicNs() when the chain arrived
+    void Append(uint64_t tsNs, uint32_t session,
+                const Rpmbd::MmcCmd* cmds, size_t count,
+                const uint8_t* in, size_t inLen,
+                const uint8_t* out, size_t outLen);
+
+private:
+    std::mutex mu_;
+    FILE* f_ = nullptr;
+    uint64_t startNs_ = 0;
+    bool failed_ = false;
+};
+
+class RpmbTraceReader {
+public:
+    ~RpmbTraceReader() { Close(); }
+
+    bool Open(const std::string& path);
+    void Close();
+
+    // Size of the recorded device in blocks, 0 if the trace does not say
+    uint32_t MaxBlocks() const { return maxBlocks_; }
+
+    // false at the end of the trace; Truncated() tells a cut-off last record
+    bool Next(RpmbTraceRecord& r);
+    bool Truncated() const { return truncated_; }
+
+private:
+    FILE* f_ = nullptr;
+    bool truncated_ = false;
+    uint32_t maxBlocks_ = 0;
+};
+
+uint64_t RpmbMonotonicNs();
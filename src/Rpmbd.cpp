@@ -1,31 +1,43 @@
 #include "Rpmbd.h"
 
 #include <cstdio>
-#include <cstdarg>
 #include <cstring>
-#include <fstream>
 #include <algorithm>
-#include <openssl/hmac.h>
+#include <new>
+#include <thread>
+#include <type_traits>
 
 #include "RpmbFrame.h"
-
-static inline void DBG(bool en, const char* fmt, ...) {
-    if (!en) return;
-    va_list ap;
-    va_start(ap, fmt);
-    std::vfprintf(stderr, fmt, ap);
-    std::fprintf(stderr, "\n");
-    std::fflush(stderr);
-    va_end(ap);
+#include "RpmbLog.h"
+#include "RpmbMetrics.h"
+#include "RpmbSeqlock.h"
+#include "RpmbSpans.h"
+#include "RpmbTrace.h"
+
+#define DBG(fmt, ...) RPMB_LOG(RpmbLog::Debug, fmt, ##__VA_ARGS__)
+
+static RpmbStateFile::Options StateFileOptions(const Rpmbd::Options& opt) {
+    RpmbStateFile::Options so;
+    so.path = opt.stateFile;
+    so.maxBlocks = opt.maxBlocks;
+    so.mode = opt.storage;
+    so.durability = opt.durability;
+    so.flushIntervalMs = opt.flushIntervalMs;
+    return so;
 }
 
-Rpmbd::Rpmbd(const Options& opt) : opt_(opt) {
-    storage_.resize(opt_.maxBlocks * 256, 0);
+const size_t Rpmbd::STREAM_FRAMES;
+
+Rpmbd::Rpmbd(const Options& opt)
+    : opt_(opt), stateFile_(StateFileOptions(opt)),
+      blockGen_(opt.maxBlocks, 0), timing_(opt.timing) {
+    if (opt_.macCache) macCache_.reset(new RpmbMacCache(opt_.maxBlocks));
+    SelectCrypto();
     LoadState();
 }
 
 Rpmbd::~Rpmbd() {
-    SaveState();
+    stateFile_.Close();
 }
 
 uint16_t Rpmbd::Be16(const uint8_t* p) {
@@ -58,120 +70,196 @@ bool Rpmbd::StorageAddrValid(uint16_t addr, uint16_t count) const {
 
 bool Rpmbd::ReadBlock(uint16_t addr, uint8_t out256[256]) const {
     if (!StorageAddrValid(addr, 1)) return false;
-    const size_t off = size_t(addr) * 256;
-    std::memcpy(out256, &storage_[off], 256);
+    SeqlockRead(out256, stateFile_.BlockData(addr), 256);
     return true;
 }
 
-void Rpmbd::WriteBlock(uint16_t addr, const uint8_t in256[256]) {
-    if (!StorageAddrValid(addr, 1)) return;
-    const size_t off = size_t(addr) * 256;
-    std::memcpy(&storage_[off], in256, 256);
-}
-
 // ----------------------------------------------------------------------
-// MAC over 284 bytes starting at OFF_DATA
-void Rpmbd::ComputeMac284(const uint8_t* frame, uint8_t macOut[32]) const {
-    const uint8_t* region = frame + OFF_DATA;
-    const size_t regionLen = 284;
+// Seqlock over key/counter/storage
+
+static inline void CpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#else
+    std::this_thread::yield();
+#endif
+}
 
-    unsigned int outLen = 0;
-    HMAC(EVP_sha256(), key_, 32, region, regionLen, macOut, &outLen);
+// Writer side, called with writeMu_ held. Inside the window the shared
+// fields are only written through the Seqlock* accessors.
+void Rpmbd::PublishBegin() {
+    seq_.store(seq_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
 }
 
-bool Rpmbd::VerifyMac284(const uint8_t* frame) const {
-    uint8_t mac[32];
-    ComputeMac284(frame, mac);
-    return std::memcmp(mac, frame + OFF_MAC, 32) == 0;
+void Rpmbd::PublishEnd() {
+    seq_.store(seq_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
 }
 
-// Multi-block MAC: concat all 284-byte regions, store MAC in last frame
-void Rpmbd::ComputeMac284_Multi(const uint8_t* frames, uint16_t blkCnt, uint8_t outMac[32]) const {
-    HMAC_CTX* ctx = HMAC_CTX_new();
-    HMAC_Init_ex(ctx, key_, 32, EVP_sha256(), nullptr);
+static_assert(std::is_trivially_copyable<RpmbMacKey>::value, "mac_ is copied bytewise");
+
+// Reader side. A writer only holds seq_ odd while copying a few blocks in
+// memory (never across file I/O), so the retry loop is short.
+template <class F>
+uint32_t Rpmbd::ReadConsistent(StateView& v, F&& copyOut) const {
+    for (;;) {
+        const uint32_t s1 = seq_.load(std::memory_order_acquire);
+        if (s1 & 1) {
+            CpuRelax();
+            continue;
+        }
 
-    for (uint16_t i = 0; i < blkCnt; ++i) {
-        const uint8_t* f = frames + size_t(i) * 512;
-        HMAC_Update(ctx, f + OFF_DATA, 284);
+        v.keyProgrammed = SeqlockLoad(keyProgrammed_);
+        SeqlockRead(&v.mac, &mac_, sizeof mac_);
+        v.keyGen = SeqlockLoad(keyGen_);
+        v.writeCounter = SeqlockLoad(writeCounter_);
+        copyOut();
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (seq_.load(std::memory_order_relaxed) == s1) return s1;
     }
+}
 
-    unsigned int len = 0;
-    HMAC_Final(ctx, outMac, &len);
-    HMAC_CTX_free(ctx);
+uint32_t Rpmbd::ReadConsistent(StateView& v) const {
+    return ReadConsistent(v, [] {});
 }
 
 // ----------------------------------------------------------------------
+// MAC over 284 bytes starting at OFF_DATA
+void Rpmbd::ComputeMac284(const RpmbMacKey& key, const uint8_t* frame, uint8_t macOut[32]) {
+    key.Mac(frame, 1, macOut);
+}
 
-void Rpmbd::LoadState() {
-    std::ifstream f(opt_.stateFile.c_str(), std::ios::binary);
-    if (!f.good()) {
-        DBG(opt_.debug, "[rpmbd] state not found -> init fresh");
-        return;
-    }
-
-    char magic[8];
-    f.read(magic, 8);
-    if (std::memcmp(magic, "RPMBDv1", 7) != 0) {
-        DBG(opt_.debug, "[rpmbd] state magic mismatch -> ignore");
-        return;
-    }
+bool Rpmbd::VerifyMac284(const RpmbMacKey& key, const uint8_t* frame) {
+    return key.Verify(frame);
+}
 
-    uint8_t kp = 0;
-    f.read(reinterpret_cast<char*>(&kp), 1);
-    keyProgrammed_ = (kp != 0);
+// Each frame carries its own MAC (DATA_WRITE); checked in parallel lanes
+bool Rpmbd::VerifyMac284_Each(const RpmbMacKey& key, const uint8_t* frames, size_t count) {
+    return key.VerifyEach(frames, count);
+}
 
-    f.read(reinterpret_cast<char*>(key_), 32);
-    f.read(reinterpret_cast<char*>(&writeCounter_), 4);
+// ----------------------------------------------------------------------
 
-    uint32_t maxBlocks = 0;
-    f.read(reinterpret_cast<char*>(&maxBlocks), 4);
+// Picks the SHA-256 backend and cross-checks it against OpenSSL; any
+// problem falls back to the OpenSSL reference.
+void Rpmbd::SelectCrypto() {
+    const RpmbShaBackend* b = RpmbShaFind(opt_.crypto);
+    if (!b) {
+        RPMB_LOG(RpmbLog::Error, "[rpmbd] crypto backend '%s' not available -> openssl",
+                 opt_.crypto.c_str());
+        b = &RpmbShaReference();
+    }
 
-    if (maxBlocks != opt_.maxBlocks) {
-        DBG(opt_.debug, "[rpmbd] state maxBlocks mismatch -> reset storage");
-        storage_.assign(opt_.maxBlocks * 256, 0);
-    } else {
-        storage_.resize(opt_.maxBlocks * 256);
-        f.read(reinterpret_cast<char*>(storage_.data()), storage_.size());
+    RpmbMacKey::UseBackend(*b);
+    if (b != &RpmbShaReference() && (!RpmbShaSelfTest(*b) || !RpmbMacKey::SelfTest())) {
+        RPMB_LOG(RpmbLog::Error, "[rpmbd] crypto backend '%s' failed self-test -> openssl", b->name);
+        RpmbMacKey::UseBackend(RpmbShaReference());
+        return;
     }
 
-    DBG(opt_.debug, "[rpmbd] state loaded: keyProg=%d writeCounter=%u",
-        keyProgrammed_ ? 1 : 0, writeCounter_);
+    DBG("[rpmbd] crypto backend: %s", b->name);
 }
 
-void Rpmbd::SaveState() {
-    std::ofstream f(opt_.stateFile.c_str(), std::ios::binary | std::ios::trunc);
-    if (!f.good()) return;
+void Rpmbd::LoadState() {
+    RpmbStateFile::Header hdr;
+    if (!stateFile_.Open(hdr)) {
+        // Runs on in-memory storage; a write it cannot persist is refused
+        if (opt_.durability == RpmbStateFile::Durability::Volatile)
+            RPMB_LOG(RpmbLog::Error, "[rpmbd] state file '%s' unusable -> fresh device, in memory only",
+                     opt_.stateFile.c_str());
+        else
+            RPMB_LOG(RpmbLog::Error, "[rpmbd] state file '%s' unusable -> fresh device, "
+                     "every write fails (WRITE_FAIL)", opt_.stateFile.c_str());
+        return;
+    }
+
+    keyProgrammed_ = hdr.keyProgrammed;
+    std::memcpy(key_, hdr.key, 32);
+    mac_.SetKey(key_);
+    writeCounter_ = hdr.writeCounter;
 
-    char magic[8] = "RPMBDv1";
-    f.write(magic, 8);
+    if (!opt_.keyFile.empty() && !keyProgrammed_) ProvisionKey();
+}
 
-    uint8_t kp = keyProgrammed_ ? 1 : 0;
-    f.write(reinterpret_cast<char*>(&kp), 1);
+// Programs opt_.keyFile as if a host had sent PROGRAM_KEY (test farms
+// start with every board keyed)
+void Rpmbd::ProvisionKey() {
+    uint8_t key[32];
+    if (!ReadKeyFile(key)) return;
+
+    RpmbStateFile::Header hdr;
+    hdr.keyProgrammed = true;
+    std::memcpy(hdr.key, key, 32);
+    hdr.writeCounter = writeCounter_;
+
+    RpmbMacKey newMac;
+    newMac.SetKey(key);
+
+    std::lock_guard<std::mutex> lk(writeMu_);
+    const bool saved = SaveState(hdr, nullptr, 0, [&] {
+        std::memcpy(key_, key, 32);
+        SeqlockWrite(&mac_, &newMac, sizeof mac_);
+        SeqlockStore(keyProgrammed_, true);
+        SeqlockStore(keyGen_, keyGen_ + 1);
+    });
+    if (!saved)
+        RPMB_LOG(RpmbLog::Error, "[rpmbd] key from '%s' could not be persisted", opt_.keyFile.c_str());
+    else
+        DBG("[rpmbd] key provisioned from %s", opt_.keyFile.c_str());
+}
 
-    f.write(reinterpret_cast<char*>(key_), 32);
-    f.write(reinterpret_cast<char*>(&writeCounter_), 4);
+bool Rpmbd::ReadKeyFile(uint8_t key[32]) const {
+    FILE* f = std::fopen(opt_.keyFile.c_str(), "rb");
+    const bool ok = f && std::fread(key, 1, 32, f) == 32 && std::fgetc(f) == EOF;
+    if (f) std::fclose(f);
+    if (!ok)
+        RPMB_LOG(RpmbLog::Error, "[rpmbd] key file '%s' unreadable or not 32 bytes -> not provisioned",
+                 opt_.keyFile.c_str());
+    return ok;
+}
 
-    uint32_t maxBlocks = opt_.maxBlocks;
-    f.write(reinterpret_cast<char*>(&maxBlocks), 4);
+// Persists the given blocks plus header and publishes them to readers
+// together with update(), which changes key/counter members. Returns false
+// (nothing changed) if the commit could not be made durable.
+template <class F>
+bool Rpmbd::SaveState(const RpmbStateFile::Header& hdr,
+                      const RpmbStateFile::Block* blocks, size_t count,
+                      F&& update) {
+    RpmbSpan span("save_state");
+    {
+        RpmbSpan persist("persist");
+        if (!stateFile_.Persist(hdr, blocks, count)) return false;
+    }
 
-    f.write(reinterpret_cast<char*>(storage_.data()), storage_.size());
+    {
+        RpmbSpan publish("storage_update");
+        PublishBegin();
+        stateFile_.Apply(hdr, blocks, count);
+        update();
+        PublishEnd();
+    }
 
-    DBG(opt_.debug, "[rpmbd] SaveState writing to '%s'", opt_.stateFile.c_str());
+    RpmbSpan sync("sync");
+    stateFile_.Sync(blocks, count);
+    return true;
 }
 
 // ----------------------------------------------------------------------
 
-void Rpmbd::MakeResponse(uint16_t respType,
+void Rpmbd::MakeResponse(Session& s,
+                         uint16_t respType,
                          uint16_t result,
                          uint32_t writeCounter,
                          const uint8_t* data256,
                          uint16_t addr,
                          uint16_t count,
                          const uint8_t* nonce16,
-                         bool addMac)
+                         const RpmbMacKey* mac)
 {
-    uint8_t frame[512];
-    std::memset(frame, 0, sizeof(frame));
+    RpmbMetrics::CountResult(RpmbMetrics::ReqIndex(respType), result);
+
+    uint8_t* frame = AppendResponse(s, 1);
 
     if (data256) std::memcpy(frame + OFF_DATA, data256, 256);
     if (nonce16) std::memcpy(frame + OFF_NONCE, nonce16, 16);
@@ -182,248 +270,856 @@ void Rpmbd::MakeResponse(uint16_t respType,
     SetBe16(frame + OFF_RESULT, result);
     SetBe16(frame + OFF_REQRESP, respType);
 
-    if (addMac && keyProgrammed_) {
-        uint8_t mac[32];
-        ComputeMac284(frame, mac);
-        std::memcpy(frame + OFF_MAC, mac, 32);
+    if (mac) {
+        RpmbSpan span("response_mac");
+        if (!data256) mac->Mac(mac->ZeroMidstate(), frame, 1, frame + OFF_MAC);
+        else ComputeMac284(*mac, frame, frame + OFF_MAC);
+    }
+}
+
+// ----------------------------------------------------------------------
+// Request frames and response frames, whole or in pieces
+
+class Rpmbd::FrameReader {
+public:
+    // All frames in memory
+    FrameReader(const uint8_t* frames, size_t count) : mem_(frames), count_(count) {}
+
+    // Pulled from io into buf; the first `buffered` frames are in buf already
+    FrameReader(ChainIo& io, size_t cmd, size_t count, uint8_t* buf, size_t buffered)
+        : io_(&io), cmd_(cmd), count_(count), buf_(buf), buffered_(buffered) {}
+
+    size_t Count() const { return count_; }
+
+    // Next piece (n frames; valid until the next call), nullptr at the end
+    // or if io failed
+    const uint8_t* Next(size_t& n) {
+        n = 0;
+        if (pos_ >= count_) return nullptr;
+
+        const uint8_t* p = buf_;
+        if (mem_) {
+            n = count_ - pos_;
+            p = mem_ + pos_ * RPMB_FRAME_SIZE;
+        } else if (buffered_) {
+            n = buffered_;
+            buffered_ = 0;
+        } else {
+            n = std::min(count_ - pos_, STREAM_FRAMES);
+            if (!io_->Read(cmd_, pos_ * RPMB_FRAME_SIZE, buf_, n * RPMB_FRAME_SIZE)) {
+                io_->failed = true;
+                pos_ = count_;
+                n = 0;
+                return nullptr;
+            }
+        }
+        pos_ += n;
+        return p;
+    }
+
+private:
+    const uint8_t* mem_ = nullptr;
+    ChainIo* io_ = nullptr;
+    size_t cmd_ = 0;
+    size_t count_;
+    size_t pos_ = 0;
+    uint8_t* buf_ = nullptr;
+    size_t buffered_ = 0;
+};
+
+class Rpmbd::FrameWriter {
+public:
+    // Built in place
+    explicit FrameWriter(uint8_t* frames) : mem_(frames) {}
+
+    // Built in buf and pushed to io
+    FrameWriter(ChainIo& io, size_t cmd, uint8_t* buf) : io_(&io), cmd_(cmd), buf_(buf) {}
+
+    // Room for the frames from index pos on; n is reduced to what fits
+    uint8_t* At(size_t pos, size_t& n) {
+        pos_ = pos;
+        if (mem_) return mem_ + pos * RPMB_FRAME_SIZE;
+        n = std::min(n, STREAM_FRAMES);
+        return buf_;
+    }
+
+    // The n frames at At() are complete
+    bool Put(size_t n) {
+        if (mem_) return true;
+        if (io_->Write(cmd_, pos_ * RPMB_FRAME_SIZE, buf_, n * RPMB_FRAME_SIZE)) return true;
+        io_->failed = true;
+        return false;
     }
 
-    respQueue_.insert(respQueue_.end(), frame, frame + 512);
+private:
+    uint8_t* mem_ = nullptr;
+    ChainIo* io_ = nullptr;
+    size_t cmd_ = 0;
+    uint8_t* buf_ = nullptr;
+    size_t pos_ = 0;
+};
+
+// One piece of a streamed transfer; per thread, reused by every chain
+static uint8_t* StreamBuffer() {
+    thread_local std::unique_ptr<uint8_t[]> buf(new uint8_t[Rpmbd::STREAM_FRAMES * RPMB_FRAME_SIZE]);
+    return buf.get();
 }
 
 // ----------------------------------------------------------------------
 // Request handlers
 
-void Rpmbd::HandleProgramKey(const uint8_t* req) {
+void Rpmbd::HandleProgramKey(Session& s, const uint8_t* req) {
     const uint8_t* newKey = req + OFF_MAC;
 
+    std::lock_guard<std::mutex> lk(writeMu_);
+
     if (keyProgrammed_ && !opt_.allowRekey) {
-        MakeResponse(RPMB_RESP_PROGRAM_KEY, RPMB_RES_GENERAL_FAIL,
-                     writeCounter_, nullptr, 0, 0, nullptr, false);
+        MakeResponse(s, RPMB_RESP_PROGRAM_KEY, RPMB_RES_GENERAL_FAIL,
+                     writeCounter_, nullptr, 0, 0, nullptr, nullptr);
         return;
     }
 
-    std::memcpy(key_, newKey, 32);
-    keyProgrammed_ = true;
-    SaveState();
-
-    MakeResponse(RPMB_RESP_PROGRAM_KEY, RPMB_RES_OK,
-                 writeCounter_, nullptr, 0, 0, nullptr, false);
+    RpmbStateFile::Header hdr;
+    hdr.keyProgrammed = true;
+    std::memcpy(hdr.key, newKey, 32);
+    hdr.writeCounter = writeCounter_;
+
+    // Key schedule is derived outside the publish window
+    RpmbMacKey newMac;
+    newMac.SetKey(newKey);
+
+    const bool ok = SaveState(hdr, nullptr, 0, [&] {
+        std::memcpy(key_, newKey, 32);
+        SeqlockWrite(&mac_, &newMac, sizeof mac_);
+        SeqlockStore(keyProgrammed_, true);
+        SeqlockStore(keyGen_, keyGen_ + 1);
+    });
+    if (ok && timing_.Enabled()) s.costNs += timing_.CommitNs();
+
+    MakeResponse(s, RPMB_RESP_PROGRAM_KEY, ok ? RPMB_RES_OK : RPMB_RES_WRITE_FAIL,
+                 writeCounter_, nullptr, 0, 0, nullptr, nullptr);
 }
 
-void Rpmbd::HandleGetCounter(const uint8_t* req) {
+void Rpmbd::HandleGetCounter(Session& s, const uint8_t* req) {
     const uint8_t* nonce = req + OFF_NONCE;
 
-    if (!keyProgrammed_) {
-        MakeResponse(RPMB_RESP_GET_COUNTER, RPMB_RES_NO_KEY,
-                     writeCounter_, nullptr, 0, 0, nonce, false);
+    StateView v;
+    ReadConsistent(v);
+
+    if (!v.keyProgrammed) {
+        MakeResponse(s, RPMB_RESP_GET_COUNTER, RPMB_RES_NO_KEY,
+                     v.writeCounter, nullptr, 0, 0, nonce, nullptr);
         return;
     }
 
-    MakeResponse(RPMB_RESP_GET_COUNTER, RPMB_RES_OK,
-                 writeCounter_, nullptr, 0, 0, nonce, true);
+    MakeResponse(s, RPMB_RESP_GET_COUNTER, RPMB_RES_OK,
+                 v.writeCounter, nullptr, 0, 0, nonce, &v.mac);
 }
 
-void Rpmbd::HandleDataWrite(const uint8_t* firstFrame,
-                            const uint8_t* allFramesBase,
-                            size_t framesTotal)
-{
+void Rpmbd::HandleDataWrite(Session& s, const uint8_t* firstFrame, FrameReader& frames) {
     const uint16_t addr   = Be16(firstFrame + OFF_ADDR);
     const uint16_t blkCnt = Be16(firstFrame + OFF_BLOCK_COUNT);
     const uint32_t wcReq  = Be32(firstFrame + OFF_WCOUNTER);
+    const size_t framesTotal = frames.Count();
+
+    // Phase 1 (lock-free): validate and verify MACs against a snapshot
+    StateView v;
+    ReadConsistent(v);
 
-    if (!keyProgrammed_) {
-        MakeResponse(RPMB_RESP_DATA_WRITE, RPMB_RES_NO_KEY,
-                     writeCounter_, nullptr, addr, blkCnt, nullptr, false);
+    if (!v.keyProgrammed) {
+        MakeResponse(s, RPMB_RESP_DATA_WRITE, RPMB_RES_NO_KEY,
+                     v.writeCounter, nullptr, addr, blkCnt, nullptr, nullptr);
         return;
     }
 
     if (blkCnt == 0 || blkCnt != framesTotal) {
-        MakeResponse(RPMB_RESP_DATA_WRITE, RPMB_RES_GENERAL_FAIL,
-                     writeCounter_, nullptr, addr, blkCnt, nullptr, false);
+        MakeResponse(s, RPMB_RESP_DATA_WRITE, RPMB_RES_GENERAL_FAIL,
+                     v.writeCounter, nullptr, addr, blkCnt, nullptr, nullptr);
         return;
     }
 
     if (!StorageAddrValid(addr, blkCnt)) {
-        MakeResponse(RPMB_RESP_DATA_WRITE, RPMB_RES_ADDR_FAIL,
-                     writeCounter_, nullptr, addr, blkCnt, nullptr, false);
+        MakeResponse(s, RPMB_RESP_DATA_WRITE, RPMB_RES_ADDR_FAIL,
+                     v.writeCounter, nullptr, addr, blkCnt, nullptr, nullptr);
         return;
     }
 
-    for (size_t i = 0; i < framesTotal; ++i) {
-        const uint8_t* f = allFramesBase + i * 512;
-        if (!VerifyMac284(f)) {
-            MakeResponse(RPMB_RESP_DATA_WRITE, RPMB_RES_AUTH_FAIL,
-                         writeCounter_, nullptr, addr, blkCnt, nullptr, false);
-            return;
+    // Piece by piece: verify, then stage the data while it is still in cache.
+    // Frames that arrive in one piece are committed from where they are.
+    RpmbSpan verify("verify_mac");
+    const uint8_t* whole = nullptr;
+    std::vector<uint8_t> staged;
+    bool macOk = true;
+    size_t done = 0, n = 0;
+    while (const uint8_t* p = frames.Next(n)) {
+        macOk &= VerifyMac284_Each(v.mac, p, n);
+        if (done == 0 && n == framesTotal) {
+            whole = p;
+        } else {
+            if (staged.empty()) staged.resize(framesTotal * 256);
+            for (size_t i = 0; i < n; ++i)
+                std::memcpy(&staged[(done + i) * 256], p + i * RPMB_FRAME_SIZE + OFF_DATA, 256);
         }
+        done += n;
+    }
+    verify.End();
+
+    if (done < framesTotal) return;     // transfer failed, the chain is aborted
+
+    if (!macOk) {
+        MakeResponse(s, RPMB_RESP_DATA_WRITE, RPMB_RES_AUTH_FAIL,
+                     v.writeCounter, nullptr, addr, blkCnt, nullptr, nullptr);
+        return;
+    }
+
+    // Phase 2 (writers serialized): counter check + commit
+    std::lock_guard<std::mutex> lk(writeMu_);
+
+    if (v.keyGen != keyGen_) {
+        // Re-keyed since verification: the frames were MACed with a stale key
+        MakeResponse(s, RPMB_RESP_DATA_WRITE, RPMB_RES_AUTH_FAIL,
+                     writeCounter_, nullptr, addr, blkCnt, nullptr, nullptr);
+        return;
     }
 
     if (wcReq != writeCounter_) {
-        MakeResponse(RPMB_RESP_DATA_WRITE, RPMB_RES_COUNTER_FAIL,
-                     writeCounter_, nullptr, addr, blkCnt, nullptr, false);
+        MakeResponse(s, RPMB_RESP_DATA_WRITE, RPMB_RES_COUNTER_FAIL,
+                     writeCounter_, nullptr, addr, blkCnt, nullptr, nullptr);
         return;
     }
 
+    // Persist dirty blocks + new counter, then publish both at once
+    std::vector<RpmbStateFile::Block> dirty(blkCnt);
     for (uint16_t i = 0; i < blkCnt; ++i) {
-        const uint8_t* f = allFramesBase + i * 512;
-        WriteBlock(addr + i, f + OFF_DATA);
+        dirty[i].addr = uint16_t(addr + i);
+        dirty[i].data = whole ? whole + size_t(i) * RPMB_FRAME_SIZE + OFF_DATA
+                              : &staged[size_t(i) * 256];
     }
 
-    writeCounter_++;
-    SaveState();
+    RpmbStateFile::Header hdr;
+    hdr.keyProgrammed = keyProgrammed_;
+    std::memcpy(hdr.key, key_, 32);
+    hdr.writeCounter = writeCounter_ + 1;
+
+    auto update = [&] {
+        SeqlockStore(writeCounter_, writeCounter_ + 1);
+        for (uint16_t i = 0; i < blkCnt; ++i) SeqlockStore(blockGen_[addr + i], blockGen_[addr + i] + 1);
+    };
+
+    if (!SaveState(hdr, dirty.data(), dirty.size(), update)) {
+        MakeResponse(s, RPMB_RESP_DATA_WRITE, RPMB_RES_WRITE_FAIL,
+                     writeCounter_, nullptr, addr, blkCnt, nullptr, nullptr);
+        return;
+    }
+    if (timing_.Enabled()) s.costNs += timing_.WriteNs(blkCnt) + timing_.CommitNs();
 
-    MakeResponse(RPMB_RESP_DATA_WRITE, RPMB_RES_OK,
-                 writeCounter_, nullptr, addr, blkCnt, nullptr, false);
+    MakeResponse(s, RPMB_RESP_DATA_WRITE, RPMB_RES_OK,
+                 writeCounter_, nullptr, addr, blkCnt, nullptr, nullptr);
 }
 
 // DATA_READ: store request only, response is generated later
-void Rpmbd::StartPendingRead(const uint8_t* req) {
-    respQueue_.clear(); // important: drop old responses
+void Rpmbd::StartPendingRead(Session& s, const uint8_t* req) {
+    ClearResponses(s); // important: drop old responses
 
-    pendingRead_.valid = true;
-    pendingRead_.addr = Be16(req + OFF_ADDR);
-    std::memcpy(pendingRead_.nonce, req + OFF_NONCE, 16);
+    s.pendingRead.valid = true;
+    s.pendingRead.addr = Be16(req + OFF_ADDR);
+    std::memcpy(s.pendingRead.nonce, req + OFF_NONCE, 16);
 }
 
 // Called by CUSE layer when CMD18 block count is known
-void Rpmbd::FinalizePendingRead(uint16_t blkCnt) {
-    if (!pendingRead_.valid) return;
-    pendingRead_.valid = false;
+size_t Rpmbd::FinalizePendingRead(Session& s, uint16_t blkCnt, uint8_t* out, size_t outLen) {
+    if (!out) return FinishPendingRead(s, blkCnt, 0, nullptr);
+    FrameWriter w(out);
+    return FinishPendingRead(s, blkCnt, outLen, &w);
+}
+
+// The response goes to direct if that takes exactly this response (returns
+// its size), else to the response queue (returns 0)
+size_t Rpmbd::FinishPendingRead(Session& s, uint16_t blkCnt, size_t outLen, FrameWriter* direct) {
+    if (!s.pendingRead.valid) return 0;
+    s.pendingRead.valid = false;
+
+    RpmbMetrics::RequestTimer timer(RpmbMetrics::REQ_DATA_READ);
+    RpmbSpan span("data_read_response");
 
     if (blkCnt == 0) blkCnt = 1;
 
-    const uint16_t addr = pendingRead_.addr;
-    const uint8_t* nonce = pendingRead_.nonce;
+    const uint16_t addr = s.pendingRead.addr;
+    const uint8_t* nonce = s.pendingRead.nonce;
 
-    respQueue_.clear();
+    ClearResponses(s);
 
-    if (!keyProgrammed_) {
-        MakeResponse(RPMB_RESP_DATA_READ, RPMB_RES_NO_KEY,
-                     writeCounter_, nullptr, addr, blkCnt, nonce, false);
-        return;
-    }
+    const bool addrOk = StorageAddrValid(addr, blkCnt);
+    const size_t len = size_t(blkCnt) * 512;
+    StateView v;
 
-    if (!StorageAddrValid(addr, blkCnt)) {
-        MakeResponse(RPMB_RESP_DATA_READ, RPMB_RES_ADDR_FAIL,
-                     writeCounter_, nullptr, addr, blkCnt, nonce, false);
-        return;
+    if (!addrOk) {
+        ReadConsistent(v);
+        MakeResponse(s, RPMB_RESP_DATA_READ, v.keyProgrammed ? RPMB_RES_ADDR_FAIL : RPMB_RES_NO_KEY,
+                     v.writeCounter, nullptr, addr, blkCnt, nonce, nullptr);
+        return 0;
     }
 
-    std::vector<uint8_t> frames;
-    frames.resize(size_t(blkCnt) * 512);
-    std::memset(frames.data(), 0, frames.size());
+    // Frames are built in place: in the caller's buffer if it takes exactly
+    // this response, else at the tail of the response queue
+    const bool isDirect = direct && outLen == len;
+    FrameWriter queued(isDirect ? nullptr : AppendResponse(s, blkCnt));
+    BuildDataRead(addr, blkCnt, nonce, isDirect ? *direct : queued, v);
+
+    if (!v.keyProgrammed) {
+        ClearResponses(s);
+        MakeResponse(s, RPMB_RESP_DATA_READ, RPMB_RES_NO_KEY,
+                     v.writeCounter, nullptr, addr, blkCnt, nonce, nullptr);
+        return 0;
+    }
 
-    for (uint16_t i = 0; i < blkCnt; ++i) {
-        uint8_t* f = frames.data() + size_t(i) * 512;
+    RpmbMetrics::CountResult(RpmbMetrics::REQ_DATA_READ, RPMB_RES_OK);
+    s.costNs += timing_.ReadNs(blkCnt);
+    return isDirect ? len : 0;
+}
 
-        uint8_t data[256];
-        if (!ReadBlock(addr + i, data)) {
-            MakeResponse(RPMB_RESP_DATA_READ, RPMB_RES_READ_FAIL,
-                         writeCounter_, nullptr, addr, blkCnt, nonce, false);
-            return;
+// DATA_READ frames for blkCnt blocks at addr; v receives the state they
+// were read from (nothing is built if no key is programmed). All frames
+// must come from one version: if a writer publishes between two pieces of
+// a streamed response, it is built again from the start, and after a few
+// attempts with writers held off.
+void Rpmbd::BuildDataRead(uint16_t addr, uint16_t blkCnt, const uint8_t* nonce,
+                          FrameWriter& w, StateView& v) {
+    static const int MAX_RESTARTS = 3;
+    std::unique_lock<std::mutex> writers(writeMu_, std::defer_lock);
+
+    for (int attempt = 0; ; ++attempt) {
+        if (attempt == MAX_RESTARTS) writers.lock();
+
+        std::unique_ptr<RpmbMacKey::Stream> mac;
+        uint32_t version = 0;
+        size_t pos = 0;
+
+        while (pos < blkCnt) {
+            size_t n = blkCnt - pos;
+            uint8_t* frames = w.At(pos, n);
+
+            // Lock-free: copy counter, key and blocks as of one version
+            StateView cur;
+            uint32_t firstGen = 0;
+            RpmbSpan readSpan("read_blocks");
+            const uint32_t seq = ReadConsistent(cur, [&] {
+                for (size_t i = 0; i < n; ++i)
+                    ReadBlock(uint16_t(addr + pos + i), frames + i * RPMB_FRAME_SIZE + OFF_DATA);
+                if (pos == 0) firstGen = SeqlockLoad(blockGen_[addr]);
+            });
+            readSpan.End();
+
+            if (pos == 0) {
+                v = cur;
+                version = seq;
+                if (!v.keyProgrammed) return;
+            } else if (seq != version) {
+                break;      // mixed versions: start over
+            }
+
+            for (size_t i = 0; i < n; ++i) {
+                uint8_t* f = frames + i * RPMB_FRAME_SIZE;
+
+                std::memset(f, 0, OFF_DATA);
+                std::memcpy(f + OFF_NONCE, nonce, 16);
+
+                SetBe32(f + OFF_WCOUNTER, v.writeCounter);
+                SetBe16(f + OFF_ADDR, uint16_t(addr + pos + i));
+                SetBe16(f + OFF_BLOCK_COUNT, blkCnt);
+                SetBe16(f + OFF_RESULT, RPMB_RES_OK);
+                SetBe16(f + OFF_REQRESP, RPMB_RESP_DATA_READ);
+            }
+
+            RpmbSpan macSpan("response_mac");
+            if (pos == 0 && macCache_) {
+                // The first payload's midstate only depends on key and block contents
+                const uint64_t tag = (uint64_t(v.keyGen) << 32) | firstGen;
+                RpmbMacKey::Midstate ms;
+                if (!macCache_->Lookup(addr, tag, ms)) {
+                    v.mac.DataMidstate(frames + OFF_DATA, ms);
+                    macCache_->Store(addr, tag, ms);
+                }
+                mac.reset(new RpmbMacKey::Stream(v.mac, ms));
+            } else if (pos == 0) {
+                mac.reset(new RpmbMacKey::Stream(v.mac));
+            }
+            mac->Update(frames, n);
+            if (pos + n == blkCnt)
+                mac->Final(frames + (n - 1) * RPMB_FRAME_SIZE + OFF_MAC);
+            macSpan.End();
+
+            if (!w.Put(n)) return;
+            pos += n;
         }
 
-        std::memcpy(f + OFF_DATA, data, 256);
-        std::memcpy(f + OFF_NONCE, nonce, 16);
-
-        SetBe32(f + OFF_WCOUNTER, writeCounter_);
-        SetBe16(f + OFF_ADDR, addr + i);
-        SetBe16(f + OFF_BLOCK_COUNT, blkCnt);
-        SetBe16(f + OFF_RESULT, RPMB_RES_OK);
-        SetBe16(f + OFF_REQRESP, RPMB_RESP_DATA_READ);
+        if (pos == blkCnt) return;
     }
-
-    uint8_t mac[32];
-    ComputeMac284_Multi(frames.data(), blkCnt, mac);
-    std::memcpy(frames.data() + size_t(blkCnt - 1) * 512 + OFF_MAC, mac, 32);
-
-    respQueue_.insert(respQueue_.end(), frames.begin(), frames.end());
 }
 
 // ----------------------------------------------------------------------
 
-void Rpmbd::HandleResultRead(const uint8_t*) {
+void Rpmbd::HandleResultRead(Session& s, const uint8_t*) {
     // Ignore RESULT_READ while a DATA_READ is still pending
-    if (pendingRead_.valid) {
-        DBG(opt_.debug, "[rpmbd] RESULT_READ ignored (pending DATA_READ)");
+    if (s.pendingRead.valid) {
+        DBG("[rpmbd] RESULT_READ ignored (pending DATA_READ)");
         return;
     }
 
-    if (!respQueue_.empty()) return;
+    if (PendingResponseBytes(s)) return;
 
-    MakeResponse(RPMB_RESP_RESULT_READ, RPMB_RES_GENERAL_FAIL,
-                 writeCounter_, nullptr, 0, 0, nullptr, false);
+    StateView v;
+    ReadConsistent(v);
+    MakeResponse(s, RPMB_RESP_RESULT_READ, RPMB_RES_GENERAL_FAIL,
+                 v.writeCounter, nullptr, 0, 0, nullptr, nullptr);
 }
 
 // ----------------------------------------------------------------------
 // Dispatcher
 
-void Rpmbd::ProcessRequest(const uint8_t* frame512,
-                           const uint8_t* allFramesBase,
-                           size_t framesTotal)
-{
+void Rpmbd::ProcessRequest(Session& s, const uint8_t* frame512, FrameReader& frames) {
     uint16_t reqType = Be16(frame512 + OFF_REQRESP);
+    RpmbMetrics::RequestTimer timer(RpmbMetrics::ReqIndex(reqType));
+    RpmbSpan span(RpmbMetrics::ReqName(RpmbMetrics::ReqIndex(reqType)));
 
     switch (reqType) {
     case RPMB_REQ_PROGRAM_KEY:
-        respQueue_.clear();
-        HandleProgramKey(frame512);
+        ClearResponses(s);
+        HandleProgramKey(s, frame512);
         break;
     case RPMB_REQ_GET_COUNTER:
-        respQueue_.clear();
-        HandleGetCounter(frame512);
+        ClearResponses(s);
+        HandleGetCounter(s, frame512);
         break;
     case RPMB_REQ_DATA_WRITE:
-        respQueue_.clear();
-        HandleDataWrite(frame512, allFramesBase, framesTotal);
+        ClearResponses(s);
+        HandleDataWrite(s, frame512, frames);
         break;
     case RPMB_REQ_DATA_READ:
-        respQueue_.clear(); // important
-        StartPendingRead(frame512);
+        ClearResponses(s); // important
+        StartPendingRead(s, frame512);
+        timer.Cancel();    // timed when the response is built
         break;
     case RPMB_REQ_RESULT_READ:
         // If a read is pending and no response exists yet, generate it now
-        if (pendingRead_.valid && respQueue_.empty()) {
-            FinalizePendingRead(1); // can be replaced if blkCnt is known earlier
+        if (s.pendingRead.valid && !PendingResponseBytes(s)) {
+            FinalizePendingRead(s, 1); // can be replaced if blkCnt is known earlier
         }
-        HandleResultRead(frame512);
+        HandleResultRead(s, frame512);
         break;
-    default:
-        respQueue_.clear();
-        MakeResponse(RPMB_RESP_RESULT_READ, RPMB_RES_GENERAL_FAIL,
-                     writeCounter_, nullptr, 0, 0, nullptr, false);
+    default: {
+        ClearResponses(s);
+        StateView v;
+        ReadConsistent(v);
+        MakeResponse(s, RPMB_RESP_RESULT_READ, RPMB_RES_GENERAL_FAIL,
+                     v.writeCounter, nullptr, 0, 0, nullptr, nullptr);
         break;
     }
+    }
 }
 
 // ----------------------------------------------------------------------
 
-void Rpmbd::HandleWriteRequestFrames(const uint8_t* data, size_t len) {
+void Rpmbd::HandleWriteRequestFrames(Session& s, const uint8_t* data, size_t len) {
     if (len % 512 != 0) return;
 
     size_t frames = len / 512;
     uint16_t reqType0 = Be16(data + OFF_REQRESP);
 
     if (reqType0 == RPMB_REQ_DATA_WRITE) {
-        ProcessRequest(data, data, frames);
+        FrameReader all(data, frames);
+        ProcessRequest(s, data, all);
         return;
     }
 
     for (size_t i = 0; i < frames; ++i) {
-        ProcessRequest(data + i * 512, data + i * 512, 1);
+        FrameReader one(data + i * 512, 1);
+        ProcessRequest(s, data + i * 512, one);
     }
 }
 
-void Rpmbd::ReadResponseFrames(uint8_t* out, size_t len) {
-    if (respQueue_.size() < len) {
+void Rpmbd::ReadResponseFrames(Session& s, uint8_t* out, size_t len) {
+    const size_t have = PendingResponseBytes(s);
+    if (have < len) {
         // RPMB expects exact length -> return zeros and log
         std::memset(out, 0, len);
-        DBG(opt_.debug, "[rpmbd] ERROR: not enough response data (need=%zu have=%zu)",
-            len, respQueue_.size());
+        RPMB_LOG(RpmbLog::Error, "[rpmbd] ERROR: not enough response data (need=%zu have=%zu)",
+                 len, have);
+        return;
+    }
+
+    std::memcpy(out, s.respQueue.data() + s.respHead, len);
+    s.respHead += len;
+    if (s.respHead == s.respQueue.size()) ClearResponses(s);
+}
+
+void Rpmbd::ReadResponseFrames(Session& s, ChainIo& io, size_t cmd, size_t len) {
+    const size_t have = PendingResponseBytes(s);
+    if (have < len) {
+        uint8_t* zero = StreamBuffer();
+        const size_t piece = STREAM_FRAMES * RPMB_FRAME_SIZE;
+        std::memset(zero, 0, piece);
+        for (size_t off = 0; off < len && !io.failed; off += piece)
+            if (!io.Write(cmd, off, zero, std::min(piece, len - off))) io.failed = true;
+        RPMB_LOG(RpmbLog::Error, "[rpmbd] ERROR: not enough response data (need=%zu have=%zu)",
+                 len, have);
+        return;
+    }
+
+    if (!io.Write(cmd, 0, s.respQueue.data() + s.respHead, len)) io.failed = true;
+    s.respHead += len;
+    if (s.respHead == s.respQueue.size()) ClearResponses(s);
+}
+
+// ----------------------------------------------------------------------
+// MMC_IOC_MULTI_CMD chain, e.g.
+//   CMD23 (set block count)
+//   CMD25 (write request frames)
+//   CMD18 (read response frames)
+//   CMD12 (stop)
+
+bool Rpmbd::ExecuteChain(Session& s, const MmcCmd* cmds, size_t count, ChainIo& io) {
+    return trace_ ? TraceChain(s, cmds, count, io) : RunChain(s, cmds, count, io);
+}
+
+bool Rpmbd::RunChain(Session& s, const MmcCmd* cmds, size_t count, ChainIo& io) {
+    bool responseRead = false;      // a CMD18 ran in the current transaction
+    s.costNs = timing_.CmdNs(count);
+
+    for (size_t i = 0; i < count && !io.failed; ++i) {
+        const MmcCmd& c = cmds[i];
+
+        DBG("[rpmbd] exec cmd[%zu]: opcode=%u dlen=%u", i, c.opcode, c.dataLen);
+
+        if (c.opcode == 25) {
+            if (responseRead) {
+                DBG("[rpmbd] cmd[%zu] starts the next transaction", i);
+                EndTransaction(s);
+                responseRead = false;
+            }
+            RpmbSpan span("CMD25");
+            ExecuteWrite(s, i, c.dataLen, io);
+        } else if (c.opcode == 18) {
+            RpmbSpan span("CMD18");
+            ExecuteRead(s, i, c, io);
+            responseRead = true;
+        }
+
+        // CMD23 / CMD12: nothing to do
+    }
+
+    s.readyAtNs = timing_.Enabled() ? timing_.Reserve(s.costNs) : 0;
+    return !io.failed;
+}
+
+void Rpmbd::ExecuteWrite(Session& s, size_t cmd, size_t len, ChainIo& io) {
+    if (const uint8_t* in = io.Map(cmd, 0, len)) {
+        DBG("[rpmbd] CMD25 decoded: reqresp=0x%04x addr=%u cnt=%u",
+            Be16(in + OFF_REQRESP), Be16(in + OFF_ADDR), Be16(in + OFF_BLOCK_COUNT));
+        RPMB_HEX(RpmbLog::Debug, "[rpmbd] CMD25 request frames", in, len);
+
+        HandleWriteRequestFrames(s, in, len);
         return;
     }
 
-    std::memcpy(out, respQueue_.data(), len);
-    respQueue_.erase(respQueue_.begin(), respQueue_.begin() + len);
+    if (len % 512 != 0 || len == 0) return;
+    const size_t frames = len / 512;
+
+    uint8_t* buf = StreamBuffer();
+    size_t n = std::min(frames, STREAM_FRAMES);
+    if (!io.Read(cmd, 0, buf, n * RPMB_FRAME_SIZE)) {
+        io.failed = true;
+        return;
+    }
+
+    DBG("[rpmbd] CMD25 decoded: reqresp=0x%04x addr=%u cnt=%u (streamed, %zu frames)",
+        Be16(buf + OFF_REQRESP), Be16(buf + OFF_ADDR), Be16(buf + OFF_BLOCK_COUNT), frames);
+
+    if (Be16(buf + OFF_REQRESP) == RPMB_REQ_DATA_WRITE) {
+        // buf is refilled by the reader: keep the first frame aside
+        uint8_t first[RPMB_FRAME_SIZE];
+        std::memcpy(first, buf, RPMB_FRAME_SIZE);
+        FrameReader all(io, cmd, frames, buf, n);
+        ProcessRequest(s, first, all);
+        return;
+    }
+
+    for (size_t pos = 0; ; ) {
+        for (size_t i = 0; i < n; ++i) {
+            FrameReader one(buf + i * 512, 1);
+            ProcessRequest(s, buf + i * 512, one);
+        }
+        pos += n;
+        if (pos == frames) return;
+
+        n = std::min(frames - pos, STREAM_FRAMES);
+        if (!io.Read(cmd, pos * RPMB_FRAME_SIZE, buf, n * RPMB_FRAME_SIZE)) {
+            io.failed = true;
+            return;
+        }
+    }
+}
+
+void Rpmbd::ExecuteRead(Session& s, size_t cmd, const MmcCmd& c, ChainIo& io) {
+    const size_t dlen = c.dataLen;
+
+    // blkCnt = CMD18 blocks (fallback to dlen/512)
+    uint16_t blkCnt = (uint16_t)c.blocks;
+    if (blkCnt == 0) blkCnt = (uint16_t)(dlen / 512);
+    if (blkCnt == 0) blkCnt = 1;
+
+    if (uint8_t* out = io.Map(cmd, 0, dlen)) {
+        // Finalize pending read before fetching responses; DATA_READ
+        // frames are then built straight in the outgoing buffer
+        size_t done = 0;
+        if (HasPendingRead(s))
+            done = FinalizePendingRead(s, blkCnt, out, dlen);
+        if (!done)
+            ReadResponseFrames(s, out, dlen);
+
+        RPMB_HEX(RpmbLog::Debug, "[rpmbd] CMD18 response frames", out, dlen);
+        return;
+    }
+
+    // Streamed: DATA_READ frames are built piece by piece and pushed out
+    size_t done = 0;
+    if (HasPendingRead(s)) {
+        FrameWriter w(io, cmd, StreamBuffer());
+        done = FinishPendingRead(s, blkCnt, dlen, &w);
+    }
+    if (!done && !io.failed)
+        ReadResponseFrames(s, io, cmd, dlen);
+}
+
+namespace {
+
+// Whole chain in two buffers: CMD25 payloads back to back in `in`, CMD18
+// buffers back to back in `out`. Commands are visited in order.
+class MemoryChainIo : public Rpmbd::ChainIo {
+public:
+    MemoryChainIo(const Rpmbd::MmcCmd* cmds, const uint8_t* in, uint8_t* out)
+        : cmds_(cmds), in_(const_cast<uint8_t*>(in)), out_(out) {}
+
+    uint8_t* Map(size_t cmd, size_t off, size_t) override { return Base(cmd) + off; }
+
+    bool Read(size_t cmd, size_t off, uint8_t* dst, size_t len) override {
+        std::memcpy(dst, Base(cmd) + off, len);
+        return true;
+    }
+
+    bool Write(size_t cmd, size_t off, const uint8_t* src, size_t len) override {
+        std::memcpy(Base(cmd) + off, src, len);
+        return true;
+    }
+
+private:
+    const Rpmbd::MmcCmd* cmds_;
+    uint8_t* in_;
+    uint8_t* out_;
+    size_t at_ = 0;
+
+    uint8_t* Base(size_t cmd) {
+        for (; at_ < cmd; ++at_) {
+            if (cmds_[at_].opcode == 25) in_ += cmds_[at_].dataLen;
+            else if (cmds_[at_].opcode == 18) out_ += cmds_[at_].dataLen;
+        }
+        return cmds_[cmd].opcode == 25 ? in_ : out_;
+    }
+};
+
+} // namespace
+
+static void ChainDataLen(const Rpmbd::MmcCmd* cmds, size_t count, size_t& inLen, size_t& outLen) {
+    inLen = outLen = 0;
+    for (size_t i = 0; i < count; ++i) {
+        if (cmds[i].opcode == 25) inLen += cmds[i].dataLen;
+        else if (cmds[i].opcode == 18) outLen += cmds[i].dataLen;
+    }
+}
+
+void Rpmbd::ExecuteChain(Session& s, const MmcCmd* cmds, size_t count,
+                         const uint8_t* in, uint8_t* out) {
+    MemoryChainIo io(cmds, in, out);
+    if (!trace_) {
+        RunChain(s, cmds, count, io);
+        return;
+    }
+
+    const uint64_t startNs = RpmbMonotonicNs();
+    size_t inLen, outLen;
+    ChainDataLen(cmds, count, inLen, outLen);
+
+    std::lock_guard<std::mutex> lk(traceMu_);
+    RunChain(s, cmds, count, io);
+    trace_->Append(startNs, s.id, cmds, count, in, inLen, out, outLen);
+}
+
+bool Rpmbd::TraceChain(Session& s, const MmcCmd* cmds, size_t count, ChainIo& io) {
+    const uint64_t startNs = RpmbMonotonicNs();
+    size_t inLen, outLen;
+    ChainDataLen(cmds, count, inLen, outLen);
+
+    // Freed on return: a large burst does not stay in memory
+    std::unique_ptr<uint8_t[]> buf(new (std::nothrow) uint8_t[inLen + outLen]);
+    if (!buf) {
+        RPMB_LOG(RpmbLog::Error, "[rpmbd] no memory to record chain in=%zu out=%zu", inLen, outLen);
+        io.failed = true;
+        return false;
+    }
+    uint8_t* in = buf.get();
+    uint8_t* out = in + inLen;
+
+    size_t off = 0;
+    for (size_t i = 0; i < count; ++i) {
+        if (cmds[i].opcode != 25) continue;
+        if (!io.Read(i, 0, in + off, cmds[i].dataLen)) {
+            io.failed = true;
+            return false;
+        }
+        off += cmds[i].dataLen;
+    }
+
+    {
+        MemoryChainIo mem(cmds, in, out);
+        std::lock_guard<std::mutex> lk(traceMu_);
+        RunChain(s, cmds, count, mem);
+        trace_->Append(startNs, s.id, cmds, count, in, inLen, out, outLen);
+    }
+
+    off = 0;
+    for (size_t i = 0; i < count; ++i) {
+        if (cmds[i].opcode != 18) continue;
+        if (!io.Write(i, 0, out + off, cmds[i].dataLen)) {
+            io.failed = true;
+            return false;
+        }
+        off += cmds[i].dataLen;
+    }
+    return true;
+}
+
+bool Rpmbd::StartTrace(const std::string& path) {
+    std::unique_ptr<RpmbTraceWriter> t(new RpmbTraceWriter());
+    if (!t->Open(path, opt_.maxBlocks)) return false;
+    trace_ = std::move(t);
+    return true;
+}
+
+// ----------------------------------------------------------------------
+// Snapshots / reset
+
+bool Rpmbd::TakeSnapshot(const std::string& name, std::string& err) {
+    std::lock_guard<std::mutex> lk(writeMu_);
+
+    RpmbStateFile::Header hdr;
+    hdr.keyProgrammed = keyProgrammed_;
+    std::memcpy(hdr.key, key_, 32);
+    hdr.writeCounter = writeCounter_;
+
+    if (!stateFile_.TakeSnapshot(hdr, snapshots_[name])) {
+        snapshots_.erase(name);
+        err = "snapshots need --storage buffered";
+        return false;
+    }
+    DBG("[rpmbd] snapshot '%s': writeCounter=%u", name.c_str(), writeCounter_);
+    return true;
+}
+
+bool Rpmbd::RestoreSnapshot(const std::string& name, std::string& err) {
+    std::lock_guard<std::mutex> lk(writeMu_);
+    auto it = snapshots_.find(name);
+    if (it == snapshots_.end()) {
+        err = "no snapshot '" + name + "'";
+        return false;
+    }
+    return RestoreState(it->second, err);
+}
+
+bool Rpmbd::DeleteSnapshot(const std::string& name, std::string& err) {
+    std::lock_guard<std::mutex> lk(writeMu_);
+    auto it = snapshots_.find(name);
+    if (it == snapshots_.end()) {
+        err = "no snapshot '" + name + "'";
+        return false;
+    }
+    stateFile_.DropSnapshot(it->second);
+    snapshots_.erase(it);
+    return true;
+}
+
+bool Rpmbd::Reset(std::string& err) {
+    RpmbStateFile::Snapshot factory;    // no chunks: all zeros
+    if (!opt_.keyFile.empty() && ReadKeyFile(factory.hdr.key))
+        factory.hdr.keyProgrammed = true;
+
+    std::lock_guard<std::mutex> lk(writeMu_);
+    return RestoreState(factory, err);
+}
+
+std::vector<std::string> Rpmbd::ListSnapshots() {
+    std::lock_guard<std::mutex> lk(writeMu_);
+    std::vector<std::string> out;
+    for (const auto& s : snapshots_)
+        out.push_back(s.first + ":" + std::to_string(s.second.hdr.writeCounter));
+    return out;
+}
+
+// Caller holds writeMu_. Only blocks that differ are written and get a new
+// generation (MAC cache entries of the others stay valid).
+bool Rpmbd::RestoreState(const RpmbStateFile::Snapshot& snap, std::string& err) {
+    RpmbSpan span("restore_state");
+    std::vector<uint16_t> changed;
+    if (!stateFile_.PersistRestore(snap, changed)) {
+        err = opt_.storage == RpmbStateFile::Mode::Mmap ? "snapshots need --storage buffered"
+                                                        : "state file write failed";
+        return false;
+    }
+
+    const bool rekey = snap.hdr.keyProgrammed != keyProgrammed_ ||
+                       std::memcmp(snap.hdr.key, key_, 32) != 0;
+
+    // Key schedule is derived outside the publish window
+    RpmbMacKey newMac;
+    if (rekey) newMac.SetKey(snap.hdr.key);
+
+    PublishBegin();
+    stateFile_.ApplyRestore(snap, changed);
+    SeqlockStore(keyProgrammed_, snap.hdr.keyProgrammed);
+    if (rekey) {
+        std::memcpy(key_, snap.hdr.key, 32);
+        SeqlockWrite(&mac_, &newMac, sizeof mac_);
+        SeqlockStore(keyGen_, keyGen_ + 1);
+    }
+    SeqlockStore(writeCounter_, snap.hdr.writeCounter);
+    for (uint16_t a : changed) SeqlockStore(blockGen_[a], blockGen_[a] + 1);
+    PublishEnd();
+
+    DBG("[rpmbd] state restored: keyProg=%d writeCounter=%u blocks=%zu",
+        keyProgrammed_ ? 1 : 0, writeCounter_, changed.size());
+    return true;
+}
+
+// ----------------------------------------------------------------------
+// Response queue: frames are appended in place and consumed from respHead;
+// the buffer keeps its capacity, so steady state does not allocate.
+
+uint8_t* Rpmbd::AppendResponse(Session& s, size_t frames) {
+    if (s.respHead && s.respHead == s.respQueue.size()) ClearResponses(s);
+    const size_t off = s.respQueue.size();
+    s.respQueue.resize(off + frames * 512);   // zero-filled
+    return s.respQueue.data() + off;
+}
+
+void Rpmbd::ClearResponses(Session& s) {
+    s.respQueue.clear();
+    s.respHead = 0;
+}
+
+size_t Rpmbd::PendingResponseBytes(const Session& s) {
+    return s.respQueue.size() - s.respHead;
+}
+
+void Rpmbd::EndTransaction(Session& s) {
+    ClearResponses(s);
+    s.pendingRead.valid = false;
 }
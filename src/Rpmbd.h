@@ -3,91 +3,247 @@
 #include <cstdint>
 #include <vector>
 #include <string>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <memory>
+
+#include "RpmbMac.h"
+#include "RpmbStateFile.h"
+#include "RpmbTiming.h"
+
+class RpmbTraceWriter;
 
 class Rpmbd {
 public:
     struct Options {
         std::string stateFile = "rpmb_state.bin";
-        uint32_t maxBlocks = 128;
+        uint32_t maxBlocks = 128;       // partition size in 256-byte blocks
+                                        // (1 .. RpmbStateFile::MAX_BLOCKS)
         bool allowRekey = false;
-        bool debug = true;
+        RpmbStateFile::Mode storage = RpmbStateFile::Mode::Buffered;
+        RpmbStateFile::Durability durability = RpmbStateFile::Durability::Strict;
+        uint32_t flushIntervalMs = 10;  // Durability::Group
+        bool macCache = false;          // cache per-block MAC midstates
+        std::string crypto = "auto";    // SHA-256 backend, see RpmbSha256.h
+        std::string keyFile;            // 32-byte key, programmed at startup
+                                        // if the state has none yet
+        RpmbTiming::Profile timing;     // device latency model; off by default
+    };
+
+    // Request/response state of one client (one open file of the device).
+    // The caller serializes use of a session, e.g. by holding mu for the
+    // whole MULTI_CMD; different sessions may be used concurrently.
+    struct Session {
+        std::mutex mu;
+        uint32_t id = 0;    // assigned by the frontend (logs, traces)
+
+        // Response frames; bytes before respHead are already read
+        std::vector<uint8_t> respQueue;
+        size_t respHead = 0;
+
+        struct PendingRead {
+            bool valid = false;
+            uint16_t addr = 0;
+            uint8_t nonce[16]{};
+        } pendingRead;
+
+        // Timing model: when the last chain is done on the device
+        // (RpmbMonotonicNs), 0 without a model. The frontend completes the
+        // chain no earlier than that.
+        uint64_t readyAtNs = 0;
+        uint64_t costNs = 0;    // of the chain being run
+    };
+
+    // One command of an MMC_IOC_MULTI_CMD chain. Its data is not referenced
+    // here: ExecuteChain() takes all CMD25 payloads and all CMD18 buffers
+    // packed back to back, in chain order, or a ChainIo.
+    struct MmcCmd {
+        uint32_t opcode = 0;
+        uint32_t blocks = 0;
+        uint32_t dataLen = 0;
     };
 
+    // Data of a chain that stays with the caller: CMD25 payloads are pulled
+    // and CMD18 buffers filled through it, in pieces of STREAM_FRAMES
+    // frames, so a large burst never has to be in memory as a whole. off
+    // is relative to the data of command cmd.
+    class ChainIo {
+    public:
+        virtual ~ChainIo() = default;
+
+        // [off, off + len) of cmd's data if directly addressable (CMD25 data
+        // is only read), else nullptr: the core copies via Read()/Write()
+        virtual uint8_t* Map(size_t cmd, size_t off, size_t len) = 0;
+        virtual bool Read(size_t cmd, size_t off, uint8_t* dst, size_t len) = 0;
+        virtual bool Write(size_t cmd, size_t off, const uint8_t* src, size_t len) = 0;
+
+        bool failed = false;    // set by the core when Read()/Write() failed
+    };
+
+    static const size_t STREAM_FRAMES = 64;     // 32 KiB per piece
+
     Rpmbd(const Options& opt);
     ~Rpmbd();
 
-    void HandleWriteRequestFrames(const uint8_t* data, size_t len);
-    void ReadResponseFrames(uint8_t* out, size_t len);
-
-    // Must be called by the CUSE layer before CMD18 reads responses
-    void FinalizePendingRead(uint16_t blkCntFromCmd18);
+    void HandleWriteRequestFrames(Session& s, const uint8_t* data, size_t len);
+    void ReadResponseFrames(Session& s, uint8_t* out, size_t len);
+
+    // Must be called by the CUSE layer before CMD18 reads responses. If out
+    // is given and outLen matches the response exactly, the DATA_READ frames
+    // are built right there and their size is returned; otherwise (0) they
+    // are queued for ReadResponseFrames.
+    size_t FinalizePendingRead(Session& s, uint16_t blkCntFromCmd18,
+                               uint8_t* out = nullptr, size_t outLen = 0);
+
+    // Runs a validated chain (opcodes 23, 25, 18, 12 only) against s; the
+    // caller holds s.mu. in holds the CMD25 payloads, out receives the CMD18
+    // responses.
+    //
+    // A chain may hold several transactions back to back (e.g. write +
+    // result read, counter read, data read), run in order. A CMD25 that
+    // follows a CMD18 starts the next transaction: responses and a pending
+    // DATA_READ the previous one left unread are dropped, so each CMD18 only
+    // ever returns what its own transaction produced.
+    void ExecuteChain(Session& s, const MmcCmd* cmds, size_t count,
+                      const uint8_t* in, uint8_t* out);
+
+    // Same, with the chain's data behind io. A DATA_WRITE is verified piece
+    // by piece and committed at the end; a DATA_READ response is generated
+    // piece by piece. False if io failed (the chain is not completed).
+    bool ExecuteChain(Session& s, const MmcCmd* cmds, size_t count, ChainIo& io);
 
     // True if a DATA_READ request is pending
-    bool HasPendingRead() const { return pendingRead_.valid; }
+    bool HasPendingRead(const Session& s) const { return s.pendingRead.valid; }
+
+    bool TimingEnabled() const { return timing_.Enabled(); }
+
+    // Records every chain run by ExecuteChain() to path (RpmbTrace.h), from
+    // whichever frontend, until the core is destroyed. Call before serving
+    // requests. While recording, chains run one at a time so the trace order
+    // is the execution order (write counters depend on it).
+    bool StartTrace(const std::string& path);
+
+    // Device state control (see RpmbControl), safe while requests run.
+    // Snapshots hold key, write counter and storage under a name and share
+    // unchanged blocks with the live storage (Buffered storage only). A
+    // restore or reset is persisted like a write. Reset() returns to the
+    // state of a fresh state file: no key (or Options::keyFile), counter 0,
+    // all blocks zero. On failure err says why.
+    bool TakeSnapshot(const std::string& name, std::string& err);
+    bool RestoreSnapshot(const std::string& name, std::string& err);
+    bool DeleteSnapshot(const std::string& name, std::string& err);
+    bool Reset(std::string& err);
+    // "<name>:<write counter>" per snapshot
+    std::vector<std::string> ListSnapshots();
 
 private:
     Options opt_;
 
+    // Device state shared by all sessions. Writers (PROGRAM_KEY, DATA_WRITE)
+    // serialize on writeMu_ and change key/counter/storage only inside a
+    // seqlock window (seq_ odd). Readers never lock: they copy what they need
+    // and retry if seq_ moved meanwhile (ReadConsistent).
+    std::mutex writeMu_;
+    std::atomic<uint32_t> seq_{0};
     bool keyProgrammed_ = false;
     uint8_t key_[32]{};
+    RpmbMacKey mac_{};          // key schedule of key_
+    uint32_t keyGen_ = 0;       // bumped on every key change
     uint32_t writeCounter_ = 0;
-    std::vector<uint8_t> storage_;
-
-    std::vector<uint8_t> respQueue_;
-
-    struct LastResult {
-        bool valid = false;
-        uint16_t respType = 0;
-        uint16_t result = 0;
-        uint16_t addr = 0;
-        uint16_t blkCnt = 0;
-        uint8_t nonce[16]{};
-        uint32_t wc = 0;
-    } lastResult_;
-
-    struct PendingRead {
-        bool valid = false;
-        uint16_t addr = 0;
-        uint8_t nonce[16]{};
-    } pendingRead_;
+    RpmbStateFile stateFile_;   // owns the block storage
+    std::vector<uint32_t> blockGen_;  // bumped on every write of a block
+
+    // Optional, tagged with keyGen_/blockGen_ so stale entries never hit
+    std::unique_ptr<RpmbMacCache> macCache_;
+
+    std::map<std::string, RpmbStateFile::Snapshot> snapshots_;   // writeMu_
+
+    RpmbTiming timing_;
+
+    std::unique_ptr<RpmbTraceWriter> trace_;    // set by StartTrace()
+    std::mutex traceMu_;                        // one traced chain at a time
+
+    // Consistent copy of the shared state
+    struct StateView {
+        bool keyProgrammed = false;
+        RpmbMacKey mac{};
+        uint32_t keyGen = 0;
+        uint32_t writeCounter = 0;
+    };
+
+    void PublishBegin();
+    void PublishEnd();
+
+    // Fills v and runs copyOut (e.g. storage reads) against one version
+    // Both return the (even) version the copy was taken from
+    template <class F>
+    uint32_t ReadConsistent(StateView& v, F&& copyOut) const;
+    uint32_t ReadConsistent(StateView& v) const;
 
     static uint16_t Be16(const uint8_t* p);
     static uint32_t Be32(const uint8_t* p);
     static void SetBe16(uint8_t* p, uint16_t v);
     static void SetBe32(uint8_t* p, uint32_t v);
 
+    void SelectCrypto();
     void LoadState();
-    void SaveState();
+    void ProvisionKey();
+    bool ReadKeyFile(uint8_t key[32]) const;
+    bool RestoreState(const RpmbStateFile::Snapshot& snap, std::string& err);
+    template <class F>
+    bool SaveState(const RpmbStateFile::Header& hdr,
+                   const RpmbStateFile::Block* blocks, size_t count,
+                   F&& update);
 
     bool StorageAddrValid(uint16_t addr, uint16_t count) const;
     bool ReadBlock(uint16_t addr, uint8_t out256[256]) const;
-    void WriteBlock(uint16_t addr, const uint8_t in256[256]);
 
-    void ComputeMac284(const uint8_t* frame, uint8_t macOut[32]) const;
-    void ComputeMac284_Multi(const uint8_t* frames, uint16_t blkCnt, uint8_t outMac[32]) const;
-    bool VerifyMac284(const uint8_t* frame) const;
+    static void ComputeMac284(const RpmbMacKey& key, const uint8_t* frame, uint8_t macOut[32]);
+    static bool VerifyMac284(const RpmbMacKey& key, const uint8_t* frame);
+    static bool VerifyMac284_Each(const RpmbMacKey& key, const uint8_t* frames, size_t count);
 
-    void MakeResponse(uint16_t respType,
+    static uint8_t* AppendResponse(Session& s, size_t frames);
+    static void ClearResponses(Session& s);
+    static size_t PendingResponseBytes(const Session& s);
+
+    // Drops what the last transaction left behind in s
+    static void EndTransaction(Session& s);
+
+    void MakeResponse(Session& s,
+                      uint16_t respType,
                       uint16_t result,
                       uint32_t writeCounter,
                       const uint8_t* data256,
                       uint16_t addr,
                       uint16_t count,
                       const uint8_t* nonce16,
-                      bool addMac);
+                      const RpmbMacKey* mac);
+
+    // Frames of one request: in memory, or pulled from a ChainIo
+    class FrameReader;
+    // Frames of one DATA_READ response: in memory, or pushed to a ChainIo
+    class FrameWriter;
 
-    void ProcessRequest(const uint8_t* frame512,
-                        const uint8_t* allFramesBase,
-                        size_t framesTotal);
+    void ProcessRequest(Session& s, const uint8_t* frame512, FrameReader& frames);
 
-    void HandleProgramKey(const uint8_t* req);
-    void HandleGetCounter(const uint8_t* req);
-    void HandleDataWrite(const uint8_t* firstFrame,
-                         const uint8_t* allFramesBase,
-                         size_t framesTotal);
+    void HandleProgramKey(Session& s, const uint8_t* req);
+    void HandleGetCounter(Session& s, const uint8_t* req);
+    void HandleDataWrite(Session& s, const uint8_t* firstFrame, FrameReader& frames);
 
     // DATA_READ: only store request parameters, response is generated later
-    void StartPendingRead(const uint8_t* req);
+    void StartPendingRead(Session& s, const uint8_t* req);
+    size_t FinishPendingRead(Session& s, uint16_t blkCnt, size_t outLen, FrameWriter* direct);
+    void BuildDataRead(uint16_t addr, uint16_t blkCnt, const uint8_t* nonce,
+                       FrameWriter& w, StateView& v);
+
+    bool RunChain(Session& s, const MmcCmd* cmds, size_t count, ChainIo& io);
+    // Recording needs the whole chain's data: staged from io, run, recorded
+    bool TraceChain(Session& s, const MmcCmd* cmds, size_t count, ChainIo& io);
+
+    void ExecuteWrite(Session& s, size_t cmd, size_t len, ChainIo& io);
+    void ExecuteRead(Session& s, size_t cmd, const MmcCmd& c, ChainIo& io);
+    void ReadResponseFrames(Session& s, ChainIo& io, size_t cmd, size_t len);
 
-    void HandleResultRead(const uint8_t* req);
+    void HandleResultRead(Session& s, const uint8_t* req);
 };
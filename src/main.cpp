@@ -1,25 +1,82 @@
 #include "Rpmbd.h"
 #include "RpmbCuseDevice.h"
+#include "RpmbCusePool.h"
+#include "RpmbControl.h"
+#include "RpmbShmServer.h"
+#include "RpmbSha256.h"
+#include "RpmbLog.h"
+#include "RpmbMetrics.h"
+#include "RpmbSpans.h"
 
 #include <iostream>
+#include <fstream>
 #include <string>
+#include <vector>
+#include <memory>
 #include <filesystem>
 #include <ctime>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <csignal>
 #include <unistd.h>   // getpid()
 
 static void usage(const char* prog)
 {
     std::cerr
         << "Usage: " << prog << " --state-file <ABSOLUTE_PATH> [options]\n"
-        << "\nRequired:\n"
+        << "       " << prog << " --config <file> [options]\n"
+        << "\nRequired (one of):\n"
         << "  -s, --state-file <path>   Absolute path to rpmb_state.bin\n"
+        << "  -c, --config <file>       Serve several devices, one [<dev name>] section each:\n"
+        << "                              state-file = <absolute path>   (required)\n"
+        << "                              key = <path>    32-byte key programmed if none yet\n"
+        << "                              trace = <path>  as --trace, for this device\n"
+        << "                              max-blocks = <n>  as --max-blocks, for this device\n"
         << "\nOptions:\n"
         << "  -d, --dev <name>          Device name under /dev (default: mmcblk2rpmb)\n"
-        << "      --debug               Enable debug output\n"
-        << "      --quiet               Disable debug output\n"
+        << "      --key <path>          32-byte key file, programmed at startup if the\n"
+        << "                            state file has no key yet\n"
+        << "      --threads <n>         Max CUSE worker threads, shared by all devices\n"
+        << "                            (default: one per CPU)\n"
+        << "      --max-idle-threads <n>  Start workers on demand and keep at most <n> idle\n"
+        << "                            (default: all --threads started and kept)\n"
+        << "      --cpus <list>         Pin CUSE workers round-robin to these CPUs, e.g. 0-3,6\n"
+        << "      --max-blocks <n>      RPMB size in 256-byte blocks, 1..65536 (default: 128);\n"
+        << "                            only written blocks use memory and disk space\n"
+        << "      --storage <mode>      Block storage: buffered | mmap (default: buffered)\n"
+        << "      --durability <mode>   strict | group | volatile (default: strict)\n"
+        << "                              strict:   fsync before every write response\n"
+        << "                              group:    background flush, batches writes (buffered only)\n"
+        << "                              volatile: keep changes in memory only\n"
+        << "      --flush-interval-ms <n>  Max delay of a group flush (default: 10)\n"
+        << "      --mac-cache           Cache per-block MAC state for repeated reads\n"
+        << "      --crypto <backend>    auto | openssl | scalar | shani | avx2 (default: auto)\n"
+        << "      --timing <spec>       Device latency model: <profile>[,<key>=<n>...] with profile\n"
+        << "                              " << RpmbTiming::ProfileNames() << " (default: none)\n"
+        << "                            and keys cmd-us, read-block-us, write-block-us,\n"
+        << "                            commit-us, busy-every, busy-us\n"
+        << "      --trace <path>        Record every MULTI_CMD, from CUSE and --shm, to <path>\n"
+        << "                            (see rpmbd_replay); the state file at startup is\n"
+        << "                            copied to <path>.state\n"
+        << "      --metrics-socket <path>  Serve Prometheus metrics on a Unix socket\n"
+        << "      --metrics-file <path>    Rewrite Prometheus metrics to <path> periodically\n"
+        << "      --metrics-interval-ms <n>  Period of --metrics-file (default: 1000)\n"
+        << "      --spans <path>        Record per-stage spans; write Chrome trace JSON to <path>\n"
+        << "                            on SIGUSR1 and on exit\n"
+        << "      --control <path>      Unix socket for snapshot / restore / reset of the devices\n"
+        << "                            (buffered storage only) and for the log level\n"
+        << "      --shm <path>          Also serve the devices on a Unix socket with shared-memory\n"
+        << "                            frame rings (see RpmbShmClient.h); no root needed\n"
+        << "      --shm-spin-us <n>     Poll a --shm ring this long before sleeping (default: 20)\n"
+        << "      --no-cuse             Do not create /dev devices (requires --shm)\n"
+        << "      --log-level <level>   off | error | info | debug | trace (default: error)\n"
+        << "      --debug               Enable debug output (--log-level debug)\n"
+        << "      --quiet               Disable all log output (--log-level off)\n"
         << "  -h, --help                Show this help\n"
         << "\nExample:\n"
-        << "  " << prog << " -s /var/lib/rpmb/rpmb_state.bin --dev mmcblk2rpmb --debug\n";
+        << "  " << prog << " -s /var/lib/rpmb/rpmb_state.bin --dev mmcblk2rpmb --debug\n"
+        << "  " << prog << " --config /etc/rpmbd/farm.conf --durability group\n";
 }
 
 static bool isAbsolutePath(const std::string& p)
@@ -27,11 +84,216 @@ static bool isAbsolutePath(const std::string& p)
     return !p.empty() && p[0] == '/';
 }
 
+static bool parseUint(const char* s, uint32_t& out)
+{
+    char* end = nullptr;
+    errno = 0;
+    unsigned long v = std::strtoul(s, &end, 10);
+    if (errno != 0 || end == s || *end != '\0' || v > UINT32_MAX)
+        return false;
+    out = static_cast<uint32_t>(v);
+    return true;
+}
+
+// One simulated device (a --config section, or the command line)
+struct DeviceConfig
+{
+    std::string devName;
+    std::string stateFile;
+    std::string keyFile;
+    std::string traceFile;
+    uint32_t maxBlocks = 0;     // 0: --max-blocks
+};
+
+static bool parseMaxBlocks(const char* s, uint32_t& out)
+{
+    return parseUint(s, out) && out >= 1 && out <= RpmbStateFile::MAX_BLOCKS;
+}
+
+static std::string trim(const std::string& s)
+{
+    const size_t b = s.find_first_not_of(" \t\r");
+    if (b == std::string::npos)
+        return std::string();
+    const size_t e = s.find_last_not_of(" \t\r");
+    return s.substr(b, e - b + 1);
+}
+
+// INI style: "[<dev name>]" starts a device, then "key = value" lines;
+// '#' starts a comment
+static bool loadConfig(const std::string& path, std::vector<DeviceConfig>& out)
+{
+    std::ifstream in(path);
+    if (!in)
+    {
+        std::cerr << "ERROR: Cannot read config file: " << path << "\n";
+        return false;
+    }
+
+    std::string line;
+    for (int lineNo = 1; std::getline(in, line); ++lineNo)
+    {
+        const size_t hash = line.find('#');
+        if (hash != std::string::npos)
+            line.erase(hash);
+        line = trim(line);
+        if (line.empty())
+            continue;
+
+        if (line.front() == '[' && line.back() == ']')
+        {
+            DeviceConfig d;
+            d.devName = trim(line.substr(1, line.size() - 2));
+            if (d.devName.empty() || d.devName.find('/') != std::string::npos)
+            {
+                std::cerr << "ERROR: " << path << ":" << lineNo << ": invalid device name\n";
+                return false;
+            }
+            out.push_back(d);
+            continue;
+        }
+
+        const size_t eq = line.find('=');
+        if (eq == std::string::npos || out.empty())
+        {
+            std::cerr << "ERROR: " << path << ":" << lineNo
+                      << ": expected [<dev name>] or <key> = <value>\n";
+            return false;
+        }
+
+        const std::string key = trim(line.substr(0, eq));
+        const std::string value = trim(line.substr(eq + 1));
+        DeviceConfig& d = out.back();
+        if (key == "state-file")
+            d.stateFile = value;
+        else if (key == "key")
+            d.keyFile = value;
+        else if (key == "trace")
+            d.traceFile = value;
+        else if (key == "max-blocks")
+        {
+            if (!parseMaxBlocks(value.c_str(), d.maxBlocks))
+            {
+                std::cerr << "ERROR: " << path << ":" << lineNo << ": invalid max-blocks: " << value << "\n";
+                return false;
+            }
+        }
+        else
+        {
+            std::cerr << "ERROR: " << path << ":" << lineNo << ": unknown setting: " << key << "\n";
+            return false;
+        }
+    }
+
+    if (out.empty())
+    {
+        std::cerr << "ERROR: No devices in config file: " << path << "\n";
+        return false;
+    }
+    return true;
+}
+
+// Checks the state file path of d; the directory must exist
+static bool validateStateFile(const DeviceConfig& d)
+{
+    if (d.stateFile.empty())
+    {
+        std::cerr << "ERROR: /dev/" << d.devName << ": missing state file\n";
+        return false;
+    }
+
+    if (!isAbsolutePath(d.stateFile))
+    {
+        std::cerr << "ERROR: State file must be an absolute path, got: " << d.stateFile << "\n";
+        return false;
+    }
+
+    try
+    {
+        std::filesystem::path p(d.stateFile);
+        auto parent = p.parent_path();
+        if (parent.empty() || !std::filesystem::exists(parent))
+        {
+            std::cerr << "ERROR: Directory does not exist: " << parent.string() << "\n";
+            return false;
+        }
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "ERROR: Invalid path: " << e.what() << "\n";
+        return false;
+    }
+    return true;
+}
+
+// --key: a raw 32-byte key; caught here, as the core only provisions it
+// when the state has no key yet
+static bool validateKeyFile(const DeviceConfig& d)
+{
+    if (d.keyFile.empty())
+        return true;
+
+    std::ifstream f(d.keyFile, std::ios::binary);
+    char key[33];
+    f.read(key, sizeof(key));
+    if (!f.bad() && f.gcount() == 32)
+        return true;
+
+    if (f.bad() || !f.is_open())
+        std::cerr << "ERROR: Cannot read key file: " << d.keyFile << "\n";
+    else
+        std::cerr << "ERROR: Key file must hold exactly 32 bytes: " << d.keyFile << "\n";
+    return false;
+}
+
+// --trace: snapshot the state the recording starts from
+static bool snapshotForTrace(const DeviceConfig& d)
+{
+    namespace fs = std::filesystem;
+    std::error_code ec;
+    const std::string snap = d.traceFile + ".state";
+    fs::remove(snap, ec);
+    fs::remove(snap + ".journal", ec);
+    if (fs::exists(d.stateFile))
+        fs::copy_file(d.stateFile, snap, ec);
+    if (!ec && fs::exists(d.stateFile + ".journal"))
+        fs::copy_file(d.stateFile + ".journal", snap + ".journal", ec);
+    if (ec)
+    {
+        std::cerr << "ERROR: Cannot snapshot state file for trace: " << ec.message() << "\n";
+        return false;
+    }
+    return true;
+}
+
 int main(int argc, char** argv)
 {
     std::string stateFile;
     std::string devName = "mmcblk2rpmb";
+    bool devNameSet = false;
+    std::string keyFile;
+    std::string configFile;
+    uint32_t threads = 0;
+    uint32_t maxIdleThreads = 0;
+    std::string cpuList;
+    std::vector<int> cpus;
+    uint32_t maxBlocks = 128;
     bool debug = false;
+    bool quiet = false;
+    std::string logLevelName;
+    bool macCache = false;
+    std::string crypto = "auto";
+    std::string timingSpec = "none";
+    RpmbTiming::Profile timing;
+    RpmbStateFile::Mode storage = RpmbStateFile::Mode::Buffered;
+    RpmbStateFile::Durability durability = RpmbStateFile::Durability::Strict;
+    uint32_t flushIntervalMs = 10;
+    std::string traceFile;
+    RpmbMetricsExporter::Options metrics;
+    std::string spansFile;
+    RpmbControl::Options control;
+    RpmbShmServer::Options shm;
+    bool noCuse = false;
 
     // --- parse CLI arguments ---
     for (int i = 1; i < argc; ++i)
@@ -45,6 +307,154 @@ int main(int argc, char** argv)
         else if ((a == "--dev" || a == "-d") && i + 1 < argc)
         {
             devName = argv[++i];
+            devNameSet = true;
+        }
+        else if ((a == "--config" || a == "-c") && i + 1 < argc)
+        {
+            configFile = argv[++i];
+        }
+        else if (a == "--key" && i + 1 < argc)
+        {
+            keyFile = argv[++i];
+        }
+        else if (a == "--threads" && i + 1 < argc)
+        {
+            if (!parseUint(argv[++i], threads) || threads == 0)
+            {
+                std::cerr << "ERROR: Invalid --threads: " << argv[i] << "\n";
+                return 2;
+            }
+        }
+        else if (a == "--max-idle-threads" && i + 1 < argc)
+        {
+            if (!parseUint(argv[++i], maxIdleThreads) || maxIdleThreads == 0)
+            {
+                std::cerr << "ERROR: Invalid --max-idle-threads: " << argv[i] << "\n";
+                return 2;
+            }
+        }
+        else if (a == "--cpus" && i + 1 < argc)
+        {
+            cpuList = argv[++i];
+            if (!RpmbCusePool::ParseCpuList(cpuList, cpus))
+            {
+                std::cerr << "ERROR: Invalid --cpus: " << cpuList << "\n";
+                return 2;
+            }
+        }
+        else if (a == "--max-blocks" && i + 1 < argc)
+        {
+            if (!parseMaxBlocks(argv[++i], maxBlocks))
+            {
+                std::cerr << "ERROR: Invalid --max-blocks (1.." << RpmbStateFile::MAX_BLOCKS << "): "
+                          << argv[i] << "\n";
+                return 2;
+            }
+        }
+        else if (a == "--storage" && i + 1 < argc)
+        {
+            std::string m = argv[++i];
+            if (m == "buffered")
+                storage = RpmbStateFile::Mode::Buffered;
+            else if (m == "mmap")
+                storage = RpmbStateFile::Mode::Mmap;
+            else
+            {
+                std::cerr << "ERROR: Unknown storage mode: " << m << "\n";
+                usage(argv[0]);
+                return 2;
+            }
+        }
+        else if (a == "--durability" && i + 1 < argc)
+        {
+            std::string m = argv[++i];
+            if (m == "strict")
+                durability = RpmbStateFile::Durability::Strict;
+            else if (m == "group")
+                durability = RpmbStateFile::Durability::Group;
+            else if (m == "volatile")
+                durability = RpmbStateFile::Durability::Volatile;
+            else
+            {
+                std::cerr << "ERROR: Unknown durability mode: " << m << "\n";
+                usage(argv[0]);
+                return 2;
+            }
+        }
+        else if (a == "--flush-interval-ms" && i + 1 < argc)
+        {
+            if (!parseUint(argv[++i], flushIntervalMs))
+            {
+                std::cerr << "ERROR: Invalid --flush-interval-ms: " << argv[i] << "\n";
+                return 2;
+            }
+        }
+        else if (a == "--crypto" && i + 1 < argc)
+        {
+            crypto = argv[++i];
+            if (!RpmbShaFind(crypto))
+            {
+                std::cerr << "ERROR: Crypto backend not available on this CPU: " << crypto << "\n";
+                return 2;
+            }
+        }
+        else if (a == "--timing" && i + 1 < argc)
+        {
+            timingSpec = argv[++i];
+            std::string err;
+            if (!RpmbTiming::Parse(timingSpec, timing, err))
+            {
+                std::cerr << "ERROR: Invalid --timing: " << err << "\n";
+                return 2;
+            }
+        }
+        else if (a == "--trace" && i + 1 < argc)
+        {
+            traceFile = argv[++i];
+        }
+        else if (a == "--metrics-socket" && i + 1 < argc)
+        {
+            metrics.socketPath = argv[++i];
+        }
+        else if (a == "--metrics-file" && i + 1 < argc)
+        {
+            metrics.filePath = argv[++i];
+        }
+        else if (a == "--metrics-interval-ms" && i + 1 < argc)
+        {
+            if (!parseUint(argv[++i], metrics.intervalMs) || metrics.intervalMs == 0)
+            {
+                std::cerr << "ERROR: Invalid --metrics-interval-ms: " << argv[i] << "\n";
+                return 2;
+            }
+        }
+        else if (a == "--spans" && i + 1 < argc)
+        {
+            spansFile = argv[++i];
+        }
+        else if (a == "--control" && i + 1 < argc)
+        {
+            control.socketPath = argv[++i];
+        }
+        else if (a == "--shm" && i + 1 < argc)
+        {
+            shm.socketPath = argv[++i];
+        }
+        else if (a == "--shm-spin-us" && i + 1 < argc)
+        {
+            if (!parseUint(argv[++i], shm.spinUs))
+            {
+                std::cerr << "ERROR: Invalid --shm-spin-us: " << argv[i] << "\n";
+                return 2;
+            }
+        }
+        else if (a == "--no-cuse")
+        {
+            noCuse = true;
+        }
+        else if (a == "--mac-cache")
+        {
+            macCache = true;
         }
         else if (a == "--debug")
         {
@@ -53,6 +463,11 @@ int main(int argc, char** argv)
         else if (a == "--quiet")
         {
             debug = false;
+            quiet = true;
+        }
+        else if (a == "--log-level" && i + 1 < argc)
+        {
+            logLevelName = argv[++i];
         }
         else if (a == "--help" || a == "-h")
         {
@@ -67,49 +482,114 @@ int main(int argc, char** argv)
         }
     }
 
-    // --- validate state file path ---
-    if (stateFile.empty())
+    // --- devices: from --config, or the one given on the command line ---
+    std::vector<DeviceConfig> devices;
+    if (!configFile.empty())
+    {
+        if (!stateFile.empty() || devNameSet || !keyFile.empty() || !traceFile.empty())
+        {
+            std::cerr << "ERROR: --config replaces --state-file, --dev, --key and --trace\n";
+            return 2;
+        }
+        if (!loadConfig(configFile, devices))
+            return 2;
+    }
+    else
+    {
+        if (stateFile.empty())
+        {
+            std::cerr << "ERROR: Missing required argument --state-file <ABSOLUTE_PATH>\n";
+            usage(argv[0]);
+            return 2;
+        }
+        devices.push_back({ devName, stateFile, keyFile, traceFile });
+    }
+
+    for (DeviceConfig& d : devices)
+    {
+        if (d.maxBlocks == 0)
+            d.maxBlocks = maxBlocks;
+    }
+
+    for (size_t i = 0; i < devices.size(); ++i)
+    {
+        if (!validateStateFile(devices[i]) || !validateKeyFile(devices[i]))
+            return 2;
+        for (size_t j = 0; j < i; ++j)
+        {
+            if (devices[j].devName == devices[i].devName || devices[j].stateFile == devices[i].stateFile)
+            {
+                std::cerr << "ERROR: /dev/" << devices[i].devName
+                          << ": device name or state file used twice\n";
+                return 2;
+            }
+        }
+    }
+
+    if (storage == RpmbStateFile::Mode::Mmap && durability == RpmbStateFile::Durability::Group)
     {
-        std::cerr << "ERROR: Missing required argument --state-file <ABSOLUTE_PATH>\n";
-        usage(argv[0]);
+        std::cerr << "ERROR: --durability group requires --storage buffered\n";
         return 2;
     }
 
-    if (!isAbsolutePath(stateFile))
+    if (noCuse && shm.socketPath.empty())
     {
-        std::cerr << "ERROR: --state-file must be an absolute path, got: " << stateFile << "\n";
+        std::cerr << "ERROR: --no-cuse requires --shm\n";
         return 2;
     }
 
-    // --- ensure parent directory exists ---
-    try
+    for (const DeviceConfig& d : devices)
     {
-        std::filesystem::path p(stateFile);
-        auto parent = p.parent_path();
-        if (parent.empty() || !std::filesystem::exists(parent))
-        {
-            std::cerr << "ERROR: Directory does not exist: " << parent.string() << "\n";
+        if (!d.traceFile.empty() && !snapshotForTrace(d))
             return 2;
-        }
     }
-    catch (const std::exception& e)
+
+    // --- logging ---
+    RpmbLog::Level logLevel = debug ? RpmbLog::Debug : quiet ? RpmbLog::Off : RpmbLog::Error;
+    if (!logLevelName.empty() && !RpmbLog::ParseLevel(logLevelName, logLevel))
     {
-        std::cerr << "ERROR: Invalid path: " << e.what() << "\n";
+        std::cerr << "ERROR: Unknown log level: " << logLevelName << "\n";
         return 2;
     }
+    if (logLevel >= RpmbLog::Debug)
+        debug = true;
 
-    // --- configure core ---
-    Rpmbd::Options ro;
-    ro.debug = debug;
-    ro.stateFile = stateFile;
+    // Without CUSE, main waits for these itself; blocked before any thread
+    // starts, so every thread inherits the mask
+    sigset_t stopSignals;
+    sigemptyset(&stopSignals);
+    sigaddset(&stopSignals, SIGINT);
+    sigaddset(&stopSignals, SIGTERM);
+    sigaddset(&stopSignals, SIGHUP);
+    if (noCuse)
+        pthread_sigmask(SIG_BLOCK, &stopSignals, nullptr);
 
-    Rpmbd core(ro);
+    RpmbLog::SetLevel(logLevel);
+    RpmbLog::Start();
 
-    // --- configure CUSE device ---
-    RpmbCuseDevice::Options co;
-    co.devName = devName;
-    co.foreground = true;
-    co.debug = debug;
+    // --- configure cores (one per device) ---
+    std::vector<std::unique_ptr<Rpmbd>> cores;
+    for (const DeviceConfig& d : devices)
+    {
+        Rpmbd::Options ro;
+        ro.stateFile = d.stateFile;
+        ro.keyFile = d.keyFile;
+        ro.maxBlocks = d.maxBlocks;
+        ro.storage = storage;
+        ro.durability = durability;
+        ro.flushIntervalMs = flushIntervalMs;
+        ro.macCache = macCache;
+        ro.crypto = crypto;
+        ro.timing = timing;
+        cores.emplace_back(new Rpmbd(ro));
+
+        if (!d.traceFile.empty() && !cores.back()->StartTrace(d.traceFile))
+        {
+            std::cerr << "ERROR: Cannot create trace " << d.traceFile << "\n";
+            RpmbLog::Stop();
+            return 1;
+        }
+    }
 
     // --- status banner ---
     auto now = std::time(nullptr);
@@ -124,12 +604,132 @@ int main(int argc, char** argv)
         << tm.tm_hour << ":"
         << tm.tm_min << ":"
         << tm.tm_sec
-        << " (pid=" << getpid() << ")\n"
-        << "[rpmbd] state-file: " << stateFile << "\n"
-        << "[rpmbd] device:     /dev/" << devName << "\n"
+        << " (pid=" << getpid() << ")\n";
+    for (const DeviceConfig& d : devices)
+    {
+        std::cout
+            << "[rpmbd] device:     " << (noCuse ? "" : "/dev/") << d.devName << "\n"
+            << "[rpmbd] state-file: " << d.stateFile << "\n"
+            << "[rpmbd] max-blocks: " << d.maxBlocks << " (" << (d.maxBlocks / 4) << " KiB)\n";
+        if (!d.keyFile.empty())
+            std::cout << "[rpmbd] key-file:   " << d.keyFile << "\n";
+        if (!d.traceFile.empty())
+            std::cout << "[rpmbd] trace:      " << d.traceFile << "\n";
+    }
+    if (!noCuse)
+    {
+        std::cout << "[rpmbd] threads:    ";
+        if (threads)
+            std::cout << threads;
+        else
+            std::cout << "one per CPU";
+        if (maxIdleThreads)
+            std::cout << " (on demand, max " << maxIdleThreads << " idle)";
+        if (!cpus.empty())
+            std::cout << " on CPUs " << cpuList;
+        std::cout << "\n";
+    }
+    std::cout
+        << "[rpmbd] storage:    " << (storage == RpmbStateFile::Mode::Mmap ? "mmap" : "buffered") << "\n"
+        << "[rpmbd] durability: "
+        << (durability == RpmbStateFile::Durability::Group ? "group"
+            : durability == RpmbStateFile::Durability::Volatile ? "volatile" : "strict") << "\n"
+        << "[rpmbd] crypto:     " << RpmbMacKey::Backend().name << "\n"
+        << "[rpmbd] mac-cache:  " << (macCache ? "on" : "off") << "\n"
+        << "[rpmbd] timing:     " << timingSpec << "\n"
         << "[rpmbd] debug:      " << (debug ? "on" : "off") << "\n";
+    if (!metrics.socketPath.empty())
+        std::cout << "[rpmbd] metrics:    unix:" << metrics.socketPath << "\n";
+    if (!metrics.filePath.empty())
+        std::cout << "[rpmbd] metrics:    " << metrics.filePath
+                  << " (every " << metrics.intervalMs << " ms)\n";
+    if (!spansFile.empty())
+        std::cout << "[rpmbd] spans:      " << spansFile << " (SIGUSR1 / exit)\n";
+    if (!control.socketPath.empty())
+        std::cout << "[rpmbd] control:    unix:" << control.socketPath << "\n";
+    if (!shm.socketPath.empty())
+        std::cout << "[rpmbd] shm:        unix:" << shm.socketPath
+                  << (noCuse ? " (no CUSE)" : "") << "\n";
     std::cout.flush();
 
-    RpmbCuseDevice dev(core, co);
-    return dev.Run();
+    // --- metrics (counting starts with the exporter) ---
+    RpmbMetricsExporter exporter(metrics);
+    if ((!metrics.socketPath.empty() || !metrics.filePath.empty()) && !exporter.Start())
+    {
+        std::cerr << "ERROR: Cannot start metrics exporter\n";
+        RpmbLog::Stop();
+        return 1;
+    }
+
+    if (!spansFile.empty() && !RpmbSpans::Start(spansFile))
+    {
+        std::cerr << "ERROR: Cannot start span recording\n";
+        exporter.Stop();
+        RpmbLog::Stop();
+        return 1;
+    }
+
+    // --- control socket ---
+    RpmbControl controller(control);
+    for (size_t i = 0; i < devices.size(); ++i)
+        controller.Add(devices[i].devName, *cores[i]);
+    if (!control.socketPath.empty() && !controller.Start())
+    {
+        std::cerr << "ERROR: Cannot start control socket\n";
+        RpmbSpans::Stop();
+        exporter.Stop();
+        RpmbLog::Stop();
+        return 1;
+    }
+
+    // --- shared-memory frontend ---
+    RpmbShmServer shmServer(shm);
+    for (size_t i = 0; i < devices.size(); ++i)
+        shmServer.Add(devices[i].devName, *cores[i]);
+    if (!shm.socketPath.empty() && !shmServer.Start())
+    {
+        std::cerr << "ERROR: Cannot start shm socket\n";
+        controller.Stop();
+        RpmbSpans::Stop();
+        exporter.Stop();
+        RpmbLog::Stop();
+        return 1;
+    }
+
+    // --- CUSE devices, all served by one worker pool ---
+    std::vector<std::unique_ptr<RpmbCuseDevice>> devs;
+    for (size_t i = 0; i < devices.size() && !noCuse; ++i)
+    {
+        RpmbCuseDevice::Options co;
+        co.devName = devices[i].devName;
+        co.foreground = true;
+        devs.emplace_back(new RpmbCuseDevice(*cores[i], co));
+    }
+
+    int rc = 0;
+    if (noCuse)
+    {
+        int sig = 0;
+        sigwait(&stopSignals, &sig);
+    }
+    else
+    {
+        RpmbCusePool::Options po;
+        po.threads = threads;
+        po.maxIdle = maxIdleThreads;
+        po.cpus = cpus;
+        RpmbCusePool pool(po);
+        for (auto& d : devs)
+            pool.Add(*d);
+        rc = pool.Run();
+    }
+    devs.clear();
+
+    shmServer.Stop();
+    controller.Stop();
+    RpmbSpans::Stop();
+    exporter.Stop();
+
+    RpmbLog::Stop();
+    return rc;
 }
@@ -3,20 +3,34 @@ set -euo pipefail
 
 WORKING_DIRECTORY="$(pwd -P)"
 
+SCRIPT_DIR="$(cd "$(dirname "$0")" && pwd -P)"
+
 CLEAN_ALL=0
 if [[ "${1:-}" == "--clean-all" ]]; then
   CLEAN_ALL=1
   shift
 fi
 
+# --preload: run mmc against the in-process simulator (build/librpmbd_preload.so)
+# instead of a running rpmbd; needs no root and starts from a fresh state
+PRELOAD=0
+if [[ "${1:-}" == "--preload" ]]; then
+  PRELOAD=1
+  shift
+fi
+
 # --- ensure root (re-run via sudo if needed) ---
-if [[ "${EUID}" -ne 0 ]]; then
+if [[ "$PRELOAD" -eq 0 && "${EUID}" -ne 0 ]]; then
   exec sudo -- "$0" ${CLEAN_ALL:+--clean-all} "$WORKING_DIRECTORY"
 fi
 
+if [[ "$PRELOAD" -eq 1 && $# -eq 0 ]]; then
+  set -- "$WORKING_DIRECTORY"
+fi
+
 # --- guard / usage ---
 if [[ $# -ne 1 ]]; then
-  echo "Usage: $0 [--clean-all] <working-directory>" >&2
+  echo "Usage: $0 [--clean-all] [--preload] <working-directory>" >&2
   exit 2
 fi
 
@@ -24,9 +38,19 @@ cd "$1"
 
 DEV="/dev/mmcblk2rpmb"
 
+if [[ "$PRELOAD" -eq 1 ]]; then
+  export LD_PRELOAD="$SCRIPT_DIR/build/librpmbd_preload.so"
+  export RPMBD_DEV="$DEV"
+  export RPMBD_STATE_FILE="$(pwd -P)/rpmb_preload_state.bin"
+  rm -f "$RPMBD_STATE_FILE"
+fi
+
 # --- cleanup (also on errors) ---
 cleanup() {
   rm -f out.bin
+  if [[ "$PRELOAD" -eq 1 ]]; then
+    rm -f rpmb_preload_state.bin
+  fi
   if [[ "$CLEAN_ALL" -eq 1 ]]; then
     rm -f key.bin data.bin
   fi
@@ -0,0 +1,470 @@
+// In-process microbenchmarks of the Rpmbd core: request chains go through
+// Rpmbd::ExecuteChain() exactly as the CUSE frontend runs them, without the
+// kernel device. Results are printed as JSON.
+
+#include "Rpmbd.h"
+#include "RpmbRequest.h"
+#include "RpmbStateFile.h"
+#include "RpmbTrace.h"     // RpmbMonotonicNs()
+#include "RpmbSha256.h"
+#include "RpmbLog.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <filesystem>
+#include <functional>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+
+static void usage(const char* prog)
+{
+    std::cerr
+        << "Usage: " << prog << " [options]\n"
+        << "\nOptions:\n"
+        << "  -n, --iterations <n>      Measured requests per case (default: 2000)\n"
+        << "      --blocks <n>          Block count of the multi-block cases (default: 8)\n"
+        << "      --max-blocks <list>   maxBlocks values for the state file cases\n"
+        << "                            (default: 128,1024,8192,65536)\n"
+        << "      --dir <path>          Directory for the state files (default: /tmp)\n"
+        << "      --storage <mode>      buffered | mmap (default: buffered)\n"
+        << "      --durability <mode>   strict | group | volatile (default: strict)\n"
+        << "      --mac-cache           Cache per-block MAC state for repeated reads\n"
+        << "      --crypto <backend>    auto | openssl | scalar | shani | avx2 (default: auto)\n"
+        << "  -o, --output <path>       Write the JSON report to <path> (default: stdout)\n"
+        << "  -h, --help                Show this help\n";
+}
+
+static bool parseUint(const char* s, uint32_t& out)
+{
+    char* end = nullptr;
+    errno = 0;
+    unsigned long v = std::strtoul(s, &end, 10);
+    if (errno != 0 || end == s || *end != '\0' || v > UINT32_MAX)
+        return false;
+    out = static_cast<uint32_t>(v);
+    return true;
+}
+
+// ------------------------------------------------------------
+// Measurement
+// ------------------------------------------------------------
+struct Result {
+    std::string name;
+    uint32_t blocks = 1;
+    uint32_t maxBlocks = 0;
+    uint64_t errors = 0;
+    uint64_t totalNs = 0;
+    std::vector<uint64_t> lat;
+};
+
+static uint64_t pct(const std::vector<uint64_t>& sorted, double p)
+{
+    if (sorted.empty()) return 0;
+    return sorted[size_t(p * double(sorted.size() - 1) + 0.5)];
+}
+
+// Runs op warmup + iterations times, timing each measured call. op returns
+// false on a protocol error (counted, not fatal).
+static Result measure(const std::string& name, uint32_t blocks, uint32_t iterations,
+                      const std::function<bool(uint32_t)>& op)
+{
+    Result r;
+    r.name = name;
+    r.blocks = blocks;
+    r.lat.reserve(iterations);
+
+    const uint32_t warmup = std::min<uint32_t>(iterations / 10, 100);
+    for (uint32_t i = 0; i < warmup; ++i)
+        if (!op(i)) r.errors++;
+
+    const uint64_t t0 = RpmbMonotonicNs();
+    for (uint32_t i = 0; i < iterations; ++i)
+    {
+        const uint64_t s = RpmbMonotonicNs();
+        if (!op(warmup + i)) r.errors++;
+        r.lat.push_back(RpmbMonotonicNs() - s);
+    }
+    r.totalNs = RpmbMonotonicNs() - t0;
+    std::sort(r.lat.begin(), r.lat.end());
+    return r;
+}
+
+static void writeJson(std::ostream& os, const Rpmbd::Options& ro, uint32_t iterations,
+                      const std::vector<Result>& results)
+{
+    os << "{\n"
+       << "  \"config\": {\n"
+       << "    \"iterations\": " << iterations << ",\n"
+       << "    \"storage\": \"" << (ro.storage == RpmbStateFile::Mode::Mmap ? "mmap" : "buffered") << "\",\n"
+       << "    \"durability\": \""
+       << (ro.durability == RpmbStateFile::Durability::Group ? "group"
+           : ro.durability == RpmbStateFile::Durability::Volatile ? "volatile" : "strict") << "\",\n"
+       << "    \"crypto\": \"" << RpmbMacKey::Backend().name << "\",\n"
+       << "    \"mac_cache\": " << (ro.macCache ? "true" : "false") << "\n"
+       << "  },\n"
+       << "  \"results\": [\n";
+
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        const Result& r = results[i];
+        uint64_t sum = 0;
+        for (uint64_t v : r.lat) sum += v;
+        const double ops = r.totalNs ? double(r.lat.size()) * 1e9 / double(r.totalNs) : 0.0;
+
+        char buf[512];
+        std::snprintf(buf, sizeof(buf),
+            "    {\"name\": \"%s\", \"blocks\": %u, \"max_blocks\": %u, \"iterations\": %zu, "
+            "\"errors\": %llu, \"ops_per_sec\": %.1f, \"mean_ns\": %llu, \"p50_ns\": %llu, "
+            "\"p90_ns\": %llu, \"p99_ns\": %llu, \"p999_ns\": %llu, \"max_ns\": %llu}%s\n",
+            r.name.c_str(), r.blocks, r.maxBlocks, r.lat.size(),
+            (unsigned long long)r.errors, ops,
+            (unsigned long long)(r.lat.empty() ? 0 : sum / r.lat.size()),
+            (unsigned long long)pct(r.lat, 0.50), (unsigned long long)pct(r.lat, 0.90),
+            (unsigned long long)pct(r.lat, 0.99), (unsigned long long)pct(r.lat, 0.999),
+            (unsigned long long)pct(r.lat, 1.0),
+            i + 1 < results.size() ? "," : "");
+        os << buf;
+    }
+    os << "  ]\n}\n";
+}
+
+// ------------------------------------------------------------
+// Core request chains (same shapes as mmc-utils)
+// ------------------------------------------------------------
+class CoreBench {
+public:
+    CoreBench(const Rpmbd::Options& ro) : core_(ro), maxBlocks_(ro.maxBlocks)
+    {
+        for (int i = 0; i < 32; ++i) key_[i] = uint8_t(0xA5 ^ (i * 29));
+        mac_.SetKey(key_);
+        data_.resize(size_t(maxBlocks_) * 256);
+        for (size_t i = 0; i < data_.size(); ++i) data_[i] = uint8_t(i * 131 + 7);
+    }
+
+    // PROGRAM_KEY + RESULT_READ
+    bool ProgramKey()
+    {
+        uint8_t req[2 * RPMB_FRAME_SIZE], resp[RPMB_FRAME_SIZE];
+        RpmbReqProgramKey(req, key_);
+        RpmbReqResultRead(req + RPMB_FRAME_SIZE);
+        const Rpmbd::MmcCmd chain[] = {
+            { 23, 1, 0 }, { 25, 1, RPMB_FRAME_SIZE },
+            { 23, 1, 0 }, { 25, 1, RPMB_FRAME_SIZE },
+            { 23, 1, 0 }, { 18, 1, RPMB_FRAME_SIZE },
+        };
+        Run(chain, 6, req, resp);
+        if (!RpmbRespCheck(resp, 1, RPMB_RESP_PROGRAM_KEY)) return false;
+        writeCounter_ = RpmbRespWriteCounter(resp);
+        return true;
+    }
+
+    bool GetCounter(uint32_t i)
+    {
+        uint8_t req[RPMB_FRAME_SIZE], resp[RPMB_FRAME_SIZE];
+        uint8_t nonce[16];
+        Nonce(i, nonce);
+        RpmbReqGetCounter(req, nonce);
+        const Rpmbd::MmcCmd chain[] = {
+            { 23, 1, 0 }, { 25, 1, RPMB_FRAME_SIZE },
+            { 23, 1, 0 }, { 18, 1, RPMB_FRAME_SIZE },
+        };
+        Run(chain, 4, req, resp);
+        return RpmbRespCheck(resp, 1, RPMB_RESP_GET_COUNTER, &mac_, nonce);
+    }
+
+    // DATA_WRITE of n frames + RESULT_READ
+    bool DataWrite(uint32_t i, uint16_t n)
+    {
+        const uint16_t addr = Addr(i, n);
+        buf_.resize(size_t(n + 1) * RPMB_FRAME_SIZE);
+        RpmbReqDataWrite(buf_.data(), addr, n, writeCounter_, data_.data() + size_t(addr) * 256, mac_);
+        RpmbReqResultRead(buf_.data() + size_t(n) * RPMB_FRAME_SIZE);
+
+        uint8_t resp[RPMB_FRAME_SIZE];
+        const Rpmbd::MmcCmd chain[] = {
+            { 23, n, 0 }, { 25, n, uint32_t(n * RPMB_FRAME_SIZE) },
+            { 23, 1, 0 }, { 25, 1, RPMB_FRAME_SIZE },
+            { 23, 1, 0 }, { 18, 1, RPMB_FRAME_SIZE },
+        };
+        Run(chain, 6, buf_.data(), resp);
+        if (!RpmbRespCheck(resp, 1, RPMB_RESP_DATA_WRITE)) return false;
+        writeCounter_ = RpmbRespWriteCounter(resp);
+        return true;
+    }
+
+    bool DataRead(uint32_t i, uint16_t n)
+    {
+        const uint16_t addr = Addr(i, n);
+        uint8_t req[RPMB_FRAME_SIZE];
+        uint8_t nonce[16];
+        Nonce(i, nonce);
+        RpmbReqDataRead(req, addr, n, nonce);
+
+        buf_.resize(size_t(n) * RPMB_FRAME_SIZE);
+        const Rpmbd::MmcCmd chain[] = {
+            { 23, 1, 0 }, { 25, 1, RPMB_FRAME_SIZE },
+            { 23, n, 0 }, { 18, n, uint32_t(n * RPMB_FRAME_SIZE) },
+        };
+        Run(chain, 4, req, buf_.data());
+        return RpmbRespCheck(buf_.data(), n, RPMB_RESP_DATA_READ, &mac_, nonce);
+    }
+
+private:
+    Rpmbd core_;
+    Rpmbd::Session sess_;
+    uint32_t maxBlocks_;
+    uint8_t key_[32];
+    RpmbMacKey mac_;
+    uint32_t writeCounter_ = 0;
+    std::vector<uint8_t> data_;
+    std::vector<uint8_t> buf_;
+
+    void Run(const Rpmbd::MmcCmd* chain, size_t count, const uint8_t* in, uint8_t* out)
+    {
+        std::lock_guard<std::mutex> lk(sess_.mu);
+        core_.ExecuteChain(sess_, chain, count, in, out);
+    }
+
+    // Walks the device in steps of n blocks
+    uint16_t Addr(uint32_t i, uint16_t n) const
+    {
+        const uint32_t slots = maxBlocks_ / n;
+        return uint16_t((i % slots) * n);
+    }
+
+    static void Nonce(uint32_t i, uint8_t nonce[16])
+    {
+        for (int k = 0; k < 16; ++k) nonce[k] = uint8_t((i >> ((k & 3) * 8)) + k);
+    }
+};
+
+// ------------------------------------------------------------
+// State file (SaveState/LoadState storage path)
+// ------------------------------------------------------------
+static RpmbStateFile::Options stateOptions(const Rpmbd::Options& ro, const std::string& path,
+                                           uint32_t maxBlocks)
+{
+    RpmbStateFile::Options so;
+    so.path = path;
+    so.maxBlocks = maxBlocks;
+    so.mode = ro.storage;
+    so.durability = ro.durability;
+    so.flushIntervalMs = ro.flushIntervalMs;
+    return so;
+}
+
+static void benchStateFile(const Rpmbd::Options& ro, const std::string& dir, uint32_t maxBlocks,
+                           uint32_t iterations, std::vector<Result>& results)
+{
+    const std::string path = dir + "/state_" + std::to_string(maxBlocks) + ".bin";
+    RpmbStateFile::Header hdr;
+
+    // Commit of one block + counter, as done for a 1-block DATA_WRITE
+    {
+        RpmbStateFile sf(stateOptions(ro, path, maxBlocks));
+        sf.Open(hdr);
+        hdr.keyProgrammed = true;
+
+        uint8_t data[256];
+        std::memset(data, 0x5A, sizeof(data));
+        Result r = measure("state_save", 1, iterations, [&](uint32_t i) {
+            RpmbStateFile::Block b;
+            b.addr = uint16_t(i % maxBlocks);
+            b.data = data;
+            hdr.writeCounter++;
+            return sf.Commit(hdr, &b, 1);
+        });
+        r.maxBlocks = maxBlocks;
+        results.push_back(std::move(r));
+        sf.Close();
+    }
+
+    // Startup: open + load of an existing file
+    {
+        const uint32_t n = std::max<uint32_t>(1, std::min<uint32_t>(iterations, 200));
+        Result r = measure("state_load", maxBlocks, n, [&](uint32_t) {
+            RpmbStateFile sf(stateOptions(ro, path, maxBlocks));
+            RpmbStateFile::Header h;
+            const bool ok = sf.Open(h);
+            sf.Close();
+            return ok && (ro.durability == RpmbStateFile::Durability::Volatile ||
+                          h.writeCounter == hdr.writeCounter);
+        });
+        r.maxBlocks = maxBlocks;
+        results.push_back(std::move(r));
+    }
+
+    std::error_code ec;
+    std::filesystem::remove(path, ec);
+    std::filesystem::remove(path + ".journal", ec);
+}
+
+// ------------------------------------------------------------
+int main(int argc, char** argv)
+{
+    uint32_t iterations = 2000;
+    uint32_t multiBlocks = 8;
+    std::vector<uint32_t> stateSizes = { 128, 1024, 8192, 65536 };
+    std::string baseDir = "/tmp";
+    std::string outPath;
+    Rpmbd::Options ro;
+    ro.allowRekey = true;   // PROGRAM_KEY is measured repeatedly
+
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string a = argv[i];
+
+        if ((a == "--iterations" || a == "-n") && i + 1 < argc)
+        {
+            if (!parseUint(argv[++i], iterations) || iterations == 0)
+            {
+                std::cerr << "ERROR: Invalid --iterations: " << argv[i] << "\n";
+                return 2;
+            }
+        }
+        else if (a == "--blocks" && i + 1 < argc)
+        {
+            if (!parseUint(argv[++i], multiBlocks) || multiBlocks < 2 || multiBlocks > ro.maxBlocks)
+            {
+                std::cerr << "ERROR: Invalid --blocks (2.." << ro.maxBlocks << "): " << argv[i] << "\n";
+                return 2;
+            }
+        }
+        else if (a == "--max-blocks" && i + 1 < argc)
+        {
+            stateSizes.clear();
+            std::stringstream ss(argv[++i]);
+            std::string item;
+            while (std::getline(ss, item, ','))
+            {
+                uint32_t v = 0;
+                if (!parseUint(item.c_str(), v) || v == 0 || v > 65536)
+                {
+                    std::cerr << "ERROR: Invalid --max-blocks entry: " << item << "\n";
+                    return 2;
+                }
+                stateSizes.push_back(v);
+            }
+        }
+        else if (a == "--dir" && i + 1 < argc)
+        {
+            baseDir = argv[++i];
+        }
+        else if (a == "--storage" && i + 1 < argc)
+        {
+            std::string m = argv[++i];
+            if (m == "buffered")
+                ro.storage = RpmbStateFile::Mode::Buffered;
+            else if (m == "mmap")
+                ro.storage = RpmbStateFile::Mode::Mmap;
+            else
+            {
+                std::cerr << "ERROR: Unknown storage mode: " << m << "\n";
+                return 2;
+            }
+        }
+        else if (a == "--durability" && i + 1 < argc)
+        {
+            std::string m = argv[++i];
+            if (m == "strict")
+                ro.durability = RpmbStateFile::Durability::Strict;
+            else if (m == "group")
+                ro.durability = RpmbStateFile::Durability::Group;
+            else if (m == "volatile")
+                ro.durability = RpmbStateFile::Durability::Volatile;
+            else
+            {
+                std::cerr << "ERROR: Unknown durability mode: " << m << "\n";
+                return 2;
+            }
+        }
+        else if (a == "--mac-cache")
+        {
+            ro.macCache = true;
+        }
+        else if (a == "--crypto" && i + 1 < argc)
+        {
+            ro.crypto = argv[++i];
+            if (!RpmbShaFind(ro.crypto))
+            {
+                std::cerr << "ERROR: Crypto backend not available on this CPU: " << ro.crypto << "\n";
+                return 2;
+            }
+        }
+        else if ((a == "--output" || a == "-o") && i + 1 < argc)
+        {
+            outPath = argv[++i];
+        }
+        else if (a == "--help" || a == "-h")
+        {
+            usage(argv[0]);
+            return 0;
+        }
+        else
+        {
+            std::cerr << "ERROR: Unknown argument: " << a << "\n";
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    std::string tmpl = baseDir + "/rpmbd_bench.XXXXXX";
+    if (!mkdtemp(&tmpl[0]))
+    {
+        std::cerr << "ERROR: Cannot create work directory in " << baseDir << ": "
+                  << std::strerror(errno) << "\n";
+        return 2;
+    }
+    const std::string workDir = tmpl;
+    ro.stateFile = workDir + "/rpmb_state.bin";
+
+    RpmbLog::Start();
+
+    std::vector<Result> results;
+    {
+        CoreBench b(ro);
+        const uint16_t n = uint16_t(multiBlocks);
+
+        results.push_back(measure("program_key", 1, iterations, [&](uint32_t) { return b.ProgramKey(); }));
+        results.push_back(measure("get_counter", 1, iterations, [&](uint32_t i) { return b.GetCounter(i); }));
+        results.push_back(measure("data_write", 1, iterations, [&](uint32_t i) { return b.DataWrite(i, 1); }));
+        results.push_back(measure("data_write", n, iterations, [&](uint32_t i) { return b.DataWrite(i, n); }));
+        results.push_back(measure("data_read", 1, iterations, [&](uint32_t i) { return b.DataRead(i, 1); }));
+        results.push_back(measure("data_read", n, iterations, [&](uint32_t i) { return b.DataRead(i, n); }));
+        for (Result& r : results) r.maxBlocks = ro.maxBlocks;
+    }
+
+    for (uint32_t mb : stateSizes)
+        benchStateFile(ro, workDir, mb, iterations, results);
+
+    RpmbLog::Stop();
+
+    std::error_code ec;
+    std::filesystem::remove_all(workDir, ec);
+
+    if (outPath.empty())
+    {
+        writeJson(std::cout, ro, iterations, results);
+    }
+    else
+    {
+        std::ofstream f(outPath);
+        writeJson(f, ro, iterations, results);
+        if (!f)
+        {
+            std::cerr << "ERROR: Cannot write " << outPath << "\n";
+            return 1;
+        }
+    }
+
+    uint64_t errors = 0;
+    for (const Result& r : results) errors += r.errors;
+    return errors ? 1 : 0;
+}
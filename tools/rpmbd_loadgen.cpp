@@ -0,0 +1,803 @@
+// End-to-end load generator for the CUSE device: N threads or processes
+// issue real MMC_IOC_MULTI_CMD chains (CMD23/CMD25/CMD18/CMD12, the shapes
+// mmc-utils uses) against /dev/<dev> and verify every response. With
+// --batch, several such transactions are sent back to back in one ioctl.
+// With --shm, the same chains go through the shared-memory frontend.
+
+#include "RpmbRequest.h"
+#include "RpmbShmClient.h"
+#include "RpmbTrace.h"     // RpmbMonotonicNs()
+
+#include <sys/ioctl.h>
+#include <linux/mmc/ioctl.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <random>
+#include <algorithm>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+
+// Response/command flags as used by mmc-utils (not exported by the kernel UAPI)
+#define MMC_RSP_PRESENT (1 << 0)
+#define MMC_RSP_CRC     (1 << 2)
+#define MMC_RSP_OPCODE  (1 << 4)
+#define MMC_CMD_AC      (0 << 5)
+#define MMC_CMD_ADTC    (1 << 5)
+#define MMC_RSP_R1      (MMC_RSP_PRESENT | MMC_RSP_CRC | MMC_RSP_OPCODE)
+
+// Longest transaction (write + result read) is 6 commands; a chain holds
+// at most 255 (MMC_IOC_MAX_CMDS)
+static const uint32_t MAX_BATCH = 255 / 6;
+
+static void usage(const char* prog)
+{
+    std::cerr
+        << "Usage: " << prog << " --key <file> [options]\n"
+        << "\nRequired:\n"
+        << "  -k, --key <file>          32-byte RPMB key (as used with mmc rpmb write-key)\n"
+        << "\nOptions:\n"
+        << "  -d, --dev <name>          Device name under /dev (default: mmcblk2rpmb)\n"
+        << "      --shm <path>          Use the rpmbd --shm socket instead of /dev/<name>\n"
+        << "                            (--dev then selects the device, if several)\n"
+        << "  -t, --threads <n>         Worker threads (default: 4)\n"
+        << "  -p, --procs <n>           Worker processes, each running --threads workers (default: 1)\n"
+        << "      --duration <sec>      Run time (default: 10)\n"
+        << "      --requests <n>        Requests per worker instead of a fixed duration\n"
+        << "      --mix <c,w,r>         Weights of counter reads, writes, reads (default: 50,20,30)\n"
+        << "      --write-blocks <n>    Blocks per DATA_WRITE (default: 1)\n"
+        << "      --read-blocks <n>     Blocks per DATA_READ (default: 8)\n"
+        << "      --blocks <n>          Device size in blocks, addresses stay below (default: 128)\n"
+        << "      --batch <n>           Transactions per ioctl, 1.." << MAX_BATCH << " (default: 1)\n"
+        << "      --program-key         Program the key first (fresh device)\n"
+        << "      --json                Print the report as JSON\n"
+        << "  -h, --help                Show this help\n";
+}
+
+static bool parseUint(const char* s, uint32_t& out)
+{
+    char* end = nullptr;
+    errno = 0;
+    unsigned long v = std::strtoul(s, &end, 10);
+    if (errno != 0 || end == s || *end != '\0' || v > UINT32_MAX)
+        return false;
+    out = static_cast<uint32_t>(v);
+    return true;
+}
+
+// ------------------------------------------------------------
+// Configuration / statistics
+// ------------------------------------------------------------
+enum Op { OP_COUNTER = 0, OP_WRITE = 1, OP_READ = 2, OP_COUNT = 3 };
+static const char* const OP_NAMES[OP_COUNT] = { "get_counter", "data_write", "data_read" };
+
+struct Config {
+    std::string dev = "/dev/mmcblk2rpmb";
+    std::string devName;            // --dev as given (for --shm)
+    std::string shm;                // rpmbd --shm socket; empty: use dev
+    uint8_t key[32]{};
+    uint32_t threads = 4;
+    uint32_t procs = 1;
+    uint32_t durationSec = 10;
+    uint32_t requests = 0;          // per worker; 0 = use durationSec
+    uint32_t mix[OP_COUNT] = { 50, 20, 30 };
+    uint32_t writeBlocks = 1;
+    uint32_t readBlocks = 8;
+    uint32_t blocks = 128;
+    uint32_t batch = 1;             // transactions per ioctl
+    bool programKey = false;
+    bool json = false;
+};
+
+// Per-worker results; merged at the end
+struct Stats {
+    uint64_t ok[OP_COUNT]{};
+    uint64_t ioctlErrors[OP_COUNT]{};   // ioctl() failed
+    uint64_t resultErrors[OP_COUNT]{};  // result code != OK
+    uint64_t authErrors[OP_COUNT]{};    // MAC / nonce mismatch
+    uint64_t counterRetries = 0;        // lost a write counter race
+    uint64_t ioctls = 0;                // MULTI_CMD ioctls issued by Run()
+    std::vector<uint64_t> lat[OP_COUNT];
+
+    void Merge(const Stats& o)
+    {
+        for (int i = 0; i < OP_COUNT; ++i)
+        {
+            ok[i] += o.ok[i];
+            ioctlErrors[i] += o.ioctlErrors[i];
+            resultErrors[i] += o.resultErrors[i];
+            authErrors[i] += o.authErrors[i];
+            lat[i].insert(lat[i].end(), o.lat[i].begin(), o.lat[i].end());
+        }
+        counterRetries += o.counterRetries;
+        ioctls += o.ioctls;
+    }
+
+    uint64_t Errors(int i) const { return ioctlErrors[i] + resultErrors[i] + authErrors[i]; }
+};
+
+// ------------------------------------------------------------
+// MULTI_CMD chains
+// ------------------------------------------------------------
+class Chain {
+public:
+    void Reset() { n_ = 0; }
+
+    // CMD23 SET_BLOCK_COUNT
+    void SetBlockCount(uint32_t blocks, bool reliableWrite = false)
+    {
+        mmc_ioc_cmd& c = Next();
+        c.opcode = 23;
+        c.arg = blocks | (reliableWrite ? (1u << 31) : 0);
+        c.flags = MMC_RSP_R1 | MMC_CMD_AC;
+    }
+
+    // CMD25 WRITE_MULTIPLE_BLOCK
+    void Write(const uint8_t* frames, uint32_t blocks)
+    {
+        mmc_ioc_cmd& c = Next();
+        c.opcode = 25;
+        c.write_flag = 1;
+        c.blksz = RPMB_FRAME_SIZE;
+        c.blocks = blocks;
+        c.flags = MMC_RSP_R1 | MMC_CMD_ADTC;
+        mmc_ioc_cmd_set_data(c, frames);
+    }
+
+    // CMD18 READ_MULTIPLE_BLOCK
+    void Read(uint8_t* frames, uint32_t blocks)
+    {
+        mmc_ioc_cmd& c = Next();
+        c.opcode = 18;
+        c.blksz = RPMB_FRAME_SIZE;
+        c.blocks = blocks;
+        c.flags = MMC_RSP_R1 | MMC_CMD_ADTC;
+        mmc_ioc_cmd_set_data(c, frames);
+    }
+
+    int Issue(int fd)
+    {
+        Header()->num_of_cmds = n_;
+        return ioctl(fd, MMC_IOC_MULTI_CMD, Header());
+    }
+
+    // Same through the shared-memory frontend: -1 with errno on failure
+    int Issue(RpmbShmClient& client)
+    {
+        const int rc = client.MultiCmd(Header()->cmds, n_);
+        if (rc == 0) return 0;
+        errno = -rc;
+        return -1;
+    }
+
+private:
+    static const size_t MAX_CMDS = 255;
+    alignas(mmc_ioc_multi_cmd) uint8_t buf_[sizeof(mmc_ioc_multi_cmd) + MAX_CMDS * sizeof(mmc_ioc_cmd)];
+    size_t n_ = 0;
+
+    mmc_ioc_multi_cmd* Header() { return reinterpret_cast<mmc_ioc_multi_cmd*>(buf_); }
+
+    mmc_ioc_cmd& Next()
+    {
+        mmc_ioc_cmd& c = Header()->cmds[n_++];
+        std::memset(&c, 0, sizeof(c));
+        return c;
+    }
+};
+
+class Worker {
+public:
+    Worker(const Config& cfg, uint64_t seed) : cfg_(cfg), rng_(seed)
+    {
+        mac_.SetKey(cfg_.key);
+        req_.resize(size_t(cfg_.batch) * (cfg_.writeBlocks + 1) * RPMB_FRAME_SIZE);
+        resp_.resize(size_t(cfg_.batch) * std::max<uint32_t>(cfg_.readBlocks, 1) * RPMB_FRAME_SIZE);
+        data_.resize(size_t(cfg_.writeBlocks) * 256);
+    }
+
+    bool Open()
+    {
+        if (!cfg_.shm.empty())
+        {
+            const int rc = shm_.Connect(cfg_.shm, cfg_.devName);
+            if (rc < 0)
+                std::cerr << "ERROR: cannot connect to " << cfg_.shm << ": " << std::strerror(-rc) << "\n";
+            return rc == 0;
+        }
+
+        fd_ = open(cfg_.dev.c_str(), O_RDWR);
+        if (fd_ < 0)
+            std::cerr << "ERROR: cannot open " << cfg_.dev << ": " << std::strerror(errno) << "\n";
+        return fd_ >= 0;
+    }
+
+    ~Worker() { if (fd_ >= 0) close(fd_); }
+
+    bool ProgramKey()
+    {
+        RpmbReqProgramKey(req_.data(), cfg_.key);
+        RpmbReqResultRead(req_.data() + RPMB_FRAME_SIZE);
+        chain_.Reset();
+        chain_.SetBlockCount(1, true);
+        chain_.Write(req_.data(), 1);
+        chain_.SetBlockCount(1);
+        chain_.Write(req_.data() + RPMB_FRAME_SIZE, 1);
+        chain_.SetBlockCount(1);
+        chain_.Read(resp_.data(), 1);
+        if (Issue() < 0) return false;
+        return RpmbRespCheck(resp_.data(), 1, RPMB_RESP_PROGRAM_KEY);
+    }
+
+    // Issues --batch transactions per ioctl until the deadline or request
+    // count is reached. Latency of a transaction is the round trip of the
+    // ioctl that completed it (plus earlier ones if it had to be retried).
+    void Run(Stats& st)
+    {
+        const uint32_t total = cfg_.mix[0] + cfg_.mix[1] + cfg_.mix[2];
+        const uint64_t deadline = RpmbMonotonicNs() + uint64_t(cfg_.durationSec) * 1000000000ull;
+        std::vector<Txn> batch, retry;
+        uint32_t started = 0;
+
+        for (;;)
+        {
+            // Writes that lost a counter race go first, then new transactions
+            batch.swap(retry);
+            retry.clear();
+            while (batch.size() < cfg_.batch &&
+                   (cfg_.requests ? started < cfg_.requests : RpmbMonotonicNs() < deadline))
+            {
+                uint32_t pick = uint32_t(rng_() % total);
+                Txn t;
+                t.op = pick < cfg_.mix[0] ? OP_COUNTER : pick < cfg_.mix[0] + cfg_.mix[1] ? OP_WRITE : OP_READ;
+                t.t0 = RpmbMonotonicNs();
+                batch.push_back(t);
+                ++started;
+            }
+            if (batch.empty()) break;
+
+            RunBatch(batch, retry, st);
+        }
+    }
+
+private:
+    enum { ERR_IOCTL = 1, ERR_RESULT = 2, ERR_AUTH = 3 };
+
+    // One transaction of a batch; its request and response frames start at
+    // req / resp in req_ / resp_
+    struct Txn {
+        Op op = OP_COUNTER;
+        uint64_t t0 = 0;
+        int attempts = 0;           // counter races lost so far (writes)
+        uint8_t nonce[16];
+        size_t req = 0, resp = 0;
+    };
+
+    static const int MAX_ATTEMPTS = 16;
+
+    int Issue() { return shm_.IsOpen() ? chain_.Issue(shm_) : chain_.Issue(fd_); }
+
+    const Config& cfg_;
+    std::mt19937_64 rng_;
+    RpmbMacKey mac_;
+    int fd_ = -1;
+    RpmbShmClient shm_;             // --shm instead of fd_
+    Chain chain_;
+    std::vector<uint8_t> req_, resp_, data_;
+    uint32_t writeCounter_ = 0;
+    bool haveCounter_ = false;
+
+    void Nonce(uint8_t nonce[16])
+    {
+        uint64_t a = rng_(), b = rng_();
+        std::memcpy(nonce, &a, 8);
+        std::memcpy(nonce + 8, &b, 8);
+    }
+
+    int Check(const uint8_t* resp, uint16_t type, size_t blocks, const RpmbMacKey* mac, const uint8_t* nonce)
+    {
+        const uint8_t* last = resp + (blocks - 1) * RPMB_FRAME_SIZE;
+        if (RpmbRespType(last) != type || RpmbRespResult(last) != RPMB_RES_OK)
+            return ERR_RESULT;
+        return RpmbRespCheck(resp, blocks, type, mac, nonce) ? 0 : ERR_AUTH;
+    }
+
+    static void Count(Stats& st, Op op, int rc, uint64_t ns)
+    {
+        if (rc == 0)
+        {
+            st.ok[op]++;
+            st.lat[op].push_back(ns);
+        }
+        else if (rc == ERR_IOCTL) st.ioctlErrors[op]++;
+        else if (rc == ERR_RESULT) st.resultErrors[op]++;
+        else st.authErrors[op]++;
+    }
+
+    // Counter read of its own (writes need a counter before they are built)
+    int GetCounter()
+    {
+        uint8_t nonce[16];
+        Nonce(nonce);
+        RpmbReqGetCounter(req_.data(), nonce);
+        chain_.Reset();
+        chain_.SetBlockCount(1);
+        chain_.Write(req_.data(), 1);
+        chain_.SetBlockCount(1);
+        chain_.Read(resp_.data(), 1);
+        if (Issue() < 0) return ERR_IOCTL;
+
+        int rc = Check(resp_.data(), RPMB_RESP_GET_COUNTER, 1, &mac_, nonce);
+        if (rc == 0)
+        {
+            writeCounter_ = RpmbRespWriteCounter(resp_.data());
+            haveCounter_ = true;
+        }
+        return rc;
+    }
+
+    // Appends t to the chain: the same commands mmc-utils sends for it alone
+    void Append(Txn& t, size_t& reqFrames, size_t& respFrames, uint32_t& writes)
+    {
+        uint8_t* req = req_.data() + reqFrames * RPMB_FRAME_SIZE;
+        uint8_t* resp = resp_.data() + respFrames * RPMB_FRAME_SIZE;
+        t.req = reqFrames;
+        t.resp = respFrames;
+
+        if (t.op == OP_COUNTER)
+        {
+            Nonce(t.nonce);
+            RpmbReqGetCounter(req, t.nonce);
+            chain_.SetBlockCount(1);
+            chain_.Write(req, 1);
+            chain_.SetBlockCount(1);
+            chain_.Read(resp, 1);
+            reqFrames += 1;
+            respFrames += 1;
+        }
+        else if (t.op == OP_WRITE)
+        {
+            // Writes of one batch use consecutive counter values
+            const uint32_t n = cfg_.writeBlocks;
+            const uint16_t addr = uint16_t(rng_() % (cfg_.blocks - n + 1));
+            for (size_t i = 0; i < data_.size(); ++i) data_[i] = uint8_t(rng_());
+
+            RpmbReqDataWrite(req, addr, uint16_t(n), writeCounter_ + writes++, data_.data(), mac_);
+            RpmbReqResultRead(req + size_t(n) * RPMB_FRAME_SIZE);
+            chain_.SetBlockCount(n, true);
+            chain_.Write(req, n);
+            chain_.SetBlockCount(1);
+            chain_.Write(req + size_t(n) * RPMB_FRAME_SIZE, 1);
+            chain_.SetBlockCount(1);
+            chain_.Read(resp, 1);
+            reqFrames += n + 1;
+            respFrames += 1;
+        }
+        else
+        {
+            const uint32_t n = cfg_.readBlocks;
+            const uint16_t addr = uint16_t(rng_() % (cfg_.blocks - n + 1));
+            Nonce(t.nonce);
+            RpmbReqDataRead(req, addr, uint16_t(n), t.nonce);
+            chain_.SetBlockCount(1);
+            chain_.Write(req, 1);
+            chain_.SetBlockCount(n);
+            chain_.Read(resp, n);
+            reqFrames += 1;
+            respFrames += n;
+        }
+    }
+
+    // Other workers write too: a write that lost a counter race takes the
+    // counter from its response and goes to retry (counted, not an error)
+    void RunBatch(std::vector<Txn>& batch, std::vector<Txn>& retry, Stats& st)
+    {
+        bool anyWrite = false;
+        for (const Txn& t : batch) anyWrite |= t.op == OP_WRITE;
+
+        if (anyWrite && !haveCounter_)
+        {
+            const int rc = GetCounter();
+            if (rc)
+            {
+                std::vector<Txn> rest;
+                for (const Txn& t : batch)
+                {
+                    if (t.op == OP_WRITE) Count(st, t.op, rc, 0);
+                    else rest.push_back(t);
+                }
+                batch.swap(rest);
+                if (batch.empty()) return;
+            }
+        }
+
+        size_t reqFrames = 0, respFrames = 0;
+        uint32_t writes = 0;
+        chain_.Reset();
+        for (Txn& t : batch) Append(t, reqFrames, respFrames, writes);
+
+        const int ioctlRc = Issue();
+        const uint64_t t1 = RpmbMonotonicNs();
+        st.ioctls++;
+
+        for (Txn& t : batch)
+        {
+            const uint8_t* resp = resp_.data() + t.resp * RPMB_FRAME_SIZE;
+            int rc = ERR_IOCTL;
+
+            if (ioctlRc < 0)
+            {
+                if (t.op == OP_WRITE) haveCounter_ = false;
+            }
+            else if (t.op == OP_COUNTER)
+            {
+                rc = Check(resp, RPMB_RESP_GET_COUNTER, 1, &mac_, t.nonce);
+                if (rc == 0)
+                {
+                    writeCounter_ = RpmbRespWriteCounter(resp);
+                    haveCounter_ = true;
+                }
+            }
+            else if (t.op == OP_WRITE)
+            {
+                if (RpmbRespResult(resp) == RPMB_RES_COUNTER_FAIL)
+                {
+                    st.counterRetries++;
+                    writeCounter_ = RpmbRespWriteCounter(resp);
+                    if (++t.attempts < MAX_ATTEMPTS)
+                    {
+                        retry.push_back(t);
+                        continue;
+                    }
+                    rc = ERR_RESULT;
+                }
+                else
+                {
+                    rc = Check(resp, RPMB_RESP_DATA_WRITE, 1, nullptr, nullptr);
+                    if (rc == 0) writeCounter_ = RpmbRespWriteCounter(resp);
+                    else haveCounter_ = false;
+                }
+            }
+            else
+            {
+                rc = Check(resp, RPMB_RESP_DATA_READ, cfg_.readBlocks, &mac_, t.nonce);
+            }
+
+            Count(st, t.op, rc, t1 - t.t0);
+        }
+    }
+};
+
+// ------------------------------------------------------------
+// Processes: each child sends its Stats back through a pipe
+// ------------------------------------------------------------
+static bool writeAll(int fd, const void* p, size_t len)
+{
+    const uint8_t* b = static_cast<const uint8_t*>(p);
+    while (len)
+    {
+        ssize_t n = write(fd, b, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        b += n;
+        len -= size_t(n);
+    }
+    return true;
+}
+
+static bool readAll(int fd, void* p, size_t len)
+{
+    uint8_t* b = static_cast<uint8_t*>(p);
+    while (len)
+    {
+        ssize_t n = read(fd, b, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        b += n;
+        len -= size_t(n);
+    }
+    return true;
+}
+
+static bool sendStats(int fd, const Stats& st)
+{
+    for (int i = 0; i < OP_COUNT; ++i)
+    {
+        const uint64_t counts[4] = { st.ok[i], st.ioctlErrors[i], st.resultErrors[i], st.authErrors[i] };
+        const uint64_t n = st.lat[i].size();
+        if (!writeAll(fd, counts, sizeof(counts)) || !writeAll(fd, &n, sizeof(n)) ||
+            !writeAll(fd, st.lat[i].data(), n * sizeof(uint64_t)))
+            return false;
+    }
+    return writeAll(fd, &st.counterRetries, sizeof(st.counterRetries)) &&
+           writeAll(fd, &st.ioctls, sizeof(st.ioctls));
+}
+
+static bool recvStats(int fd, Stats& st)
+{
+    for (int i = 0; i < OP_COUNT; ++i)
+    {
+        uint64_t counts[4], n = 0;
+        if (!readAll(fd, counts, sizeof(counts)) || !readAll(fd, &n, sizeof(n)))
+            return false;
+        st.ok[i] = counts[0];
+        st.ioctlErrors[i] = counts[1];
+        st.resultErrors[i] = counts[2];
+        st.authErrors[i] = counts[3];
+        st.lat[i].resize(n);
+        if (!readAll(fd, st.lat[i].data(), n * sizeof(uint64_t)))
+            return false;
+    }
+    return readAll(fd, &st.counterRetries, sizeof(st.counterRetries)) &&
+           readAll(fd, &st.ioctls, sizeof(st.ioctls));
+}
+
+// Runs cfg.threads workers in this process
+static bool runThreads(const Config& cfg, uint64_t seedBase, Stats& out)
+{
+    std::vector<Stats> stats(cfg.threads);
+    std::vector<Worker*> workers;
+    bool ok = true;
+    for (uint32_t i = 0; i < cfg.threads; ++i)
+    {
+        workers.push_back(new Worker(cfg, seedBase + i));
+        ok = workers.back()->Open() && ok;
+    }
+
+    if (ok)
+    {
+        std::vector<std::thread> th;
+        for (uint32_t i = 0; i < cfg.threads; ++i)
+            th.emplace_back([&, i] { workers[i]->Run(stats[i]); });
+        for (auto& t : th) t.join();
+    }
+
+    for (uint32_t i = 0; i < cfg.threads; ++i)
+    {
+        out.Merge(stats[i]);
+        delete workers[i];
+    }
+    return ok;
+}
+
+// ------------------------------------------------------------
+// Report
+// ------------------------------------------------------------
+static uint64_t pct(const std::vector<uint64_t>& sorted, double p)
+{
+    if (sorted.empty()) return 0;
+    return sorted[size_t(p * double(sorted.size() - 1) + 0.5)];
+}
+
+static void report(const Config& cfg, Stats& st, double secs)
+{
+    uint64_t totalOk = 0, totalErr = 0;
+    for (int i = 0; i < OP_COUNT; ++i)
+    {
+        std::sort(st.lat[i].begin(), st.lat[i].end());
+        totalOk += st.ok[i];
+        totalErr += st.Errors(i);
+    }
+    const double rate = secs > 0 ? double(totalOk) / secs : 0.0;
+    const double ioctlRate = secs > 0 ? double(st.ioctls) / secs : 0.0;
+    char line[512];
+
+    if (cfg.json)
+    {
+        std::printf("{\n  \"workers\": %u, \"batch\": %u, \"seconds\": %.3f, \"ok\": %llu, "
+                    "\"errors\": %llu, \"ops_per_sec\": %.1f, \"ioctls_per_sec\": %.1f, "
+                    "\"counter_retries\": %llu,\n  \"ops\": [\n",
+                    cfg.threads * cfg.procs, cfg.batch, secs, (unsigned long long)totalOk,
+                    (unsigned long long)totalErr, rate, ioctlRate, (unsigned long long)st.counterRetries);
+        for (int i = 0; i < OP_COUNT; ++i)
+        {
+            std::printf("    {\"name\": \"%s\", \"ok\": %llu, \"ioctl_errors\": %llu, "
+                        "\"result_errors\": %llu, \"auth_errors\": %llu, \"ops_per_sec\": %.1f, "
+                        "\"p50_ns\": %llu, \"p99_ns\": %llu, \"p999_ns\": %llu, \"max_ns\": %llu}%s\n",
+                        OP_NAMES[i], (unsigned long long)st.ok[i],
+                        (unsigned long long)st.ioctlErrors[i], (unsigned long long)st.resultErrors[i],
+                        (unsigned long long)st.authErrors[i],
+                        secs > 0 ? double(st.ok[i]) / secs : 0.0,
+                        (unsigned long long)pct(st.lat[i], 0.50), (unsigned long long)pct(st.lat[i], 0.99),
+                        (unsigned long long)pct(st.lat[i], 0.999), (unsigned long long)pct(st.lat[i], 1.0),
+                        i + 1 < OP_COUNT ? "," : "");
+        }
+        std::printf("  ]\n}\n");
+        return;
+    }
+
+    std::snprintf(line, sizeof(line),
+                  "[rpmbd_loadgen] %u worker(s), %.3fs: %llu ok, %llu error(s), %.0f ops/s, "
+                  "%.0f ioctls/s (batch %u), %llu counter retries\n",
+                  cfg.threads * cfg.procs, secs, (unsigned long long)totalOk,
+                  (unsigned long long)totalErr, rate, ioctlRate, cfg.batch,
+                  (unsigned long long)st.counterRetries);
+    std::cout << line;
+    for (int i = 0; i < OP_COUNT; ++i)
+    {
+        std::snprintf(line, sizeof(line),
+                      "  %-12s ok=%-9llu err=%llu/%llu/%llu (ioctl/result/auth)  "
+                      "p50=%.1fus p99=%.1fus p999=%.1fus max=%.1fus\n",
+                      OP_NAMES[i], (unsigned long long)st.ok[i],
+                      (unsigned long long)st.ioctlErrors[i], (unsigned long long)st.resultErrors[i],
+                      (unsigned long long)st.authErrors[i],
+                      pct(st.lat[i], 0.50) / 1e3, pct(st.lat[i], 0.99) / 1e3,
+                      pct(st.lat[i], 0.999) / 1e3, pct(st.lat[i], 1.0) / 1e3);
+        std::cout << line;
+    }
+}
+
+// ------------------------------------------------------------
+int main(int argc, char** argv)
+{
+    Config cfg;
+    std::string keyFile;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string a = argv[i];
+        uint32_t* num = nullptr;
+
+        if ((a == "--key" || a == "-k") && i + 1 < argc)
+            keyFile = argv[++i];
+        else if ((a == "--dev" || a == "-d") && i + 1 < argc)
+        {
+            cfg.devName = argv[++i];
+            cfg.dev = "/dev/" + cfg.devName;
+        }
+        else if ((a == "--threads" || a == "-t") && i + 1 < argc)
+            num = &cfg.threads;
+        else if ((a == "--procs" || a == "-p") && i + 1 < argc)
+            num = &cfg.procs;
+        else if (a == "--duration" && i + 1 < argc)
+            num = &cfg.durationSec;
+        else if (a == "--requests" && i + 1 < argc)
+            num = &cfg.requests;
+        else if (a == "--write-blocks" && i + 1 < argc)
+            num = &cfg.writeBlocks;
+        else if (a == "--read-blocks" && i + 1 < argc)
+            num = &cfg.readBlocks;
+        else if (a == "--blocks" && i + 1 < argc)
+            num = &cfg.blocks;
+        else if (a == "--shm" && i + 1 < argc)
+            cfg.shm = argv[++i];
+        else if (a == "--batch" && i + 1 < argc)
+            num = &cfg.batch;
+        else if (a == "--mix" && i + 1 < argc)
+        {
+            if (std::sscanf(argv[++i], "%u,%u,%u", &cfg.mix[0], &cfg.mix[1], &cfg.mix[2]) != 3 ||
+                cfg.mix[0] + cfg.mix[1] + cfg.mix[2] == 0)
+            {
+                std::cerr << "ERROR: Invalid --mix (expected c,w,r): " << argv[i] << "\n";
+                return 2;
+            }
+        }
+        else if (a == "--program-key")
+            cfg.programKey = true;
+        else if (a == "--json")
+            cfg.json = true;
+        else if (a == "--help" || a == "-h")
+        {
+            usage(argv[0]);
+            return 0;
+        }
+        else
+        {
+            std::cerr << "ERROR: Unknown argument: " << a << "\n";
+            usage(argv[0]);
+            return 2;
+        }
+
+        if (num && (!parseUint(argv[++i], *num) || *num == 0))
+        {
+            std::cerr << "ERROR: Invalid " << a << ": " << argv[i] << "\n";
+            return 2;
+        }
+    }
+
+    if (keyFile.empty())
+    {
+        std::cerr << "ERROR: Missing required argument --key <file>\n";
+        usage(argv[0]);
+        return 2;
+    }
+
+    std::ifstream kf(keyFile, std::ios::binary);
+    if (!kf.read(reinterpret_cast<char*>(cfg.key), sizeof(cfg.key)))
+    {
+        std::cerr << "ERROR: Cannot read 32 key bytes from " << keyFile << "\n";
+        return 2;
+    }
+
+    if (cfg.writeBlocks > cfg.blocks || cfg.readBlocks > cfg.blocks ||
+        cfg.writeBlocks > 0xFFFF || cfg.readBlocks > 0xFFFF || cfg.blocks > 0x10000)
+    {
+        std::cerr << "ERROR: --write-blocks/--read-blocks must not exceed --blocks\n";
+        return 2;
+    }
+
+    if (cfg.batch > MAX_BATCH)
+    {
+        std::cerr << "ERROR: --batch must not exceed " << MAX_BATCH << "\n";
+        return 2;
+    }
+
+    if (cfg.programKey)
+    {
+        Worker w(cfg, 0);
+        if (!w.Open()) return 1;
+        if (!w.ProgramKey())
+        {
+            std::cerr << "ERROR: PROGRAM_KEY failed (key already programmed?)\n";
+            return 1;
+        }
+    }
+
+    Stats total;
+    bool ok = true;
+    const uint64_t t0 = RpmbMonotonicNs();
+
+    if (cfg.procs == 1)
+    {
+        ok = runThreads(cfg, 1, total);
+    }
+    else
+    {
+        std::vector<std::pair<pid_t, int>> children;
+        for (uint32_t p = 0; p < cfg.procs; ++p)
+        {
+            int fds[2];
+            if (pipe(fds) != 0)
+            {
+                std::cerr << "ERROR: pipe: " << std::strerror(errno) << "\n";
+                ok = false;
+                break;
+            }
+            pid_t pid = fork();
+            if (pid == 0)
+            {
+                close(fds[0]);
+                Stats st;
+                bool cok = runThreads(cfg, 1 + uint64_t(p) * cfg.threads, st);
+                cok = sendStats(fds[1], st) && cok;
+                _exit(cok ? 0 : 1);
+            }
+            close(fds[1]);
+            if (pid < 0)
+            {
+                std::cerr << "ERROR: fork: " << std::strerror(errno) << "\n";
+                close(fds[0]);
+                ok = false;
+                break;
+            }
+            children.emplace_back(pid, fds[0]);
+        }
+
+        for (auto& c : children)
+        {
+            Stats st;
+            if (recvStats(c.second, st)) total.Merge(st);
+            else ok = false;
+            close(c.second);
+
+            int status = 0;
+            waitpid(c.first, &status, 0);
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) ok = false;
+        }
+    }
+
+    const double secs = double(RpmbMonotonicNs() - t0) / 1e9;
+    report(cfg, total, secs);
+
+    uint64_t errors = 0;
+    for (int i = 0; i < OP_COUNT; ++i) errors += total.Errors(i);
+    return (!ok || errors) ? 1 : 0;
+}
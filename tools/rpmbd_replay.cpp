@@ -0,0 +1,292 @@
+// Replays a trace recorded with `rpmbd --trace` against the core, without
+// CUSE, and compares every CMD18 response with the recorded one.
+
+#include "Rpmbd.h"
+#include "RpmbTrace.h"
+#include "RpmbSha256.h"
+#include "RpmbLog.h"
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <algorithm>
+#include <filesystem>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <unistd.h>
+
+static void usage(const char* prog)
+{
+    std::cerr
+        << "Usage: " << prog << " --trace <path> [options]\n"
+        << "\nOptions:\n"
+        << "  -t, --trace <path>        Trace written by rpmbd --trace\n"
+        << "      --state <path>        Initial state file (default: <trace>.state if present,\n"
+        << "                            otherwise a fresh device)\n"
+        << "      --timing <mode>       max | original (default: max)\n"
+        << "                              max:      run chains back to back\n"
+        << "                              original: keep the recorded arrival times\n"
+        << "      --no-compare          Do not compare responses\n"
+        << "      --max-blocks <n>      RPMB size in blocks (default: that of the recording\n"
+        << "                            rpmbd, stored in the trace)\n"
+        << "      --storage <mode>      buffered | mmap (default: buffered)\n"
+        << "      --durability <mode>   strict | group | volatile (default: strict)\n"
+        << "      --mac-cache           Cache per-block MAC state for repeated reads\n"
+        << "      --crypto <backend>    auto | openssl | scalar | shani | avx2 (default: auto)\n"
+        << "      --log-level <level>   off | error | info | debug | trace (default: error)\n"
+        << "  -h, --help                Show this help\n"
+        << "\nThe state is replayed on a temporary copy; the snapshot is not modified.\n";
+}
+
+static void sleepUntil(uint64_t ns)
+{
+    struct timespec ts;
+    ts.tv_sec = time_t(ns / 1000000000ull);
+    ts.tv_nsec = long(ns % 1000000000ull);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR) {}
+}
+
+static double percentileUs(std::vector<uint64_t>& v, double p)
+{
+    if (v.empty()) return 0.0;
+    size_t i = size_t(p * double(v.size() - 1) + 0.5);
+    std::nth_element(v.begin(), v.begin() + i, v.end());
+    return double(v[i]) / 1000.0;
+}
+
+int main(int argc, char** argv)
+{
+    std::string tracePath;
+    std::string statePath;
+    bool originalTiming = false;
+    bool compare = true;
+    std::string logLevelName;
+    bool maxBlocksSet = false;
+    Rpmbd::Options ro;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string a = argv[i];
+
+        if ((a == "--trace" || a == "-t") && i + 1 < argc)
+        {
+            tracePath = argv[++i];
+        }
+        else if (a == "--state" && i + 1 < argc)
+        {
+            statePath = argv[++i];
+        }
+        else if (a == "--timing" && i + 1 < argc)
+        {
+            std::string m = argv[++i];
+            if (m == "max")
+                originalTiming = false;
+            else if (m == "original")
+                originalTiming = true;
+            else
+            {
+                std::cerr << "ERROR: Unknown timing mode: " << m << "\n";
+                return 2;
+            }
+        }
+        else if (a == "--no-compare")
+        {
+            compare = false;
+        }
+        else if (a == "--storage" && i + 1 < argc)
+        {
+            std::string m = argv[++i];
+            if (m == "buffered")
+                ro.storage = RpmbStateFile::Mode::Buffered;
+            else if (m == "mmap")
+                ro.storage = RpmbStateFile::Mode::Mmap;
+            else
+            {
+                std::cerr << "ERROR: Unknown storage mode: " << m << "\n";
+                return 2;
+            }
+        }
+        else if (a == "--durability" && i + 1 < argc)
+        {
+            std::string m = argv[++i];
+            if (m == "strict")
+                ro.durability = RpmbStateFile::Durability::Strict;
+            else if (m == "group")
+                ro.durability = RpmbStateFile::Durability::Group;
+            else if (m == "volatile")
+                ro.durability = RpmbStateFile::Durability::Volatile;
+            else
+            {
+                std::cerr << "ERROR: Unknown durability mode: " << m << "\n";
+                return 2;
+            }
+        }
+        else if (a == "--max-blocks" && i + 1 < argc)
+        {
+            char* end = nullptr;
+            unsigned long v = std::strtoul(argv[++i], &end, 10);
+            if (*end != '\0' || v == 0 || v > RpmbStateFile::MAX_BLOCKS)
+            {
+                std::cerr << "ERROR: Invalid --max-blocks: " << argv[i] << "\n";
+                return 2;
+            }
+            ro.maxBlocks = uint32_t(v);
+            maxBlocksSet = true;
+        }
+        else if (a == "--mac-cache")
+        {
+            ro.macCache = true;
+        }
+        else if (a == "--crypto" && i + 1 < argc)
+        {
+            ro.crypto = argv[++i];
+            if (!RpmbShaFind(ro.crypto))
+            {
+                std::cerr << "ERROR: Crypto backend not available on this CPU: " << ro.crypto << "\n";
+                return 2;
+            }
+        }
+        else if (a == "--log-level" && i + 1 < argc)
+        {
+            logLevelName = argv[++i];
+        }
+        else if (a == "--help" || a == "-h")
+        {
+            usage(argv[0]);
+            return 0;
+        }
+        else
+        {
+            std::cerr << "ERROR: Unknown argument: " << a << "\n";
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    if (tracePath.empty())
+    {
+        usage(argv[0]);
+        return 2;
+    }
+
+    RpmbLog::Level logLevel = RpmbLog::Error;
+    if (!logLevelName.empty() && !RpmbLog::ParseLevel(logLevelName, logLevel))
+    {
+        std::cerr << "ERROR: Unknown log level: " << logLevelName << "\n";
+        return 2;
+    }
+    RpmbLog::SetLevel(logLevel);
+
+    RpmbTraceReader reader;
+    if (!reader.Open(tracePath))
+    {
+        std::cerr << "ERROR: Not an rpmbd trace: " << tracePath << "\n";
+        return 2;
+    }
+
+    const uint32_t traceBlocks = reader.MaxBlocks();
+    if (!maxBlocksSet && traceBlocks >= 1 && traceBlocks <= RpmbStateFile::MAX_BLOCKS)
+        ro.maxBlocks = traceBlocks;
+    else if (maxBlocksSet && traceBlocks && traceBlocks != ro.maxBlocks)
+        std::cout << "[rpmbd_replay] warning: trace was recorded with --max-blocks " << traceBlocks
+                  << ", replaying with " << ro.maxBlocks << "\n";
+
+    // --- working copy of the initial state ---
+    namespace fs = std::filesystem;
+    if (statePath.empty() && fs::exists(tracePath + ".state"))
+        statePath = tracePath + ".state";
+
+    char tmpl[] = "/tmp/rpmbd_replay.XXXXXX";
+    if (!mkdtemp(tmpl))
+    {
+        std::cerr << "ERROR: Cannot create work directory: " << std::strerror(errno) << "\n";
+        return 2;
+    }
+    const std::string workDir = tmpl;
+    ro.stateFile = workDir + "/rpmb_state.bin";
+
+    std::error_code ec;
+    if (!statePath.empty())
+    {
+        fs::copy_file(statePath, ro.stateFile, ec);
+        if (!ec && fs::exists(statePath + ".journal"))
+            fs::copy_file(statePath + ".journal", ro.stateFile + ".journal", ec);
+        if (ec)
+        {
+            std::cerr << "ERROR: Cannot copy state " << statePath << ": " << ec.message() << "\n";
+            fs::remove_all(workDir, ec);
+            return 2;
+        }
+    }
+
+    RpmbLog::Start();
+
+    uint64_t chains = 0, mismatches = 0;
+    std::vector<uint64_t> lat;
+    uint64_t wallNs = 0;
+    {
+        Rpmbd core(ro);
+        std::map<uint32_t, std::unique_ptr<Rpmbd::Session>> sessions;
+
+        std::cout
+            << "[rpmbd_replay] trace:  " << tracePath << "\n"
+            << "[rpmbd_replay] state:  " << (statePath.empty() ? "<fresh>" : statePath) << "\n"
+            << "[rpmbd_replay] timing: " << (originalTiming ? "original" : "max") << "\n"
+            << "[rpmbd_replay] crypto: " << RpmbMacKey::Backend().name << "\n";
+        std::cout.flush();
+
+        RpmbTraceRecord rec;
+        std::vector<uint8_t> out;
+        const uint64_t t0 = RpmbMonotonicNs();
+
+        while (reader.Next(rec))
+        {
+            std::unique_ptr<Rpmbd::Session>& s = sessions[rec.session];
+            if (!s) s.reset(new Rpmbd::Session());
+
+            if (originalTiming)
+                sleepUntil(t0 + rec.tsNs);
+
+            out.assign(rec.out.size(), 0);
+            const uint64_t start = RpmbMonotonicNs();
+            core.ExecuteChain(*s, rec.cmds.data(), rec.cmds.size(), rec.in.data(), out.data());
+            lat.push_back(RpmbMonotonicNs() - start);
+
+            if (compare && out != rec.out)
+            {
+                size_t off = 0;
+                while (out[off] == rec.out[off]) ++off;
+                if (mismatches < 10)
+                    std::cout << "[rpmbd_replay] MISMATCH chain #" << chains
+                              << " session=" << rec.session
+                              << " frame=" << off / 512 << " byte=" << off % 512 << "\n";
+                ++mismatches;
+            }
+            ++chains;
+        }
+        wallNs = RpmbMonotonicNs() - t0;
+    }
+
+    RpmbLog::Stop();
+    fs::remove_all(workDir, ec);
+
+    if (reader.Truncated())
+        std::cout << "[rpmbd_replay] warning: trace ends with a truncated record\n";
+
+    const double secs = double(wallNs) / 1e9;
+    char line[256];
+    std::snprintf(line, sizeof(line),
+                  "[rpmbd_replay] chains=%llu mismatches=%llu elapsed=%.3fs rate=%.0f/s\n"
+                  "[rpmbd_replay] latency us: p50=%.1f p99=%.1f max=%.1f\n",
+                  (unsigned long long)chains, (unsigned long long)mismatches,
+                  secs, secs > 0 ? double(chains) / secs : 0.0,
+                  percentileUs(lat, 0.50), percentileUs(lat, 0.99), percentileUs(lat, 1.0));
+    std::cout << line;
+
+    return mismatches ? 1 : 0;
+}